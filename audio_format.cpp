@@ -0,0 +1,53 @@
+#include <cstdlib>
+#include "audio_format.h"
+
+
+static const char * sample_names[SAMPLE_TYPE_COUNT] = {"s16", "f32"};
+static const size_t sample_sizes[SAMPLE_TYPE_COUNT] = {2, 4};
+
+size_t AudioFormat::sample_size() const {
+    return sample_sizes[sample];
+}
+
+size_t AudioFormat::bytes_per(unsigned long ms) const {
+    return frame_size() * ((size_t) rate * ms / 1000);
+}
+
+bool AudioFormat::operator==(const AudioFormat & other) const {
+    return rate == other.rate && sample == other.sample && channels == other.channels;
+}
+
+string audio_format_name(const AudioFormat & format) {
+    return std::to_string(format.rate) + ":" + sample_names[format.sample]
+           + ":" + std::to_string(format.channels);
+}
+
+bool parse_audio_format(const string & name, AudioFormat & format) {
+    size_t first = name.find(':');
+    size_t second = first == string::npos ? string::npos : name.find(':', first + 1);
+    if (second == string::npos) {
+        return false;
+    }
+
+    char * end;
+    string rate = name.substr(0, first);
+    unsigned long rate_value = strtoul(rate.c_str(), &end, 10);
+    if (rate.empty() || *end != '\0' || rate_value < 1000 || rate_value > 192000) {
+        return false;
+    }
+    string channels = name.substr(second + 1);
+    unsigned long channels_value = strtoul(channels.c_str(), &end, 10);
+    if (channels.empty() || *end != '\0' || channels_value < 1 || channels_value > MAX_CHANNELS) {
+        return false;
+    }
+    string sample = name.substr(first + 1, second - first - 1);
+    for (int i = 0; i < SAMPLE_TYPE_COUNT; ++i) {
+        if (sample == sample_names[i]) {
+            format.rate = rate_value;
+            format.sample = (sample_type_t) i;
+            format.channels = channels_value;
+            return true;
+        }
+    }
+    return false;
+}
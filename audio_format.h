@@ -0,0 +1,40 @@
+#ifndef __audio_format_h_
+#define __audio_format_h_
+
+#include <cstddef>
+#include <string>
+
+using std::string;
+
+/* Layout of the raw PCM clients upload and get back: interleaved frames
+ * of `channels` samples. A room mixes in one format only; the server's is
+ * the default, a client may ask for another in its CLIENT message. */
+enum sample_type_t { SAMPLE_S16, SAMPLE_F32, SAMPLE_TYPE_COUNT };
+
+const unsigned MAX_CHANNELS = 2;
+
+struct AudioFormat {
+    unsigned rate;          // frames per second
+    sample_type_t sample;
+    unsigned channels;      // 1 or 2
+
+    size_t sample_size() const;
+    size_t frame_size() const { return channels * sample_size(); }
+
+    /* Whole frames in `ms` of audio, rounded down */
+    size_t bytes_per(unsigned long ms) const;
+    size_t bytes_per_ms() const { return bytes_per(1); }
+
+    bool operator==(const AudioFormat & other) const;
+    bool operator!=(const AudioFormat & other) const { return !(*this == other); }
+};
+
+/* 44.1 kHz 16-bit stereo -- 176 bytes per ms, what sox sends with
+ * -r 44100 -b 16 -e signed-integer -c 2 */
+const AudioFormat DEFAULT_AUDIO_FORMAT = {44100, SAMPLE_S16, 2};
+
+/* As "rate:sample:channels", e.g. "48000:f32:1" */
+string audio_format_name(const AudioFormat &);
+bool parse_audio_format(const string &, AudioFormat &);
+
+#endif
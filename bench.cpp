@@ -0,0 +1,606 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <exception>
+#include <map>
+#include <new>
+#include <sstream>
+#include <vector>
+#include <boost/program_options.hpp>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include "server_params.h"
+#include "server.h"
+#include "session.h"
+#include "mixer.h"
+#include "mix_pool.h"
+#include "server_clock.h"
+
+namespace asio = boost::asio;
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+using std::map;
+using std::make_shared;
+using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
+
+typedef std::chrono::steady_clock bench_clock;
+
+const string DEFAULT_SESSIONS = "1,10,100,500";
+const string DEFAULT_UDP_SESSIONS = "10,100,500";
+const size_t DEFAULT_TICKS = 2000;
+const size_t DEFAULT_ITERATIONS = 100000;
+const size_t WARMUP_TICKS = 50;
+
+
+/* ALLOCATION COUNTING -- every operator new in the process */
+
+static std::atomic<uint64_t> allocations(0);
+static std::atomic<uint64_t> allocated_bytes(0);
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+struct Measurement {
+    Measurement()
+        : started(bench_clock::now()),
+          allocs(allocations.load(std::memory_order_relaxed)),
+          bytes(allocated_bytes.load(std::memory_order_relaxed)) {}
+
+    double ns() const {
+        return std::chrono::duration<double, std::nano>(bench_clock::now() - started).count();
+    }
+    uint64_t allocs_since() const {
+        return allocations.load(std::memory_order_relaxed) - allocs;
+    }
+    uint64_t bytes_since() const {
+        return allocated_bytes.load(std::memory_order_relaxed) - bytes;
+    }
+
+    bench_clock::time_point started;
+    uint64_t allocs;
+    uint64_t bytes;
+};
+
+/* One JSON object per line, so runs can be diffed and plotted */
+static void report(const string & bench, const vector<std::pair<string, double>> & fields) {
+    std::ostringstream line;
+    line << "{\"bench\":\"" << bench << "\"";
+    for (auto it = fields.begin(); it != fields.end(); ++it) {
+        line << ",\"" << it->first << "\":" << it->second;
+    }
+    line << "}";
+    cout << line.str() << endl;
+}
+
+static ServerParams bench_params(size_t loudest = DEFAULT_LOUDEST) {
+    ServerParams params;
+    params.port = 0; // ephemeral; only the UDP pipelines send through the sockets
+    params.fifo_size = DEFAULT_FIFO_SIZE;
+    params.fifo_low_watermark = DEFAULT_FIFO_LOW_WATERMARK;
+    params.fifo_high_watermark = DEFAULT_FIFO_SIZE;
+    params.buf_len = DEFAULT_BUF_LEN;
+    params.tx_interval = DEFAULT_TX_INTERVAL;
+    params.ack_delay = DEFAULT_ACK_DELAY;
+    params.udp_timeout = DEFAULT_UDP_TIMEOUT;
+    params.report_backlog = DEFAULT_REPORT_BACKLOG;
+    params.report_interval = DEFAULT_REPORT_INTERVAL;
+    params.stats_port = 0;
+    params.workers = 1;
+    params.udp_backend = UDP_BACKEND_EPOLL;
+    params.resume_grace = DEFAULT_RESUME_GRACE;
+    params.loudest = loudest;
+    params.mix_threads = 0;
+    params.format = DEFAULT_AUDIO_FORMAT;
+    params.agc = DEFAULT_AGC;
+    params.record_inputs = false;
+    params.parent_port = 0;
+    params.cascade_room = DEFAULT_CASCADE_ROOM;
+    params.multicast_port = 0;
+    return params;
+}
+
+static size_t chunk_size(const ServerParams & params) {
+    return params.format.bytes_per(params.tx_interval);
+}
+
+
+/* FULL PIPELINE */
+
+/* The client side of the in-memory transport: what each endpoint was
+ * last told about its ack and window. */
+class BenchTransport {
+public:
+    struct Peer {
+        Peer() : ack(0), win(0) {}
+        uint32_t ack;
+        uint32_t win;
+    };
+
+    BenchTransport() : datagrams(0), bytes(0) {}
+
+    bool take(const udp::endpoint & endpoint, const string & header, const string & payload) {
+        ++datagrams;
+        bytes += header.size() + payload.size();
+        Peer & peer = peers[endpoint];
+        uint32_t nr;
+        if (sscanf(header.c_str(), "DATA %u %u %u", &nr, &peer.ack, &peer.win) != 3) {
+            sscanf(header.c_str(), "ACK %u %u", &peer.ack, &peer.win);
+        }
+        return true;
+    }
+
+    map<udp::endpoint, Peer> peers;
+    uint64_t datagrams;
+    uint64_t bytes;
+};
+
+static ServerParams udp_params(size_t loudest, udp_backend_t backend) {
+    ServerParams params = bench_params(loudest);
+    params.udp_backend = backend;
+    return params;
+}
+
+/* Sessions get a real TCP connection for the CLIENT greeting and their
+ * reports; all UDP goes through process_datagram and the sink. Time is
+ * frozen and stepped one tx_interval per tick, so every tick runs exactly
+ * one mix_and_send per room.
+ *
+ * Over UDP, each session is a socket on [::1] instead and what the server
+ * sends through the backend is read back from them after the tick. */
+class Pipeline {
+public:
+    Pipeline(size_t sessions, size_t loudest = DEFAULT_LOUDEST, bool _over_udp = false,
+             udp_backend_t backend = UDP_BACKEND_EPOLL)
+        : over_udp(_over_udp),
+          params(udp_params(loudest, backend)),
+          server(params, io_service),
+          nudge_timer(io_service),
+          acceptor(io_service, tcp::endpoint(asio::ip::address_v4::loopback(), 0)),
+          bytes_in(0)
+    {
+        if (!over_udp) {
+            server.set_datagram_sink(boost::bind(&BenchTransport::take, &transport, _1, _2, _3));
+        }
+        for (size_t i = 0; i < sessions; ++i) {
+            if (!over_udp) {
+                connect(udp::endpoint(asio::ip::address_v4(0x0a000000 + i), 10000));
+                continue;
+            }
+            auto socket_p = make_shared<udp::socket>(
+                io_service, udp::endpoint(asio::ip::address_v6::loopback(), 0));
+            peer_sockets.push_back(socket_p);
+            connect(socket_p->local_endpoint());
+        }
+        io_service.poll();
+        receive_from_server();
+
+        chunk.assign(chunk_size(params), 0);
+        for (size_t i = 0; i < chunk.size(); ++i) {
+            chunk[i] = (char) (i * 7);
+        }
+    }
+
+    void tick() {
+        for (auto it = transport.peers.begin(); it != transport.peers.end(); ++it) {
+            if (it->second.win < chunk.size()) {
+                continue;
+            }
+            int header = snprintf(datagram, sizeof(datagram), "UPLOAD %u\n", it->second.ack);
+            memcpy(datagram + header, chunk.data(), chunk.size());
+            server.process_datagram(it->first, datagram, header + chunk.size());
+            bytes_in += header + chunk.size();
+        }
+        step_clock();
+        io_service.poll();
+        receive_from_server();
+    }
+
+    void receive_from_server() {
+        for (auto it = peer_sockets.begin(); it != peer_sockets.end(); ++it) {
+            const udp::endpoint & endpoint = (*it)->local_endpoint();
+            ssize_t n;
+            while ((n = ::recv((*it)->native_handle(), datagram, sizeof(datagram), MSG_DONTWAIT)) >= 0) {
+                received.assign(datagram, n);
+                transport.take(endpoint, received, string());
+            }
+        }
+    }
+
+    /* asio waits for timers on a timerfd armed in real time. A timer that
+     * is already overdue becomes the earliest one, which re-arms the
+     * timerfd to fire at once, so the next poll runs every timer due by
+     * the frozen clock. */
+    void step_clock() {
+        server_clock_traits::advance(boost::posix_time::milliseconds(params.tx_interval));
+        nudge_timer.expires_at(server_clock_traits::now() - boost::posix_time::microseconds(1));
+        nudge_timer.async_wait(boost::bind(&Pipeline::nudged, asio::placeholders::error));
+    }
+
+    static void nudged(const boost::system::error_code &) {}
+
+    void run(size_t ticks) {
+        for (size_t i = 0; i < WARMUP_TICKS; ++i) {
+            tick();
+        }
+        uint64_t datagrams = transport.datagrams;
+        uint64_t bytes = transport.bytes;
+        uint64_t bytes_in_before = bytes_in;
+        uint64_t send_calls = over_udp ? stat("eognisko_udp_send_calls_total ") : 0;
+        Measurement measurement;
+        for (size_t i = 0; i < ticks; ++i) {
+            tick();
+        }
+        double ns = measurement.ns();
+        size_t sessions = transport.peers.size();
+        if (over_udp) {
+            report_udp(ticks, ns, datagrams, send_calls);
+            return;
+        }
+        report("pipeline", {
+            {"sessions", sessions},
+            {"loudest", params.loudest},
+            {"ticks", ticks},
+            {"ticks_per_s", ticks / (ns / 1e9)},
+            {"ns_per_tick", ns / ticks},
+            {"ns_per_session_tick", ns / ticks / std::max(sessions, (size_t) 1)},
+            {"allocs_per_tick", (double) measurement.allocs_since() / ticks},
+            {"alloc_bytes_per_tick", (double) measurement.bytes_since() / ticks},
+            {"bytes_in_per_tick", (double) (bytes_in - bytes_in_before) / ticks},
+            {"datagrams_out_per_tick", (double) (transport.datagrams - datagrams) / ticks},
+            {"bytes_out_per_tick", (double) (transport.bytes - bytes) / ticks}
+        });
+    }
+
+    /* Sending alone is what differs between the backends: the uploads
+     * are fed in as elsewhere */
+    void report_udp(size_t ticks, double ns, uint64_t datagrams_before, uint64_t send_calls_before) {
+        static const char * names[] = {"udp_epoll", "udp_sendmmsg", "udp_uring"};
+        uint64_t send_calls = stat("eognisko_udp_send_calls_total ") - send_calls_before;
+        size_t sessions = transport.peers.size();
+        report(names[params.udp_backend], {
+            {"sessions", sessions},
+            {"ticks", ticks},
+            {"ticks_per_s", ticks / (ns / 1e9)},
+            {"ns_per_tick", ns / ticks},
+            {"ns_per_session_tick", ns / ticks / std::max(sessions, (size_t) 1)},
+            {"datagrams_out_per_tick", (double) (transport.datagrams - datagrams_before) / ticks},
+            {"send_calls_per_tick", (double) send_calls / ticks},
+            {"send_drops", stat("eognisko_udp_send_drops_total ")}
+        });
+    }
+
+    /* A counter off the server's Prometheus page */
+    uint64_t stat(const string & name) {
+        string stats = server.render_stats();
+        size_t pos = stats.find("\n" + name);
+        return pos == string::npos ? 0 : std::stoull(stats.substr(pos + name.size() + 1));
+    }
+
+    /* The same datagram over and over from the first session */
+    void run_datagram(const string & name, const string & datagram, size_t iterations) {
+        const udp::endpoint & endpoint = transport.peers.begin()->first;
+        Measurement measurement;
+        for (size_t i = 0; i < iterations; ++i) {
+            server.process_datagram(endpoint, datagram.data(), datagram.size());
+        }
+        double ns = measurement.ns();
+        io_service.poll();
+        report(name, {
+            {"iterations", iterations},
+            {"ns_per_call", ns / iterations},
+            {"allocs_per_call", (double) measurement.allocs_since() / iterations}
+        });
+    }
+
+private:
+    void connect(const udp::endpoint & endpoint) {
+        auto client_p = make_shared<tcp::socket>(io_service);
+        auto accepted_p = make_shared<tcp::socket>(io_service);
+        client_p->connect(acceptor.local_endpoint());
+        acceptor.accept(*accepted_p);
+        server.handle_accept_tcp(boost::system::error_code(), accepted_p);
+        io_service.poll();
+
+        asio::streambuf greeting;
+        asio::read_until(*client_p, greeting, "\n");
+        std::istream stream(&greeting);
+        string command;
+        uint32_t id;
+        stream >> command >> id;
+        clients.push_back(client_p);
+
+        string message = "CLIENT " + std::to_string(id) + " report=self\n";
+        server.process_datagram(endpoint, message.data(), message.size());
+        transport.peers[endpoint];
+    }
+
+    bool over_udp;
+    asio::io_service io_service;
+    ServerParams params;
+    Server server;
+    server_timer nudge_timer;
+    BenchTransport transport;
+    tcp::acceptor acceptor;
+    vector<std::shared_ptr<tcp::socket>> clients;
+    vector<std::shared_ptr<udp::socket>> peer_sockets;
+    string chunk;
+    string received;
+    char datagram[RECV_BUF_LEN];
+    uint64_t bytes_in;
+};
+
+
+/* MICROBENCHMARKS */
+
+/* Input i of a mixer benchmark: a sawtooth, well inside full scale */
+static string test_signal(const AudioFormat & format, size_t bytes, size_t i) {
+    string signal(bytes, 0);
+    size_t samples = bytes / format.sample_size();
+    for (size_t j = 0; j < samples; ++j) {
+        int16_t value = (int16_t) ((i * 31 + j * 7) % 4096) - 2048;
+        if (format.sample == SAMPLE_F32) {
+            float sample = value / 32768.0f;
+            memcpy(&signal[j * sizeof(sample)], &sample, sizeof(sample));
+        } else {
+            memcpy(&signal[j * sizeof(value)], &value, sizeof(value));
+        }
+    }
+    return signal;
+}
+
+static void bench_mixer(size_t inputs_count, const AudioFormat & format, size_t iterations,
+                        bool metered = false) {
+    ServerParams params = bench_params();
+    params.format = format;
+    vector<string> buffers(inputs_count);
+    for (size_t i = 0; i < inputs_count; ++i) {
+        buffers[i] = test_signal(format, chunk_size(params), i);
+    }
+    vector<mixer_input> inputs(inputs_count);
+    vector<mixer_meter> meters(inputs_count);
+    string output(chunk_size(params), 0);
+
+    Measurement measurement;
+    for (size_t n = 0; n < iterations; ++n) {
+        for (size_t i = 0; i < inputs_count; ++i) {
+            inputs[i].data = (void*) buffers[i].data();
+            inputs[i].len = buffers[i].size();
+            inputs[i].consumed = 0;
+            inputs[i].gain = 1;
+            inputs[i].meter = metered ? &meters[i] : nullptr;
+        }
+        size_t output_size = output.size();
+        mixer(inputs.data(), inputs.size(), &output[0], &output_size, params.tx_interval, format);
+    }
+    double ns = measurement.ns();
+    report("mixer", {
+        {"inputs", inputs_count},
+        {"metered", metered},
+        {"rate", format.rate},
+        {"sample_size", format.sample_size()},
+        {"channels", format.channels},
+        {"iterations", iterations},
+        {"ns_per_call", ns / iterations},
+        {"ns_per_input", ns / iterations / inputs_count},
+        {"allocs_per_call", (double) measurement.allocs_since() / iterations}
+    });
+}
+
+/* Scaling of the pool over thread counts, against the serial mixer() on
+ * the same inputs; identical is 1 when the outputs match byte for byte. */
+static void bench_mix_pool(size_t inputs_count, unsigned long tx_interval,
+                           size_t max_threads, size_t iterations) {
+    size_t bytes = DEFAULT_AUDIO_FORMAT.bytes_per(tx_interval);
+    vector<string> buffers(inputs_count);
+    for (size_t i = 0; i < inputs_count; ++i) {
+        buffers[i] = test_signal(DEFAULT_AUDIO_FORMAT, bytes, i);
+    }
+    vector<mixer_input> inputs(inputs_count);
+    auto reset = [&]() {
+        for (size_t i = 0; i < inputs_count; ++i) {
+            inputs[i].data = (void*) buffers[i].data();
+            inputs[i].len = buffers[i].size();
+            inputs[i].gain = 1;
+        }
+    };
+    string serial(bytes, 0), parallel(bytes, 0);
+
+    reset();
+    size_t serial_size = bytes;
+    Measurement serial_measurement;
+    for (size_t n = 0; n < iterations; ++n) {
+        serial_size = bytes;
+        mixer(inputs.data(), inputs.size(), &serial[0], &serial_size, tx_interval);
+    }
+    double serial_ns = serial_measurement.ns();
+
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+        MixPool pool(threads);
+        reset();
+        size_t parallel_size = bytes;
+        Measurement measurement;
+        for (size_t n = 0; n < iterations; ++n) {
+            parallel_size = bytes;
+            pool.mix(inputs.data(), inputs.size(), &parallel[0], &parallel_size, tx_interval);
+        }
+        double ns = measurement.ns();
+        report("mix_pool", {
+            {"inputs", inputs_count},
+            {"tx_interval", tx_interval},
+            {"threads", threads},
+            {"iterations", iterations},
+            {"ns_per_call", ns / iterations},
+            {"speedup", serial_ns / ns},
+            {"identical", serial_size == parallel_size && serial == parallel},
+            {"allocs_per_call", (double) measurement.allocs_since() / iterations}
+        });
+    }
+}
+
+/* Timed in batches: a full FIFO is consumed a tick at a time */
+static void bench_consume(size_t iterations) {
+    asio::io_service io_service;
+    ServerParams params = bench_params();
+    ServerStats stats;
+    Session session(0, params, stats, make_shared<tcp::socket>(io_service));
+    string chunk(chunk_size(params), 1);
+    size_t per_batch = params.fifo_size / chunk.size();
+
+    double ns = 0;
+    uint64_t allocs = 0;
+    size_t done = 0;
+    while (done < iterations) {
+        for (size_t i = 0; i < per_batch; ++i) {
+            session.upload(chunk);
+        }
+        Measurement measurement;
+        for (size_t i = 0; i < per_batch; ++i) {
+            session.consume(chunk.size());
+        }
+        ns += measurement.ns();
+        allocs += measurement.allocs_since();
+        done += per_batch;
+    }
+    report("session_consume", {
+        {"bytes", chunk.size()},
+        {"iterations", done},
+        {"ns_per_call", ns / done},
+        {"allocs_per_call", (double) allocs / done}
+    });
+}
+
+/* Header parsing as the server does it, on datagrams that do little else:
+ * KEEPALIVE only refreshes liveness, and a repeated CLIENT is ignored. */
+static void bench_parsers(size_t iterations) {
+    Pipeline pipeline(1);
+    pipeline.run_datagram("parse_keepalive", "KEEPALIVE\n", iterations);
+    pipeline.run_datagram("parse_client", "CLIENT 0 report=self\n", iterations);
+
+    asio::io_service io_service;
+    ServerParams params = bench_params();
+    ServerStats stats;
+    Session session(0, params, stats, make_shared<tcp::socket>(io_service));
+    Measurement measurement;
+    size_t total = 0;
+    for (size_t i = 0; i < iterations; ++i) {
+        total += session.get_datagram_header(i).size();
+    }
+    double ns = measurement.ns();
+    report("build_data_header", {
+        {"iterations", iterations},
+        {"ns_per_call", ns / iterations},
+        {"allocs_per_call", (double) measurement.allocs_since() / iterations},
+        {"bytes", (double) total / iterations}
+    });
+}
+
+static vector<size_t> parse_list(const string & list) {
+    vector<size_t> values;
+    std::istringstream stream(list);
+    string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) {
+            values.push_back(std::stoul(item));
+        }
+    }
+    return values;
+}
+
+int main(int argc, char** argv) {
+
+try {
+    namespace po = boost::program_options;
+
+    string sessions, udp_sessions;
+    size_t ticks, iterations, loudest;
+    po::options_description desc("Options");
+    desc.add_options()
+        ("help,h", "")
+        ("sessions,n", po::value<string>(&sessions)->default_value(DEFAULT_SESSIONS),
+         "comma-separated session counts for the pipeline benchmark")
+        ("ticks,t", po::value<size_t>(&ticks)->default_value(DEFAULT_TICKS),
+         "mixing ticks per pipeline run")
+        ("loudest", po::value<size_t>(&loudest)->default_value(DEFAULT_LOUDEST),
+         "server's --loudest for the pipeline benchmark")
+        ("udp_sessions", po::value<string>(&udp_sessions)->default_value(DEFAULT_UDP_SESSIONS),
+         "session counts for the pipeline over real UDP, once per --udp_backend")
+        ("iterations,i", po::value<size_t>(&iterations)->default_value(DEFAULT_ITERATIONS),
+         "calls per microbenchmark")
+    ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help")) {
+        cout << "E-ognisko -- benchmarks, one JSON object per line" << endl << desc << endl;
+        return 0;
+    }
+
+    server_clock_traits::freeze();
+
+    const size_t mixer_inputs[] = {1, 8, 64};
+    for (size_t i = 0; i < sizeof(mixer_inputs) / sizeof(mixer_inputs[0]); ++i) {
+        bench_mixer(mixer_inputs[i], DEFAULT_AUDIO_FORMAT, iterations / mixer_inputs[i] + 1);
+        bench_mixer(mixer_inputs[i], DEFAULT_AUDIO_FORMAT, iterations / mixer_inputs[i] + 1, true);
+    }
+    const char * mixer_formats[] = {"48000:s16:1", "48000:s16:2", "48000:f32:1", "48000:f32:2"};
+    for (size_t i = 0; i < sizeof(mixer_formats) / sizeof(mixer_formats[0]); ++i) {
+        AudioFormat format;
+        parse_audio_format(mixer_formats[i], format);
+        bench_mixer(8, format, iterations / 8 + 1);
+    }
+    size_t max_threads = std::max(std::thread::hardware_concurrency(), 2u);
+    const size_t pool_inputs[] = {8, 64, 256};
+    const unsigned long pool_intervals[] = {5, 50};
+    for (size_t i = 0; i < sizeof(pool_inputs) / sizeof(pool_inputs[0]); ++i) {
+        for (size_t j = 0; j < sizeof(pool_intervals) / sizeof(pool_intervals[0]); ++j) {
+            bench_mix_pool(pool_inputs[i], pool_intervals[j], max_threads,
+                           iterations / pool_inputs[i] / pool_intervals[j] + 1);
+        }
+    }
+    bench_consume(iterations);
+    bench_parsers(iterations);
+
+    vector<size_t> counts = parse_list(sessions);
+    for (auto it = counts.begin(); it != counts.end(); ++it) {
+        Pipeline pipeline(*it, loudest);
+        pipeline.run(ticks);
+    }
+    counts = parse_list(udp_sessions);
+    const udp_backend_t backends[] = {UDP_BACKEND_EPOLL, UDP_BACKEND_SENDMMSG, UDP_BACKEND_URING};
+    for (auto it = counts.begin(); it != counts.end(); ++it) {
+        for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); ++i) {
+            Pipeline pipeline(*it, loudest, true, backends[i]);
+            pipeline.run(ticks);
+        }
+    }
+} catch (std::exception &e) {
+    cout << e.what() << endl;
+    return 1;
+}
+
+    return 0;
+}
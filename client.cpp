@@ -2,6 +2,9 @@
 #include <iostream>
 #include <exception>
 #include "client.h"
+#include "logger.h"
+#include "downstream_format.h"
+#include "latency.h"
 #include <assert.h>
 
 
@@ -9,9 +12,7 @@ namespace asio = boost::asio;
 
 using std::istringstream;
 using std::stringstream;
-using std::cerr;
 using std::cout;
-using std::endl;
 using std::getline;
 using std::move;
 using std::make_shared;
@@ -22,67 +23,108 @@ using boost::posix_time::seconds;
 using boost::posix_time::milliseconds;
 
 
-Client::Client(ClientParams _params, asio::io_service & _io_service)
+Client::Client(ClientParams _params, asio::io_service & _io_service,
+               const ClientResumeState & state)
     : params(_params),
       io_service(_io_service),
+      session_token(state.token),
+      resuming(!state.token.empty()),
+      connected(false),
+      resolved(state.resolved),
+      tcp_endpoint(state.tcp_endpoint),
+      udp_endpoint(state.udp_endpoint),
       tcp_socket(io_service),
       udp_socket(io_service),
+      multicast_socket(io_service),
       keepalive_timer(io_service, seconds(0)),
       check_udp_timer(io_service, seconds(0)),
-      nr_max_seen(0),
-      nr_expected(0),
-      next_ack(0),
+      latency_timer(io_service, seconds(0)),
+      nr_max_seen(state.nr_max_seen),
+      nr_expected(state.nr_expected),
+      next_ack(state.next_ack),
       win(0),
       waiting_for_input(false),
       waiting_for_win(false),
+      my_last_datagram(state.my_last_datagram),
       eof(false),
-      input_stream(io_service, ::dup(STDIN_FILENO)),
+      ready_input(state.ready_input),
+      input_stream(io_service),
+      sent_since_keepalive(false),
       waiting_for_ack(false),
       waits(0),
-      udp_active(false)
+      udp_active(false),
+      latency_sum(),
+      latency_max(0),
+      latency_samples(0)
 {
+    if (params.use_stdio) {
+        input_stream.assign(::dup(STDIN_FILENO));
+    }
     establish_tcp_connection();
     setup_udp();
     receive_tcp(true); // embeds getting id and sending it
     schedule_keepalive();
     receive_udp();
     schedule_check_udp_active();
+    if (params.latency_interval > 0) {
+        schedule_latency_report();
+    }
 }
 
 void Client::terminate() {
     io_service.stop();
 }
 
+/* While a resume is undecided the old token is still worth presenting */
+ClientResumeState Client::get_resume_state() {
+    ClientResumeState state;
+    state.connected = connected;
+    state.resolved = resolved;
+    state.tcp_endpoint = tcp_endpoint;
+    state.udp_endpoint = udp_endpoint;
+    state.token = session_token;
+    state.next_ack = next_ack;
+    state.nr_expected = nr_expected;
+    state.nr_max_seen = nr_max_seen;
+    state.ready_input = ready_input;
+    state.my_last_datagram = my_last_datagram;
+    return state;
+}
+
 void Client::establish_tcp_connection() {
-    cerr << "Connecting to " << params.server_name << ":" << params.port  << "..." << endl;
+    LOG(LOG_INFO, "connect", LOG_NO_CLIENT, "Connecting to %s:%u...",
+        params.server_name.c_str(), params.port);
     
     try {
-        tcp::resolver resolver(io_service);
-        tcp::resolver::query query(params.server_name, std::to_string(params.port));
-        tcp::resolver::iterator endpoint_iterator = resolver.resolve(query);
-        tcp::endpoint remote_endpoint = *endpoint_iterator;
-        tcp_socket.connect(remote_endpoint);
+        if (!resolved) {
+            tcp::resolver resolver(io_service);
+            tcp::resolver::query query(params.server_name, std::to_string(params.port));
+            tcp_endpoint = *resolver.resolve(query);
+            udp::resolver udp_resolver(io_service);
+            udp::resolver::query udp_query(params.server_name, std::to_string(params.port));
+            udp_endpoint = *udp_resolver.resolve(udp_query);
+            resolved = true;
+        }
+        tcp_socket.connect(tcp_endpoint);
         //asio::connect(tcp_socket, endpoint_iterator); -- only in newest boost
-        cerr << "Connection established" << endl;
+        connected = true;
+        LOG(LOG_INFO, "connect", LOG_NO_CLIENT, "Connection established");
     } catch (std::exception & e) {
-        cerr << "Couldn't connect to " << params.server_name << ":" << params.port << endl;
+        LOG(LOG_ERROR, "connect", LOG_NO_CLIENT, "Couldn't connect to %s:%u",
+            params.server_name.c_str(), params.port);
         terminate();
     }
 }
 
 
 void Client::setup_udp() {
-    cerr << "Setting up udp socket..." << endl;
+    LOG(LOG_INFO, "setup_udp", LOG_NO_CLIENT, "Setting up udp socket...");
 
     try {
-        udp::resolver resolver(io_service);
-        udp::resolver::query query(params.server_name, std::to_string(params.port));
-        udp::resolver::iterator endpoint_iterator = resolver.resolve(query);
-        udp::endpoint remote_endpoint = *endpoint_iterator;
-        udp_socket.connect(remote_endpoint);
+        udp_socket.connect(udp_endpoint);
         //asio::connect(udp_socket, endpoint_iterator); -- only in newest boost
     } catch (std::exception &e) {
-        cerr << "Couldn't set up UDP socket" << endl;
+        LOG(LOG_ERROR, "setup_udp", LOG_NO_CLIENT, "Couldn't set up UDP socket");
         terminate();
     }
 }
@@ -101,8 +143,11 @@ void Client::schedule_keepalive() {
 void Client::keepalive(const boost::system::error_code & ec) {
     schedule_keepalive();
     if (ec) {
-        cerr << "timer error in keepalive\n"
-             << ec.message() << endl;
+        LOG(LOG_ERROR, "timer", LOG_NO_CLIENT, "timer error in keepalive: %s", ec.message().c_str());
+        return;
+    }
+    if (sent_since_keepalive) {
+        sent_since_keepalive = false;
         return;
     }
 
@@ -122,8 +167,7 @@ void Client::handle_keepalive(const boost::system::error_code& ec, size_t n,
                               shared_ptr<string> header_p)
 {
    if (ec) {
-       cerr << "error after keepalive\n"
-            << ec.message() << endl;
+       LOG(LOG_WARN, "keepalive", LOG_NO_CLIENT, "error after keepalive: %s", ec.message().c_str());
    }
 }
 
@@ -143,8 +187,8 @@ void Client::receive_tcp(bool initial) {
 
 void Client::handle_receive_tcp(const boost::system::error_code &ec, size_t n, bool initial) { 
     if (ec) {
-        cerr << "problem with tcp connection\n"
-             << ec.message() << endl;
+        LOG(LOG_ERROR, "tcp_error", LOG_NO_CLIENT, "problem with tcp connection: %s",
+            ec.message().c_str());
         terminate();
         return;
     }
@@ -153,7 +197,7 @@ void Client::handle_receive_tcp(const boost::system::error_code &ec, size_t n, b
         set_id_from_msg(data);
         send_id();
     } else {
-        cerr << data;
+        Logger::instance().print(data);
     }
     receive_tcp(); 
 } 
@@ -164,21 +208,35 @@ void Client::set_id_from_msg(string data) {
         string command;
         istream >> command;
         if (command != "CLIENT") {
-            cerr << "first tcp header received is not <<CLIENT>>\n";
+            LOG(LOG_ERROR, "bad_tcp_header", LOG_NO_CLIENT, "first tcp header received is not <<CLIENT>>");
             terminate();
             return;
         }
         istream >> id;
+        offered_token.clear();
+
+        string word;
+        while (istream >> word) {
+            if (params.multicast && word.compare(0, 10, "multicast=") == 0) {
+                join_multicast(word.substr(10));
+            } else if (word.compare(0, 6, "token=") == 0) {
+                offered_token = word.substr(6);
+            }
+        }
     } catch (std::exception& e) {
-            cerr << "first tcp header received is not <<CLIENT>>\n";
+            LOG(LOG_ERROR, "bad_tcp_header", LOG_NO_CLIENT, "first tcp header received is not <<CLIENT>>");
             terminate();
             return;
     }
-    cerr << "Received id: " << id << endl;
+    if (!resuming) {
+        session_token = offered_token;
+    }
+    LOG(LOG_INFO, "id", id, "Received id: %u", id);
 }
 
 void Client::send_datagram(string data, bool set_waiting) {
     auto datagram_p = make_shared<string>(data);    
+    sent_since_keepalive = true;
 
     udp_socket.async_send(
         asio::buffer(*datagram_p),
@@ -195,8 +253,8 @@ void Client::send_datagram(string data, bool set_waiting) {
 void Client::handle_send_datagram(const boost::system::error_code & ec, size_t n,
                                   shared_ptr<string> datagram_p, bool set_waiting) {
     if (ec) {
-        cerr << "problem with sending datagram\n"
-             << ec.message() << endl;
+        LOG(LOG_ERROR, "send_datagram", LOG_NO_CLIENT, "problem with sending datagram: %s",
+            ec.message().c_str());
         terminate();
         return;
     }
@@ -208,7 +266,29 @@ void Client::handle_send_datagram(const boost::system::error_code & ec, size_t n
 
 void Client::send_id() {
     stringstream stream;
-    stream << "CLIENT " << id << "\n";
+    stream << "CLIENT " << id;
+    if (params.report_mode != DEFAULT_REPORT_MODE) {
+        stream << " report=" << params.report_mode;
+    }
+    if (!params.room.empty()) {
+        stream << " room=" << params.room;
+    }
+    if (!params.format.empty()) {
+        stream << " format=" << params.format;
+    }
+    if (params.mix_minus) {
+        stream << " mixminus=1";
+    }
+    if (multicast_socket.is_open()) {
+        stream << " multicast=1";
+    }
+    if (params.adapt) {
+        stream << " adapt=1";
+    }
+    if (resuming) {
+        stream << " resume=" << session_token;
+    }
+    stream << "\n";
     send_datagram(stream.str());
 }
 
@@ -225,7 +305,8 @@ void Client::receive_udp() {
 
 void Client::handle_receive_udp(const boost::system::error_code& ec, size_t n) {
     if (ec) {
-        cerr << "error after receive_udp\n";
+        LOG(LOG_WARN, "receive_udp", LOG_NO_CLIENT, "error after receive_udp: %s",
+            ec.message().c_str());
         receive_udp();
         return;
     }
@@ -233,7 +314,7 @@ void Client::handle_receive_udp(const boost::system::error_code& ec, size_t n) {
 
     char* newline_pos = std::find(udp_rcv_buf, udp_rcv_buf + n, '\n');
     if (newline_pos == udp_rcv_buf + n) {
-        cerr << "no newline in received udp datagram\n";
+        LOG(LOG_WARN, "bad_header", LOG_NO_CLIENT, "no newline in received udp datagram");
         receive_udp();
         return;
     }
@@ -256,16 +337,30 @@ void Client::handle_receive_udp(const boost::system::error_code& ec, size_t n) {
         if (type == "ACK") {
             uint32_t ack, win;
             istream >> ack >> win;
+            string word;
+            if (istream >> word) {
+                handle_latency_echo(word);
+            }
             handle_ack(ack, win);
         } else if (type == "DATA") {
             uint32_t nr, ack, win;
             istream >> nr >> ack >> win;
-            handle_data_received(nr, ack, win, data);
+            string word;
+            downstream_format_t format = FORMAT_FULL;
+            while (istream >> word) {
+                if (word.compare(0, LATENCY_WORD.size(), LATENCY_WORD) == 0) {
+                    handle_latency_echo(word);
+                } else if (!parse_format(word, format)) {
+                    LOG(LOG_WARN, "bad_header", LOG_NO_CLIENT, "unknown DATA format: %s",
+                        word.c_str());
+                }
+            }
+            handle_data_received(nr, ack, win, decode_downstream(data, format));
         } else {
-            cerr << "bad udp header from server\n";
+            LOG(LOG_WARN, "bad_header", LOG_NO_CLIENT, "bad udp header from server");
         }
     } catch(std::exception& e) {
-        cerr << "bad udp header from server\n";
+        LOG(LOG_WARN, "bad_header", LOG_NO_CLIENT, "bad udp header from server");
         return;
     }
     receive_udp();
@@ -273,6 +368,9 @@ void Client::handle_receive_udp(const boost::system::error_code& ec, size_t n) {
 
 
 void Client::handle_ack(uint32_t ack, uint32_t _win, bool from_DATA) {
+    if (resuming) {
+        check_resumed(ack);
+    }
     if (waiting_for_win && _win > 0) {
 		waiting_for_win = false;
 		win = _win;
@@ -289,28 +387,184 @@ void Client::handle_ack(uint32_t ack, uint32_t _win, bool from_DATA) {
         
         upload_data();
 
-    } else if (from_DATA && waiting_for_ack) {
-        ++waits;
-        if (waits >= 2) {
-            waiting_for_ack = false;
-            waits = 0;
-            retransmit();
-        }
+    } else if (from_DATA) {
+        count_data_without_ack();
+    }
+}
+
+/* A resumed session acks where we left off: the last upload, or the one
+ * before it if that upload got lost. A fresh one starts at 0. */
+void Client::check_resumed(uint32_t ack) {
+    resuming = false;
+    if (next_ack > 1 && ack + 1 < next_ack) {
+        LOG(LOG_WARN, "resume", id, "session not resumed, starting over");
+        session_token = offered_token;
+        next_ack = 0;
+        nr_expected = 0;
+        nr_max_seen = 0;
+        my_last_datagram.clear();
+        return;
+    }
+    LOG(LOG_INFO, "resume", id, "session resumed at ack %u", ack);
+    if (ack + 1 == next_ack && !my_last_datagram.empty()) {
+        retransmit();
+    }
+}
+
+/* Two remixes went by and our upload is still not acked -- it was lost */
+void Client::count_data_without_ack() {
+    if (!waiting_for_ack) {
+        return;
+    }
+    ++waits;
+    if (waits >= 2) {
+        waiting_for_ack = false;
+        waits = 0;
+        retransmit();
     }
 }
 
 void Client::handle_data_received(uint32_t nr_recv, uint32_t ack, uint32_t _win, string data) {
     handle_ack(ack, _win, true);
+    deliver_data(nr_recv, data);
+}
+
+void Client::deliver_data(uint32_t nr_recv, const string & data) {
     if (nr_recv == nr_expected || nr_expected + params.retransmit_limit < nr_recv) {
         nr_expected = nr_recv + 1;
-        cout.write(data.data(), data.size());
-	fflush(stdout);
+        if (params.use_stdio) {
+            cout.write(data.data(), data.size());
+            fflush(stdout);
+        } else if (on_data) {
+            on_data(data);
+        }
     } else if (nr_recv > nr_max_seen) {
         ask_for_retransmit(nr_expected);
     }
     nr_max_seen = max(nr_max_seen, nr_recv);
 }
 
+/* LATENCY */
+
+void Client::handle_latency_echo(const string & word) {
+    latency_breakdown_t sample;
+    if (!parse_latency_echo(word, latency_clock_us(), sample)) {
+        LOG(LOG_WARN, "bad_header", LOG_NO_CLIENT, "bad latency echo: %s", word.c_str());
+        return;
+    }
+    latency_sum.uplink += sample.uplink;
+    latency_sum.jitter_buffer += sample.jitter_buffer;
+    latency_sum.mix += sample.mix;
+    latency_sum.downlink += sample.downlink;
+    latency_max = max(latency_max,
+                      sample.uplink + sample.jitter_buffer + sample.mix + sample.downlink);
+    ++latency_samples;
+}
+
+void Client::schedule_latency_report() {
+    latency_timer.expires_at(latency_timer.expires_at() + milliseconds(params.latency_interval));
+    latency_timer.async_wait(
+        boost::bind(
+            &Client::report_latency,
+            this,
+            asio::placeholders::error)
+   );
+}
+
+/* Means over the interval; the network is split evenly between uplink
+ * and downlink, see latency.h. Our own stdout isn't counted. */
+void Client::report_latency(const boost::system::error_code& ec) {
+    schedule_latency_report();
+    if (ec) {
+        LOG(LOG_ERROR, "timer", LOG_NO_CLIENT, "timer error in report_latency: %s",
+            ec.message().c_str());
+        return;
+    }
+    if (latency_samples == 0) {
+        LOG(LOG_INFO, "latency", id, "latency: no stamped upload came back");
+        return;
+    }
+    double n = latency_samples * 1000.0;
+    double total = (latency_sum.uplink + latency_sum.jitter_buffer
+                    + latency_sum.mix + latency_sum.downlink) / n;
+    LOG(LOG_INFO, "latency", id,
+        "latency: uplink %.1f ms, jitter buffer %.1f ms, mix %.1f ms, downlink %.1f ms"
+        " -- %.1f ms in all, max %.1f ms, %llu samples",
+        latency_sum.uplink / n, latency_sum.jitter_buffer / n, latency_sum.mix / n,
+        latency_sum.downlink / n, total, latency_max / 1000.0,
+        (unsigned long long) latency_samples);
+    latency_sum = latency_breakdown_t();
+    latency_max = 0;
+    latency_samples = 0;
+}
+
+/* MULTICAST */
+
+/* Falls back to unicast DATA (by not asking for multicast) if the group
+ * can't be joined. */
+void Client::join_multicast(const string & group) {
+    size_t colon = group.rfind(':');
+    if (colon == string::npos) {
+        return;
+    }
+    try {
+        auto address = asio::ip::address::from_string(group.substr(0, colon));
+        udp::endpoint endpoint(address, std::stoi(group.substr(colon + 1)));
+        multicast_socket.open(endpoint.protocol());
+        multicast_socket.set_option(udp::socket::reuse_address(true));
+        multicast_socket.bind(endpoint);
+        multicast_socket.set_option(asio::ip::multicast::join_group(address));
+    } catch (std::exception & e) {
+        LOG(LOG_WARN, "multicast", id, "can't join multicast group %s: %s",
+            group.c_str(), e.what());
+        boost::system::error_code ignored;
+        multicast_socket.close(ignored);
+        return;
+    }
+    LOG(LOG_INFO, "multicast", id, "joined multicast group %s", group.c_str());
+    receive_multicast();
+}
+
+void Client::receive_multicast() {
+    multicast_socket.async_receive(
+        asio::buffer(multicast_rcv_buf),
+        boost::bind(
+            &Client::handle_receive_multicast,
+            this,
+            asio::placeholders::error,
+            asio::placeholders::bytes_transferred)
+    );
+}
+
+/* MDATA <room> <nr> -- ack and win come in unicast ACKs */
+void Client::handle_receive_multicast(const boost::system::error_code& ec, size_t n) {
+    if (ec) {
+        LOG(LOG_WARN, "receive_multicast", id, "error after receive_multicast: %s",
+            ec.message().c_str());
+        receive_multicast();
+        return;
+    }
+
+    char* newline_pos = std::find(multicast_rcv_buf, multicast_rcv_buf + n, '\n');
+    if (newline_pos == multicast_rcv_buf + n) {
+        LOG(LOG_WARN, "bad_header", id, "no newline in multicast datagram");
+        receive_multicast();
+        return;
+    }
+
+    istringstream istream(string(multicast_rcv_buf, newline_pos));
+    string type, room;
+    uint32_t nr;
+    istream >> type >> room >> nr;
+    string my_room = params.room.empty() ? SERVER_DEFAULT_ROOM : params.room;
+    if (!istream.fail() && type == "MDATA" && room == my_room) {
+        udp_active = true;
+        count_data_without_ack();
+        deliver_data(nr, string(newline_pos + 1, multicast_rcv_buf + n));
+    }
+    receive_multicast();
+}
+
 void Client::upload_data() {
     if (win == 0) {
         waiting_for_win = true;
@@ -326,7 +580,11 @@ void Client::upload_data() {
         n = min((uint32_t) ready_input.size(), win);
         
         stringstream stream;
-        stream << "UPLOAD " << next_ack - 1 << "\n";
+        stream << "UPLOAD " << next_ack - 1;
+        if (params.latency_interval > 0) {
+            stream << " " << latency_stamp_word(latency_clock_us());
+        }
+        stream << "\n";
         
         stream << string(ready_input.data(), n);
         ready_input.erase(ready_input.begin(), ready_input.begin() + n);
@@ -346,7 +604,7 @@ void Client::ask_for_retransmit(uint32_t nr_expected) {
 }
    
 void Client::read_stdin() {
-    if (eof) {
+    if (eof || !params.use_stdio) {
         return;
     }
     //cerr << "reading from stdin...\n";
@@ -363,7 +621,7 @@ void Client::read_stdin() {
 
 void Client::handle_read_stdin(const boost::system::error_code &ec, size_t n) {
     if (ec && ec != asio::error::eof) {
-        cerr << "stdin error\n" << ec.message() << endl;
+        LOG(LOG_ERROR, "stdin", LOG_NO_CLIENT, "stdin error: %s", ec.message().c_str());
         terminate();
         return;
     }
@@ -383,6 +641,19 @@ void Client::handle_read_stdin(const boost::system::error_code &ec, size_t n) {
     }
 }
 
+/* A live feed doesn't wait for the window: when the server stops taking
+ * it, the oldest input is dropped rather than delivered ever later. */
+void Client::feed_input(string data) {
+    ready_input.insert(ready_input.end(), data.begin(), data.end());
+    if (ready_input.size() > 50000) {
+        ready_input.erase(ready_input.begin(), ready_input.end() - 50000);
+    }
+    if (waiting_for_input) {
+        waiting_for_input = false;
+        upload_data();
+    }
+}
+
 void Client::schedule_check_udp_active() {
     check_udp_timer.expires_at(check_udp_timer.expires_at() + seconds(1)); 
     check_udp_timer.async_wait(
@@ -395,14 +666,14 @@ void Client::schedule_check_udp_active() {
 void Client::check_udp_active(const boost::system::error_code& ec) {
     schedule_check_udp_active();
     if (ec) {
-        cerr << "timer error in check_udp_active\n"
-             << ec.message() << endl;
+        LOG(LOG_ERROR, "timer", LOG_NO_CLIENT, "timer error in check_udp_active: %s",
+            ec.message().c_str());
         return;
     }
     if (udp_active) {
         udp_active = false;
     } else {
-        cerr << "no udp datagram from server for one second\n";
+        LOG(LOG_WARN, "udp_timeout", LOG_NO_CLIENT, "no udp datagram from server for one second");
         terminate();
     }
 }
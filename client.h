@@ -1,11 +1,13 @@
 #ifndef __client_h_
 #define __client_h_
 
+#include <functional>
 #include <map>
 #include <string>
 #include <vector>
 #include <boost/asio.hpp>
 #include "client_params.h"
+#include "latency.h"
 
 using std::shared_ptr;
 using std::string;
@@ -16,11 +18,32 @@ using boost::asio::ip::tcp;
 using boost::asio::ip::udp;
 
 
+/* What a Client leaves to the next one, so that a reconnect resumes the
+ * server-side session -- FIFO, ack and remix numbers -- instead of
+ * starting over, and doesn't resolve the server's name again. */
+struct ClientResumeState {
+    ClientResumeState()
+        : connected(false), resolved(false), next_ack(0), nr_expected(0), nr_max_seen(0) {}
+
+    bool connected;   // TCP connection was made
+    bool resolved;
+    tcp::endpoint tcp_endpoint;
+    udp::endpoint udp_endpoint;
+    string token;     // session to resume, empty if none
+    uint32_t next_ack;
+    uint32_t nr_expected;
+    uint32_t nr_max_seen;
+    vector<char> ready_input;
+    string my_last_datagram;
+};
+
 class Client
 {
 public:
-    Client(ClientParams, boost::asio::io_service &);
+    Client(ClientParams, boost::asio::io_service &,
+           const ClientResumeState & = ClientResumeState());
     void terminate();
+    ClientResumeState get_resume_state();
     
     /* RECEIVING ID AND REPORTS */
     void establish_tcp_connection();
@@ -41,7 +64,16 @@ public:
     void receive_udp();
     void handle_receive_udp(const boost::system::error_code&, size_t);
     void handle_ack(uint32_t ack, uint32_t _win, bool from_DATA=false);
+    void check_resumed(uint32_t ack);
     void handle_data_received(uint32_t nr, uint32_t ack, uint32_t win, string data);
+    void count_data_without_ack();
+    void deliver_data(uint32_t nr, const string & data);
+    void handle_latency_echo(const string & word);
+
+    /* RECEIVING MULTICAST DATA */
+    void join_multicast(const string & group);
+    void receive_multicast();
+    void handle_receive_multicast(const boost::system::error_code&, size_t);
 
     /* SENDING KEEPALIVE */
     void schedule_keepalive();
@@ -52,6 +84,14 @@ public:
     void read_stdin();
     void handle_read_stdin(const boost::system::error_code &, size_t n);
 
+    /* EMBEDDED USE -- without stdio, the owner pushes input here (on the
+     * client's io_service) and takes received DATA through on_data */
+    void feed_input(string);
+
+    /* REPORTING LATENCY */
+    void schedule_latency_report();
+    void report_latency(const boost::system::error_code&);
+
     /* CHECKING UDP CONNECTION */
     void schedule_check_udp_active();
     void check_udp_active(const boost::system::error_code&);
@@ -66,6 +106,18 @@ public:
     /* IDENTIFICATION */
     uint32_t id;
 
+    /* RESUMPTION -- session_token is the session we hold (or try to take
+     * back while resuming); offered_token came with this connection */
+    string session_token;
+    string offered_token;
+    bool resuming;
+
+    /* SERVER ENDPOINTS -- resolved once per run_client */
+    bool connected;
+    bool resolved;
+    tcp::endpoint tcp_endpoint;
+    udp::endpoint udp_endpoint;
+
     /* TCP */
     boost::asio::ip::tcp::socket tcp_socket;
     char tcp_rcv_buf[70000];
@@ -74,10 +126,15 @@ public:
     boost::asio::ip::udp::socket udp_socket;
     char udp_rcv_buf[70000];
 
+    /* MULTICAST -- open once joined */
+    boost::asio::ip::udp::socket multicast_socket;
+    char multicast_rcv_buf[70000];
+
     
     /* TIMERS */
     boost::asio::deadline_timer keepalive_timer;
     boost::asio::deadline_timer check_udp_timer;
+    boost::asio::deadline_timer latency_timer;
 
     /* DATA RECEIVED INFO */
     uint32_t nr_max_seen;
@@ -95,10 +152,19 @@ public:
     vector<char> ready_input;
     char stdin_buf[10000];
     boost::asio::posix::stream_descriptor input_stream;
+    std::function<void(const string &)> on_data;
        
+    /* Any datagram sent counts as a keepalive on the server side */
+    bool sent_since_keepalive;
+
     /* STATISTICS */
     bool waiting_for_ack;
     int waits;
     bool udp_active;
+
+    /* LATENCY -- echoed stamps since the last report; sums in us */
+    latency_breakdown_t latency_sum;
+    uint64_t latency_max;
+    uint64_t latency_samples;
 };
 #endif
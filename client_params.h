@@ -7,11 +7,22 @@
 
 const uint16_t DEFAULT_PORT = (10000 + 337620) % 10000;
 const size_t DEFAULT_RETRANSMIT_LIMIT = 10;
+const unsigned long DEFAULT_LATENCY_INTERVAL = 0; // not measured
+const std::string DEFAULT_REPORT_MODE = "full";
+const std::string SERVER_DEFAULT_ROOM = "default"; // room joined without room=
 
 typedef struct {
     std::string server_name;
     uint16_t port;
     size_t retransmit_limit;
+    std::string report_mode;
+    std::string room;
+    std::string format; // rate:sample:channels asked of the room; empty: as it is
+    bool mix_minus;   // ask the server to leave our own upload out of DATA
+    bool multicast;   // take remixes from the server's multicast group, if any
+    bool adapt;       // let the server send lighter DATA when we lose a lot
+    unsigned long latency_interval; // ms between latency reports; 0: uploads aren't stamped
+    bool use_stdio;   // false: input comes from feed_input(), DATA goes to on_data
 } ClientParams;
 
 #endif
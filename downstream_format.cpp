@@ -0,0 +1,90 @@
+#include <cstdint>
+#include "downstream_format.h"
+
+
+static const char * format_names[FORMAT_COUNT] = {"full", "mono", "low"};
+
+/* Of the full rate's bytes per ms -- 176 at 44.1 kHz */
+static const size_t format_divisors[FORMAT_COUNT] = {1, 2, 8};
+
+const char * format_name(downstream_format_t format) {
+    return format_names[format];
+}
+
+bool parse_format(const string & name, downstream_format_t & format) {
+    for (int i = 0; i < FORMAT_COUNT; ++i) {
+        if (name == format_names[i]) {
+            format = (downstream_format_t) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t format_rate(downstream_format_t format, const AudioFormat & audio) {
+    return audio.bytes_per_ms() / format_divisors[format];
+}
+
+bool format_adaptable(const AudioFormat & audio) {
+    return audio.sample == SAMPLE_S16 && audio.channels == 2;
+}
+
+string encode_downstream(const string & full, downstream_format_t format) {
+    const int16_t * in = (const int16_t*) full.data();
+    size_t frames = full.size() / 4;
+    string out;
+
+    switch (format) {
+    case FORMAT_MONO:
+        out.resize(2 * frames);
+        for (size_t i = 0; i < frames; ++i) {
+            int16_t mono = ((int32_t) in[2 * i] + in[2 * i + 1]) / 2;
+            ((int16_t*) &out[0])[i] = mono;
+        }
+        break;
+    case FORMAT_LOW:
+        out.resize((frames + 1) / 2);
+        for (size_t i = 0; i < frames; i += 2) {
+            size_t last = i + 1 < frames ? i + 1 : i;
+            int32_t sum = (int32_t) in[2 * i] + in[2 * i + 1]
+                        + in[2 * last] + in[2 * last + 1];
+            out[i / 2] = (char) (int8_t) ((sum / 4) >> 8);
+        }
+        break;
+    default:
+        out = full;
+    }
+    return out;
+}
+
+string decode_downstream(const string & data, downstream_format_t format) {
+    string out;
+
+    switch (format) {
+    case FORMAT_MONO: {
+        const int16_t * in = (const int16_t*) data.data();
+        size_t samples = data.size() / 2;
+        out.resize(4 * samples);
+        int16_t * frames = (int16_t*) &out[0];
+        for (size_t i = 0; i < samples; ++i) {
+            frames[2 * i] = frames[2 * i + 1] = in[i];
+        }
+        break;
+    }
+    case FORMAT_LOW: {
+        size_t samples = data.size();
+        out.resize(8 * samples);
+        int16_t * frames = (int16_t*) &out[0];
+        for (size_t i = 0; i < samples; ++i) {
+            int16_t sample = (int16_t) ((int8_t) data[i] * 256);
+            for (int j = 0; j < 4; ++j) {
+                frames[4 * i + j] = sample;
+            }
+        }
+        break;
+    }
+    default:
+        out = data;
+    }
+    return out;
+}
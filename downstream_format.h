@@ -0,0 +1,29 @@
+#ifndef __downstream_format_h_
+#define __downstream_format_h_
+
+#include <cstddef>
+#include <string>
+#include "audio_format.h"
+
+using std::string;
+
+/* Lighter encodings of a 16-bit stereo remix, for listeners whose link
+ * can't carry the full rate; rooms in other formats send FULL only. Each halves the previous one or more:
+ *   FULL -- 16-bit stereo, as mixed
+ *   MONO -- 16-bit, channels averaged
+ *   LOW  -- 8-bit mono at half the sample rate
+ * The client decodes back to 16-bit stereo, so its output never changes
+ * shape. */
+enum downstream_format_t { FORMAT_FULL, FORMAT_MONO, FORMAT_LOW, FORMAT_COUNT };
+
+const char * format_name(downstream_format_t);
+bool parse_format(const string &, downstream_format_t &);
+
+/* Bytes per ms of audio, for a remix in the given format */
+size_t format_rate(downstream_format_t, const AudioFormat & = DEFAULT_AUDIO_FORMAT);
+bool format_adaptable(const AudioFormat &);
+
+string encode_downstream(const string & full, downstream_format_t);
+string decode_downstream(const string & data, downstream_format_t);
+
+#endif
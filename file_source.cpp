@@ -0,0 +1,74 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "file_source.h"
+
+
+MappedFile::MappedFile(const string & _path)
+    : path(_path),
+      data(NULL),
+      size(0)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("can't open " + path + ": " + strerror(errno));
+    }
+    struct stat st;
+    if (::fstat(fd, &st) < 0 || st.st_size == 0) {
+        ::close(fd);
+        throw std::runtime_error("nothing to play in " + path);
+    }
+    void * mapping = ::mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        throw std::runtime_error("can't map " + path + ": " + strerror(errno));
+    }
+    ::madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+    data = (const char*) mapping;
+    size = st.st_size;
+}
+
+MappedFile::~MappedFile() {
+    ::munmap((void*) data, size);
+}
+
+
+FileSource::FileSource(shared_ptr<MappedFile> _file, bool _loop, size_t frame_size)
+    : file(_file),
+      loop(_loop),
+      end(_file->size - _file->size % frame_size),
+      position(0)
+{
+}
+
+struct mixer_input FileSource::input(size_t bytes) {
+    size_t left = end - position;
+    if (left >= bytes || !loop || end == 0) {
+        struct mixer_input input {(void*) (file->data + position), std::min(left, bytes), 0, 1};
+        return input;
+    }
+
+    wrap_buf.assign(file->data + position, left);
+    while (wrap_buf.size() < bytes) {
+        wrap_buf.append(file->data, std::min(end, bytes - wrap_buf.size()));
+    }
+    struct mixer_input input {(void*) wrap_buf.data(), bytes, 0, 1};
+    return input;
+}
+
+bool FileSource::advance(size_t consumed) {
+    position += consumed;
+    if (position < end) {
+        return true;
+    }
+    if (!loop || end == 0) {
+        return false;
+    }
+    position %= end;
+    return true;
+}
@@ -0,0 +1,52 @@
+#ifndef __file_source_h_
+#define __file_source_h_
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include "mixer.h"
+
+using std::shared_ptr;
+using std::string;
+
+/* A raw PCM file mapped read-only, in whatever format the room playing it
+ * mixes -- nothing in the file says which. Shared by every room playing
+ * it; throws std::runtime_error if it can't be mapped. */
+class MappedFile {
+public:
+    MappedFile(const string & path);
+    ~MappedFile();
+
+    string path;
+    const char * data;
+    size_t size;
+
+private:
+    MappedFile(const MappedFile &);
+    MappedFile & operator=(const MappedFile &);
+};
+
+/* A mapped file played into a room, a tick at a time: the mixer reads
+ * the mapping directly. Only the tick that wraps a looped file around is
+ * copied, so the loop has no gap. */
+class FileSource {
+public:
+    FileSource(shared_ptr<MappedFile>, bool loop, size_t frame_size);
+
+    /* Up to `bytes` from the current position */
+    struct mixer_input input(size_t bytes);
+
+    /* Moves on by what the mixer consumed; false once a file played
+     * without loop is done */
+    bool advance(size_t consumed);
+
+    shared_ptr<MappedFile> file;
+    bool loop;
+
+private:
+    size_t end; // whole frames only
+    size_t position;
+    string wrap_buf;
+};
+
+#endif
@@ -0,0 +1,494 @@
+#include <algorithm>
+#include <iostream>
+#include <exception>
+#include <map>
+#include <random>
+#include <boost/program_options.hpp>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include "client_params.h"
+
+namespace asio = boost::asio;
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::map;
+using std::shared_ptr;
+using std::make_shared;
+using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
+
+typedef boost::posix_time::ptime ptime;
+typedef boost::posix_time::microsec_clock microsec_clock;
+
+
+#ifdef NDEBUG
+    const bool DEBUG = false;
+#else
+    const bool DEBUG = true;
+#endif
+
+const uint16_t DEFAULT_LISTEN_PORT = 14000;
+const unsigned long DEFAULT_QUEUE = 200;   // ms a rate-capped link may queue
+const unsigned long FLOW_IDLE_TIMEOUT = 60; // s
+const size_t PROXY_BUF_LEN = 100000;
+
+/* Impairments of one direction. Everything is off by default. */
+typedef struct {
+    double loss;            // independent, per datagram
+    double burst_enter;     // Gilbert-Elliott: P(good -> bad) per datagram
+    double burst_exit;      //                  P(bad -> good)
+    double burst_loss;      //                  loss while bad
+    unsigned long delay;    // ms
+    unsigned long jitter;   // ms, uniform in [-jitter, jitter]
+    double reorder;         // sent at once, overtaking the delayed ones
+    double duplicate;
+    unsigned long rate;     // kbit/s, 0 for no cap
+} ImpairParams;
+
+typedef struct {
+    string server_name;
+    uint16_t port;
+    uint16_t listen_port;
+    unsigned long queue;
+    unsigned long seed;
+    ImpairParams up;        // client -> server
+    ImpairParams down;      // server -> client
+} ProxyParams;
+
+
+/* Decides the fate of each datagram going one way: dropped, or sent
+ * (maybe twice) after some delay. */
+class Impairment {
+public:
+    struct Counters {
+        Counters() : forwarded(0), lost(0), burst_lost(0), queue_dropped(0),
+                     duplicated(0), reordered(0) {}
+        uint64_t forwarded, lost, burst_lost, queue_dropped, duplicated, reordered;
+    };
+
+    Impairment(const ImpairParams & _params, unsigned long queue, std::mt19937 & _rng)
+        : params(_params),
+          max_queue(boost::posix_time::milliseconds(queue)),
+          rng(_rng),
+          bad(false),
+          link_free_at(microsec_clock::universal_time()) {}
+
+    /* Send times of the copies to deliver -- none if it is dropped */
+    int schedule(size_t size, ptime times[2]) {
+        if (chance(params.burst_enter) && !bad) {
+            bad = true;
+        } else if (bad && chance(params.burst_exit)) {
+            bad = false;
+        }
+        if (bad && chance(params.burst_loss)) {
+            ++counters.burst_lost;
+            return 0;
+        }
+        if (chance(params.loss)) {
+            ++counters.lost;
+            return 0;
+        }
+
+        ptime now = microsec_clock::universal_time();
+        ptime sent = now;
+        if (params.rate > 0) {
+            /* kbit/s is bits per ms */
+            link_free_at = std::max(link_free_at, now)
+                + boost::posix_time::microseconds(size * 8 * 1000 / params.rate);
+            if (link_free_at - now > max_queue) {
+                link_free_at -= boost::posix_time::microseconds(size * 8 * 1000 / params.rate);
+                ++counters.queue_dropped;
+                return 0;
+            }
+            sent = link_free_at;
+        }
+
+        int copies = 1;
+        times[0] = sent + delay();
+        if (chance(params.reorder)) {
+            times[0] = sent;
+            ++counters.reordered;
+        }
+        if (chance(params.duplicate)) {
+            times[1] = sent + delay();
+            ++copies;
+            ++counters.duplicated;
+        }
+        counters.forwarded += copies;
+        return copies;
+    }
+
+    const Counters & get_counters() const { return counters; }
+
+private:
+    bool chance(double p) {
+        return p > 0 && std::uniform_real_distribution<double>(0, 1)(rng) < p;
+    }
+
+    boost::posix_time::time_duration delay() {
+        long us = params.delay * 1000;
+        if (params.jitter > 0) {
+            long jitter = params.jitter * 1000;
+            us += std::uniform_int_distribution<long>(-jitter, jitter)(rng);
+        }
+        return boost::posix_time::microseconds(std::max(us, 0L));
+    }
+
+    ImpairParams params;
+    boost::posix_time::time_duration max_queue;
+    std::mt19937 & rng;
+    bool bad;           // Gilbert-Elliott state
+    ptime link_free_at; // when the rate-capped link finishes its queue
+    Counters counters;
+};
+
+
+/* Passes TCP through untouched, so runclient's connection and reports go
+ * to the server as usual. */
+class TcpPipe : public std::enable_shared_from_this<TcpPipe> {
+public:
+    TcpPipe(asio::io_service & io_service) : client(io_service), server(io_service) {}
+
+    void start(tcp::endpoint target) {
+        server.async_connect(target, boost::bind(
+            &TcpPipe::handle_connect, shared_from_this(), asio::placeholders::error));
+    }
+
+    tcp::socket client;
+    tcp::socket server;
+
+private:
+    void handle_connect(const boost::system::error_code & ec) {
+        if (ec) {
+            close();
+            return;
+        }
+        read(client, server, client_buf);
+        read(server, client, server_buf);
+    }
+
+    void read(tcp::socket & from, tcp::socket & to, char * buf) {
+        from.async_read_some(asio::buffer(buf, sizeof(client_buf)), boost::bind(
+            &TcpPipe::handle_read, shared_from_this(),
+            asio::placeholders::error, asio::placeholders::bytes_transferred,
+            boost::ref(from), boost::ref(to), buf));
+    }
+
+    void handle_read(const boost::system::error_code & ec, size_t n,
+                     tcp::socket & from, tcp::socket & to, char * buf) {
+        if (ec) {
+            close();
+            return;
+        }
+        asio::async_write(to, asio::buffer(buf, n), boost::bind(
+            &TcpPipe::handle_write, shared_from_this(),
+            asio::placeholders::error, boost::ref(from), boost::ref(to), buf));
+    }
+
+    void handle_write(const boost::system::error_code & ec,
+                      tcp::socket & from, tcp::socket & to, char * buf) {
+        if (ec) {
+            close();
+            return;
+        }
+        read(from, to, buf);
+    }
+
+    void close() {
+        boost::system::error_code ignored;
+        client.close(ignored);
+        server.close(ignored);
+    }
+
+    char client_buf[4096];
+    char server_buf[4096];
+};
+
+
+/* Each client endpoint gets its own socket towards the server, so the
+ * server still tells clients apart by endpoint. Single-threaded. */
+class Proxy {
+public:
+    Proxy(const ProxyParams & _params, asio::io_service & _io_service)
+        : params(_params),
+          io_service(_io_service),
+          rng(params.seed),
+          up(params.up, params.queue, rng),
+          down(params.down, params.queue, rng),
+          acceptor(io_service, tcp::endpoint(tcp::v4(), params.listen_port)),
+          udp_socket(io_service, udp::endpoint(udp::v4(), params.listen_port)),
+          cleanup_timer(io_service)
+    {
+        tcp::resolver resolver(io_service);
+        tcp_target = *resolver.resolve(
+            tcp::resolver::query(tcp::v4(), params.server_name, std::to_string(params.port)));
+        udp_target = udp::endpoint(tcp_target.address(), tcp_target.port());
+
+        accept_tcp();
+        receive_client();
+        schedule_cleanup();
+    }
+
+    void print_counters() const {
+        print_direction("up  ", up.get_counters());
+        print_direction("down", down.get_counters());
+    }
+
+private:
+    struct Flow {
+        Flow(asio::io_service & io_service) : socket(io_service) {}
+
+        udp::socket socket;
+        udp::endpoint client;
+        ptime last_active;
+        char buf[PROXY_BUF_LEN];
+    };
+
+    static void print_direction(const char * name, const Impairment::Counters & c) {
+        cout << name << " -- forwarded " << c.forwarded << ", lost " << c.lost
+             << ", burst lost " << c.burst_lost << ", queue dropped " << c.queue_dropped
+             << ", duplicated " << c.duplicated << ", reordered " << c.reordered << endl;
+    }
+
+    /* TCP */
+
+    void accept_tcp() {
+        auto pipe_p = make_shared<TcpPipe>(io_service);
+        acceptor.async_accept(pipe_p->client, boost::bind(
+            &Proxy::handle_accept_tcp, this, asio::placeholders::error, pipe_p));
+    }
+
+    void handle_accept_tcp(const boost::system::error_code & ec, shared_ptr<TcpPipe> pipe_p) {
+        if (!ec) {
+            pipe_p->start(tcp_target);
+        }
+        accept_tcp();
+    }
+
+    /* UDP */
+
+    void receive_client() {
+        udp_socket.async_receive_from(asio::buffer(client_buf), client_endpoint, boost::bind(
+            &Proxy::handle_receive_client, this,
+            asio::placeholders::error, asio::placeholders::bytes_transferred));
+    }
+
+    void handle_receive_client(const boost::system::error_code & ec, size_t n) {
+        if (!ec) {
+            shared_ptr<Flow> flow_p = find_or_create_flow(client_endpoint);
+            if (flow_p) {
+                flow_p->last_active = microsec_clock::universal_time();
+                forward(up, flow_p, udp_target, string(client_buf, n));
+            }
+        }
+        receive_client();
+    }
+
+    shared_ptr<Flow> find_or_create_flow(const udp::endpoint & client) {
+        auto it = flows.find(client);
+        if (it != flows.end()) {
+            return it->second;
+        }
+        auto flow_p = make_shared<Flow>(io_service);
+        boost::system::error_code ec;
+        flow_p->socket.open(udp::v4(), ec);
+        if (ec) {
+            std::cerr << "can't open a flow socket: " << ec.message() << endl;
+            return shared_ptr<Flow>();
+        }
+        flow_p->client = client;
+        flows[client] = flow_p;
+        receive_server(flow_p);
+        return flow_p;
+    }
+
+    void receive_server(shared_ptr<Flow> flow_p) {
+        flow_p->socket.async_receive(asio::buffer(flow_p->buf), boost::bind(
+            &Proxy::handle_receive_server, this,
+            asio::placeholders::error, asio::placeholders::bytes_transferred, flow_p));
+    }
+
+    void handle_receive_server(const boost::system::error_code & ec, size_t n,
+                               shared_ptr<Flow> flow_p) {
+        if (ec == asio::error::operation_aborted) {
+            return; // flow expired
+        }
+        if (!ec) {
+            forward(down, flow_p, flow_p->client, string(flow_p->buf, n));
+        }
+        receive_server(flow_p);
+    }
+
+    /* Up goes out of the flow's socket, down out of the listening one */
+    void forward(Impairment & impairment, shared_ptr<Flow> flow_p,
+                 udp::endpoint to, string datagram) {
+        ptime times[2];
+        int copies = impairment.schedule(datagram.size(), times);
+        auto datagram_p = make_shared<string>(datagram);
+        bool upstream = &impairment == &up;
+        for (int i = 0; i < copies; ++i) {
+            if (times[i] <= microsec_clock::universal_time()) {
+                send(upstream, flow_p, to, datagram_p);
+                continue;
+            }
+            auto timer_p = make_shared<asio::deadline_timer>(io_service, times[i]);
+            timer_p->async_wait(boost::bind(
+                &Proxy::handle_delay, this, asio::placeholders::error,
+                timer_p, upstream, flow_p, to, datagram_p));
+        }
+    }
+
+    void handle_delay(const boost::system::error_code & ec, shared_ptr<asio::deadline_timer>,
+                      bool upstream, shared_ptr<Flow> flow_p, udp::endpoint to,
+                      shared_ptr<string> datagram_p) {
+        if (!ec) {
+            send(upstream, flow_p, to, datagram_p);
+        }
+    }
+
+    void send(bool upstream, shared_ptr<Flow> flow_p, udp::endpoint to,
+              shared_ptr<string> datagram_p) {
+        udp::socket & socket = upstream ? flow_p->socket : udp_socket;
+        if (!socket.is_open()) {
+            return;
+        }
+        boost::system::error_code ignored;
+        socket.send_to(asio::buffer(*datagram_p), to, 0, ignored);
+    }
+
+    /* Flows of clients gone quiet */
+    void schedule_cleanup() {
+        cleanup_timer.expires_from_now(boost::posix_time::seconds(FLOW_IDLE_TIMEOUT));
+        cleanup_timer.async_wait(boost::bind(&Proxy::cleanup, this, asio::placeholders::error));
+    }
+
+    void cleanup(const boost::system::error_code & ec) {
+        if (ec) {
+            return;
+        }
+        ptime idle_since = microsec_clock::universal_time()
+            - boost::posix_time::seconds(FLOW_IDLE_TIMEOUT);
+        for (auto it = flows.begin(); it != flows.end(); ) {
+            if (it->second->last_active < idle_since) {
+                boost::system::error_code ignored;
+                it->second->socket.close(ignored);
+                flows.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+        schedule_cleanup();
+    }
+
+
+    /* --- DATA --- */
+
+    const ProxyParams & params;
+    asio::io_service & io_service;
+    std::mt19937 rng;
+    Impairment up;
+    Impairment down;
+
+    tcp::acceptor acceptor;
+    tcp::endpoint tcp_target;
+
+    udp::socket udp_socket;
+    udp::endpoint udp_target;
+    udp::endpoint client_endpoint;
+    char client_buf[PROXY_BUF_LEN];
+    map<udp::endpoint, shared_ptr<Flow>> flows;
+    asio::deadline_timer cleanup_timer;
+};
+
+
+static void add_direction_options(boost::program_options::options_description & desc,
+                                  const string & dir, ImpairParams & p) {
+    namespace po = boost::program_options;
+    string to = dir == "up" ? " (client to server)" : " (server to client)";
+    desc.add_options()
+        ((dir + "_loss").c_str(), po::value<double>(&p.loss)->default_value(0),
+         ("probability a datagram is lost" + to).c_str())
+        ((dir + "_burst_enter").c_str(), po::value<double>(&p.burst_enter)->default_value(0),
+         "Gilbert-Elliott: probability of entering the bad state, per datagram")
+        ((dir + "_burst_exit").c_str(), po::value<double>(&p.burst_exit)->default_value(1),
+         "Gilbert-Elliott: probability of leaving the bad state, per datagram")
+        ((dir + "_burst_loss").c_str(), po::value<double>(&p.burst_loss)->default_value(1),
+         "Gilbert-Elliott: loss probability in the bad state")
+        ((dir + "_delay").c_str(), po::value<unsigned long>(&p.delay)->default_value(0),
+         "ms")
+        ((dir + "_jitter").c_str(), po::value<unsigned long>(&p.jitter)->default_value(0),
+         "ms, uniform around the delay")
+        ((dir + "_reorder").c_str(), po::value<double>(&p.reorder)->default_value(0),
+         "probability a datagram skips the delay, overtaking others")
+        ((dir + "_duplicate").c_str(), po::value<double>(&p.duplicate)->default_value(0),
+         "probability a datagram is sent twice")
+        ((dir + "_rate").c_str(), po::value<unsigned long>(&p.rate)->default_value(0),
+         "bandwidth cap in kbit/s, 0 for none")
+    ;
+}
+
+static void print_direction_settings(const string & dir, const ImpairParams & p) {
+    cout << dir << "                  -- loss " << p.loss
+         << ", burst " << p.burst_enter << "/" << p.burst_exit << "/" << p.burst_loss
+         << ", delay " << p.delay << "+-" << p.jitter
+         << ", reorder " << p.reorder << ", duplicate " << p.duplicate
+         << ", rate " << p.rate << endl;
+}
+
+int main(int argc, char** argv) {
+
+try {
+    namespace po = boost::program_options;
+
+    ProxyParams params;
+    po::options_description desc("Options");
+    desc.add_options()
+        ("help,h", "")
+        ("server_name,s", po::value<std::string>(&params.server_name)->default_value("localhost"))
+        ("port,p", po::value<uint16_t>(&params.port)->default_value(DEFAULT_PORT),
+         "server's port")
+        ("listen,l", po::value<uint16_t>(&params.listen_port)->default_value(DEFAULT_LISTEN_PORT),
+         "port clients connect to, TCP and UDP")
+        ("queue", po::value<unsigned long>(&params.queue)->default_value(DEFAULT_QUEUE),
+         "ms of datagrams a rate-capped direction queues before dropping")
+        ("seed", po::value<unsigned long>(&params.seed)->default_value(1),
+         "random seed, for reproducible runs")
+    ;
+    add_direction_options(desc, "up", params.up);
+    add_direction_options(desc, "down", params.down);
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (DEBUG) {
+        cout << "Settings:" << endl;
+        cout << "server_name         -- " << params.server_name << endl;
+        cout << "port                -- " << params.port << endl;
+        cout << "listen              -- " << params.listen_port << endl;
+        cout << "queue               -- " << params.queue << endl;
+        cout << "seed                -- " << params.seed << endl;
+        print_direction_settings("up  ", params.up);
+        print_direction_settings("down", params.down);
+    }
+
+    if (vm.count("help")) {
+        cout << "E-ognisko -- impairment proxy" << endl << desc << endl;
+        return 0;
+    }
+
+    asio::io_service io_service;
+    Proxy proxy(params, io_service);
+    asio::signal_set signals(io_service, SIGINT, SIGTERM);
+    signals.async_wait(boost::bind(&asio::io_service::stop, &io_service));
+    io_service.run();
+    proxy.print_counters();
+} catch (std::exception &e) {
+    cout << e.what() << endl;
+}
+
+    return 0;
+}
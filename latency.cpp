@@ -0,0 +1,45 @@
+#include <chrono>
+#include <cstdio>
+#include "latency.h"
+
+
+uint64_t latency_clock_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count() + 1;
+}
+
+string latency_stamp_word(uint64_t stamp) {
+    return LATENCY_WORD + std::to_string(stamp);
+}
+
+bool parse_latency_stamp(const string & word, uint64_t & stamp) {
+    unsigned long long value;
+    if (word.compare(0, LATENCY_WORD.size(), LATENCY_WORD) != 0
+        || sscanf(word.c_str() + LATENCY_WORD.size(), "%llu", &value) != 1) {
+        return false;
+    }
+    stamp = value;
+    return true;
+}
+
+string latency_echo_word(uint64_t stamp, uint64_t jitter_buffer, uint64_t mix) {
+    return LATENCY_WORD + std::to_string(stamp) + "," + std::to_string(jitter_buffer)
+           + "," + std::to_string(mix);
+}
+
+bool parse_latency_echo(const string & word, uint64_t received, latency_breakdown_t & out) {
+    unsigned long long stamp, jitter_buffer, mix;
+    if (word.compare(0, LATENCY_WORD.size(), LATENCY_WORD) != 0
+        || sscanf(word.c_str() + LATENCY_WORD.size(), "%llu,%llu,%llu",
+                  &stamp, &jitter_buffer, &mix) != 3
+        || stamp > received) {
+        return false;
+    }
+    uint64_t round_trip = received - stamp;
+    uint64_t network = round_trip > jitter_buffer + mix ? round_trip - jitter_buffer - mix : 0;
+    out.uplink = network / 2;
+    out.jitter_buffer = jitter_buffer;
+    out.mix = mix;
+    out.downlink = network - out.uplink;
+    return true;
+}
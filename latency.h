@@ -0,0 +1,41 @@
+#ifndef __latency_h_
+#define __latency_h_
+
+#include <cstdint>
+#include <string>
+
+using std::string;
+
+/* End-to-end timing, for clients that stamp their uploads.
+ *
+ * The client adds its clock to UPLOAD:  UPLOAD <nr> ts=<us>
+ * The server notes when the upload arrived and when its last byte left
+ * the FIFO for the mix; the next DATA or ACK to that client echoes
+ *   ts=<client us>,<jitter buffer us>,<mix us>
+ * -- the stamp, arrival to mixed, and mixed to sent. A stamp is only
+ * ever compared with the clock that made it, so nothing needs the two
+ * clocks in sync: what is left of the round trip is the network, taken
+ * to be the same both ways. */
+const string LATENCY_WORD = "ts=";
+
+/* One echoed stamp, split into stages; microseconds */
+struct latency_breakdown_t {
+    uint64_t uplink;
+    uint64_t jitter_buffer;
+    uint64_t mix;
+    uint64_t downlink;
+};
+
+/* Steady clock in microseconds, never 0 -- 0 means "no stamp" */
+uint64_t latency_clock_us();
+
+string latency_stamp_word(uint64_t stamp);
+bool parse_latency_stamp(const string & word, uint64_t & stamp);
+
+string latency_echo_word(uint64_t stamp, uint64_t jitter_buffer, uint64_t mix);
+
+/* False if word is not an echo; received is latency_clock_us() at the
+ * time the datagram carrying it came in */
+bool parse_latency_echo(const string & word, uint64_t received, latency_breakdown_t &);
+
+#endif
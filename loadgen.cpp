@@ -0,0 +1,772 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <exception>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <boost/program_options.hpp>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <sys/resource.h>
+#include "audio_format.h"
+#include "client_params.h"
+#include "stats.h"
+#include "latency.h"
+
+namespace asio = boost::asio;
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+using std::shared_ptr;
+using std::make_shared;
+using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
+
+
+#ifdef NDEBUG
+    const bool DEBUG = false;
+#else
+    const bool DEBUG = true;
+#endif
+
+const size_t DEFAULT_CLIENTS = 1000;
+const size_t DEFAULT_ROOMS = 1;
+const unsigned long DEFAULT_DURATION = 10;      // s
+const unsigned long DEFAULT_INTERVAL = 5;       // ms of audio per tick
+const size_t DEFAULT_RAMP = 500;                // connections per second
+const unsigned long DEFAULT_PROBE_PERIOD = 500; // ms
+const size_t DEFAULT_THREADS = 1;
+
+const size_t MAX_PENDING = 50000;        // same cap runclient puts on stdin
+const size_t MAX_TRACKED_GAP = 1000;     // longer gaps are counted lost at once
+const int16_t PULSE_AMPLITUDE = 8000;
+const size_t LOADGEN_BUF_LEN = 100000;
+
+typedef struct {
+    string server_name;
+    uint16_t port;
+    size_t clients;
+    size_t rooms;
+    unsigned long duration;
+    unsigned long interval;
+    string format_name;
+    AudioFormat format;     // every client's, asked of its room
+    size_t ramp;
+    unsigned long probe_period;
+    string report_mode;
+    bool retransmit;
+    size_t threads;
+    uint16_t stats_port;
+} LoadgenParams;
+
+/* Totals over all simulated clients, bumped from any strand */
+struct LoadgenStats {
+    Counter connected;
+    Counter failed;       // never got a CLIENT greeting
+    Counter disconnected; // lost the TCP connection midway
+    Counter uploads_sent;
+    Counter uploads_acked;
+    Counter upload_bytes;
+    Counter uploads_resent;
+    Counter input_dropped;  // synthetic input the upload window never took
+    Counter data_received;
+    Counter data_bytes;
+    Counter data_lost;      // missing when the gap was found
+    Counter data_recovered; // filled in later by a RETRANSMIT
+    Counter retransmits_sent;
+    Counter tcp_bytes;
+    LatencyHistogram end_to_end;
+
+    /* Stages of it, from the server's echoes of upload stamps */
+    LatencyHistogram uplink;
+    LatencyHistogram jitter_buffer;
+    LatencyHistogram mix;
+    LatencyHistogram downlink;
+};
+
+/* Probe pulses of a room -- when the latest one went into an upload queue */
+struct RoomProbe {
+    RoomProbe() : pulse_at_ns(0) {}
+    std::atomic<int64_t> pulse_at_ns;
+};
+
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        stats_clock::now().time_since_epoch()).count();
+}
+
+
+/* One simulated client: the runclient protocol, minus stdio. It uploads
+ * silence, except the first client of each room, which now and then
+ * uploads a pulse; every listener times the pulse's arrival in DATA to
+ * measure end-to-end latency through the server's FIFO and mixer.
+ *
+ * All handlers of a client run on its strand. */
+class SimClient {
+public:
+    SimClient(const LoadgenParams & _params, LoadgenStats & _stats, asio::io_service & io_service,
+              const string & _room, RoomProbe & _probe, bool _is_probe)
+        : params(_params),
+          stats(_stats),
+          strand(io_service),
+          tcp_socket(io_service),
+          udp_socket(io_service),
+          tick_timer(io_service),
+          room(_room),
+          probe(_probe),
+          is_probe(_is_probe),
+          alive(false),
+          id(0),
+          acked_once(false),
+          ack(0),
+          win(0),
+          in_flight(false),
+          in_flight_nr(0),
+          waits(0),
+          data_seen(false),
+          nr_first(0),
+          nr_max(0),
+          in_pulse(false),
+          ms_since_pulse(0),
+          lost(0),
+          received(0) {}
+
+    void start(const tcp::endpoint & endpoint) {
+        tcp_socket.async_connect(
+            endpoint,
+            strand.wrap(boost::bind(
+                &SimClient::handle_connect,
+                this,
+                asio::placeholders::error,
+                endpoint))
+        );
+    }
+
+    void stop() {
+        strand.dispatch(boost::bind(&SimClient::close, this));
+    }
+
+    /* Only once the io_service is stopped */
+    double loss() const {
+        uint64_t span = data_seen ? (uint64_t) (nr_max - nr_first) + 1 : 0;
+        if (span == 0) {
+            return 0;
+        }
+        return (double) (lost + missing.size()) / span;
+    }
+
+    bool received_any() const { return data_seen; }
+
+private:
+    /* TCP */
+
+    void handle_connect(const boost::system::error_code & ec, tcp::endpoint endpoint) {
+        if (ec) {
+            stats.failed.add();
+            return;
+        }
+        tcp_socket.async_read_some(
+            asio::buffer(tcp_buf),
+            strand.wrap(boost::bind(
+                &SimClient::handle_greeting,
+                this,
+                asio::placeholders::error,
+                asio::placeholders::bytes_transferred,
+                endpoint))
+        );
+    }
+
+    void handle_greeting(const boost::system::error_code & ec, size_t n, tcp::endpoint endpoint) {
+        std::istringstream istream(string(tcp_buf, n));
+        string command;
+        if (ec || !(istream >> command >> id) || command != "CLIENT") {
+            stats.failed.add();
+            close();
+            return;
+        }
+        stats.tcp_bytes.add(n);
+
+        boost::system::error_code udp_ec;
+        udp_socket.open(udp::v4(), udp_ec);
+        if (!udp_ec) {
+            udp_socket.connect(udp::endpoint(endpoint.address(), endpoint.port()), udp_ec);
+        }
+        if (udp_ec) {
+            stats.failed.add();
+            close();
+            return;
+        }
+
+        alive = true;
+        stats.connected.add();
+
+        std::ostringstream stream;
+        stream << "CLIENT " << id << " report=" << params.report_mode
+               << " format=" << params.format_name;
+        if (room != SERVER_DEFAULT_ROOM) {
+            stream << " room=" << room;
+        }
+        stream << "\n";
+        send(stream.str());
+
+        receive_tcp();
+        receive_udp();
+        next_tick = stats_clock::now();
+        schedule_tick();
+    }
+
+    /* Reports are read and thrown away, so the server never backs off */
+    void receive_tcp() {
+        tcp_socket.async_read_some(
+            asio::buffer(tcp_buf),
+            strand.wrap(boost::bind(
+                &SimClient::handle_receive_tcp,
+                this,
+                asio::placeholders::error,
+                asio::placeholders::bytes_transferred))
+        );
+    }
+
+    void handle_receive_tcp(const boost::system::error_code & ec, size_t n) {
+        if (ec) {
+            if (alive) {
+                stats.disconnected.add();
+                stats.connected.sub();
+            }
+            close();
+            return;
+        }
+        stats.tcp_bytes.add(n);
+        receive_tcp();
+    }
+
+    void close() {
+        alive = false;
+        boost::system::error_code ignored;
+        tick_timer.cancel(ignored);
+        tcp_socket.close(ignored);
+        udp_socket.close(ignored);
+    }
+
+    /* UPLOADS */
+
+    void schedule_tick() {
+        next_tick += std::chrono::milliseconds(params.interval);
+        tick_timer.expires_from_now(boost::posix_time::microseconds(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                next_tick - stats_clock::now()).count()));
+        tick_timer.async_wait(strand.wrap(boost::bind(
+            &SimClient::tick,
+            this,
+            asio::placeholders::error)));
+    }
+
+    void tick(const boost::system::error_code & ec) {
+        if (ec || !alive) {
+            return;
+        }
+        size_t n = params.format.bytes_per(params.interval);
+        bool pulse = false;
+        if (is_probe) {
+            ms_since_pulse += params.interval;
+            if (ms_since_pulse >= params.probe_period) {
+                ms_since_pulse = 0;
+                pulse = true;
+                probe.pulse_at_ns.store(now_ns(), std::memory_order_relaxed);
+            }
+        }
+        if (pending.size() + n > MAX_PENDING) {
+            stats.input_dropped.add(n);
+        } else {
+            size_t start = pending.size();
+            pending.resize(start + n, 0);
+            if (pulse) {
+                write_pulse(&pending[start], n);
+            }
+        }
+        upload();
+        schedule_tick();
+    }
+
+    /* Every sample of the tick at PULSE_AMPLITUDE, in the room's sample type */
+    void write_pulse(char * out, size_t n) {
+        size_t sample_size = params.format.sample_size();
+        char sample[4];
+        if (params.format.sample == SAMPLE_F32) {
+            float value = PULSE_AMPLITUDE / 32768.0f;
+            memcpy(sample, &value, sizeof(value));
+        } else {
+            int16_t value = PULSE_AMPLITUDE;
+            memcpy(sample, &value, sizeof(value));
+        }
+        for (size_t i = 0; i + sample_size <= n; i += sample_size) {
+            memcpy(out + i, sample, sample_size);
+        }
+    }
+
+    void upload() {
+        if (in_flight || !acked_once || win == 0 || pending.empty()) {
+            return;
+        }
+        size_t n = std::min(pending.size(), (size_t) win);
+        last_upload = "UPLOAD " + std::to_string(ack) + " "
+                      + latency_stamp_word(latency_clock_us()) + "\n";
+        last_upload.append(pending.data(), n);
+        pending.erase(pending.begin(), pending.begin() + n);
+        in_flight = true;
+        in_flight_nr = ack;
+        waits = 0;
+        stats.uploads_sent.add();
+        stats.upload_bytes.add(n);
+        send(last_upload);
+    }
+
+    void handle_ack(uint32_t _ack, uint32_t _win, bool from_data) {
+        acked_once = true;
+        win = _win;
+        if (in_flight && _ack > in_flight_nr) {
+            in_flight = false;
+            stats.uploads_acked.add();
+        } else if (in_flight && from_data && ++waits >= 2) {
+            /* Two remixes went by without our upload acked -- resend */
+            waits = 0;
+            stats.uploads_resent.add();
+            send(last_upload);
+        }
+        ack = _ack;
+        upload();
+    }
+
+    /* DOWNLOADS */
+
+    void receive_udp() {
+        udp_socket.async_receive(
+            asio::buffer(udp_buf),
+            strand.wrap(boost::bind(
+                &SimClient::handle_receive_udp,
+                this,
+                asio::placeholders::error,
+                asio::placeholders::bytes_transferred))
+        );
+    }
+
+    void handle_receive_udp(const boost::system::error_code & ec, size_t n) {
+        if (ec || !alive) {
+            return;
+        }
+        char * newline_pos = std::find(udp_buf, udp_buf + n, '\n');
+        if (newline_pos != udp_buf + n) {
+            uint32_t nr, _ack, _win;
+            string header(udp_buf, newline_pos);
+            size_t echo_pos = header.find(" " + LATENCY_WORD);
+            if (echo_pos != string::npos) {
+                record_latency(header.substr(echo_pos + 1));
+            }
+            if (sscanf(header.c_str(), "DATA %u %u %u", &nr, &_ack, &_win) == 3) {
+                handle_ack(_ack, _win, true);
+                handle_data(nr, newline_pos + 1, udp_buf + n);
+            } else if (sscanf(header.c_str(), "ACK %u %u", &_ack, &_win) == 2) {
+                handle_ack(_ack, _win, false);
+            }
+        }
+        receive_udp();
+    }
+
+    void record_latency(const string & word) {
+        latency_breakdown_t sample;
+        if (parse_latency_echo(word, latency_clock_us(), sample)) {
+            stats.uplink.record(sample.uplink * 1000);
+            stats.jitter_buffer.record(sample.jitter_buffer * 1000);
+            stats.mix.record(sample.mix * 1000);
+            stats.downlink.record(sample.downlink * 1000);
+        }
+    }
+
+    void handle_data(uint32_t nr, const char * begin, const char * end) {
+        stats.data_received.add();
+        stats.data_bytes.add(end - begin);
+
+        if (!data_seen) {
+            data_seen = true;
+            nr_first = nr;
+            nr_max = nr;
+        } else if (nr > nr_max) {
+            uint32_t gap = nr - nr_max - 1;
+            if (gap > 0) {
+                stats.data_lost.add(gap);
+                if (gap > MAX_TRACKED_GAP) {
+                    lost += gap;
+                } else {
+                    for (uint32_t missed = nr_max + 1; missed < nr; ++missed) {
+                        missing.insert(missed);
+                    }
+                }
+                if (params.retransmit) {
+                    stats.retransmits_sent.add();
+                    send("RETRANSMIT " + std::to_string(nr_max + 1) + "\n");
+                }
+            }
+            nr_max = nr;
+        } else {
+            if (missing.erase(nr) > 0) {
+                stats.data_recovered.add();
+            }
+            return; // old audio, don't time pulses on it
+        }
+        while (!missing.empty() && *missing.begin() + MAX_TRACKED_GAP < nr_max) {
+            missing.erase(missing.begin());
+            ++lost;
+        }
+        ++received;
+        detect_pulse(begin, end);
+    }
+
+    /* The rising edge of a pulse -- other clients upload silence */
+    void detect_pulse(const char * begin, const char * end) {
+        bool loud = false;
+        for (const char * p = begin; p < end; ++p) {
+            if (*p != 0) {
+                loud = true;
+                break;
+            }
+        }
+        if (loud && !in_pulse) {
+            int64_t pulse_at = probe.pulse_at_ns.load(std::memory_order_relaxed);
+            if (pulse_at != 0) {
+                int64_t latency = now_ns() - pulse_at;
+                stats.end_to_end.record(latency > 0 ? latency : 0);
+            }
+        }
+        in_pulse = loud;
+    }
+
+    void send(const string & datagram) {
+        auto datagram_p = make_shared<string>(datagram);
+        udp_socket.async_send(
+            asio::buffer(*datagram_p),
+            strand.wrap(boost::bind(
+                &SimClient::handle_send,
+                this,
+                asio::placeholders::error,
+                datagram_p))
+        );
+    }
+
+    void handle_send(const boost::system::error_code & ec, shared_ptr<string> datagram_p) {}
+
+
+    /* --- DATA --- */
+
+    const LoadgenParams & params;
+    LoadgenStats & stats;
+    asio::io_service::strand strand;
+
+    tcp::socket tcp_socket;
+    udp::socket udp_socket;
+    asio::deadline_timer tick_timer;
+    stats_clock::time_point next_tick;
+    char tcp_buf[4096];
+    char udp_buf[LOADGEN_BUF_LEN];
+
+    string room;
+    RoomProbe & probe;
+    bool is_probe;
+    bool alive;
+    uint32_t id;
+
+    /* UPLOADS */
+    bool acked_once;
+    uint32_t ack;
+    uint32_t win;
+    bool in_flight;
+    uint32_t in_flight_nr;
+    int waits;
+    vector<char> pending;
+    string last_upload;
+
+    /* DOWNLOADS */
+    bool data_seen;
+    uint32_t nr_first;
+    uint32_t nr_max;
+    std::set<uint32_t> missing;
+    bool in_pulse;
+    unsigned long ms_since_pulse;
+    uint64_t lost;
+    uint64_t received;
+};
+
+
+/* STATS SCRAPING */
+
+/* Reads one counter off the server's stats endpoint, -1 if it can't */
+static double scrape_counter(const LoadgenParams & params, const string & name) {
+    if (params.stats_port == 0) {
+        return -1;
+    }
+    try {
+        asio::io_service io_service;
+        tcp::resolver resolver(io_service);
+        tcp::socket socket(io_service);
+        asio::connect(socket, resolver.resolve(
+            tcp::resolver::query(params.server_name, std::to_string(params.stats_port))));
+        string request = "GET /metrics HTTP/1.0\r\n\r\n";
+        asio::write(socket, asio::buffer(request));
+
+        asio::streambuf response;
+        boost::system::error_code ec;
+        asio::read(socket, response, ec);
+        std::istream stream(&response);
+        string line;
+        while (std::getline(stream, line)) {
+            if (line.compare(0, name.size() + 1, name + " ") == 0) {
+                return std::stod(line.substr(name.size() + 1));
+            }
+        }
+    } catch (std::exception & e) {
+        std::cerr << "can't scrape " << name << ": " << e.what() << endl;
+    }
+    return -1;
+}
+
+
+/* REPORTING */
+
+struct Totals {
+    uint64_t uploads_acked, upload_bytes, data_received, data_bytes, data_lost;
+};
+
+static Totals take_totals(LoadgenStats & stats) {
+    Totals totals = {stats.uploads_acked.get(), stats.upload_bytes.get(),
+                     stats.data_received.get(), stats.data_bytes.get(), stats.data_lost.get()};
+    return totals;
+}
+
+static void print_interval(LoadgenStats & stats, const Totals & was, const Totals & is,
+                           double seconds, double elapsed) {
+    uint64_t data = is.data_received - was.data_received;
+    uint64_t lost = is.data_lost - was.data_lost;
+    printf("t=%.0fs clients=%llu uploads/s=%.0f up_kB/s=%.0f data/s=%.0f down_kB/s=%.0f "
+           "loss=%.2f%% e2e_p50=%.1fms e2e_p99=%.1fms\n",
+           elapsed,
+           (unsigned long long) stats.connected.get(),
+           (is.uploads_acked - was.uploads_acked) / seconds,
+           (is.upload_bytes - was.upload_bytes) / seconds / 1000,
+           data / seconds,
+           (is.data_bytes - was.data_bytes) / seconds / 1000,
+           data + lost > 0 ? 100.0 * lost / (data + lost) : 0.0,
+           stats.end_to_end.quantile(0.5) / 1e6,
+           stats.end_to_end.quantile(0.99) / 1e6);
+    fflush(stdout);
+}
+
+static double percentile(vector<double> & values, double q) {
+    if (values.empty()) {
+        return 0;
+    }
+    size_t i = std::min(values.size() - 1, (size_t) (q * values.size()));
+    std::nth_element(values.begin(), values.begin() + i, values.end());
+    return values[i];
+}
+
+static void print_summary(const LoadgenParams & params, LoadgenStats & stats,
+                          const vector<shared_ptr<SimClient>> & clients,
+                          double seconds, double underruns, double overruns) {
+    vector<double> losses;
+    for (auto & client_p : clients) {
+        if (client_p->received_any()) {
+            losses.push_back(100 * client_p->loss());
+        }
+    }
+
+    printf("\nSummary over %.1fs:\n", seconds);
+    printf("clients         -- %zu started, %llu connected, %llu failed, %llu disconnected\n",
+           clients.size(),
+           (unsigned long long) stats.connected.get(),
+           (unsigned long long) stats.failed.get(),
+           (unsigned long long) stats.disconnected.get());
+    printf("upstream        -- %.0f uploads/s, %.0f kB/s, %llu resent, %llu kB input dropped\n",
+           stats.uploads_acked.get() / seconds,
+           stats.upload_bytes.get() / seconds / 1000,
+           (unsigned long long) stats.uploads_resent.get(),
+           (unsigned long long) stats.input_dropped.get() / 1000);
+    printf("downstream      -- %.0f DATA/s, %.0f kB/s, %llu RETRANSMITs, %llu recovered\n",
+           stats.data_received.get() / seconds,
+           stats.data_bytes.get() / seconds / 1000,
+           (unsigned long long) stats.retransmits_sent.get(),
+           (unsigned long long) stats.data_recovered.get());
+    printf("loss per client -- p50=%.2f%% p99=%.2f%% max=%.2f%%\n",
+           percentile(losses, 0.5), percentile(losses, 0.99), percentile(losses, 1.0));
+    printf("end to end      -- p50=%.1fms p90=%.1fms p99=%.1fms p99.9=%.1fms\n",
+           stats.end_to_end.quantile(0.5) / 1e6,
+           stats.end_to_end.quantile(0.9) / 1e6,
+           stats.end_to_end.quantile(0.99) / 1e6,
+           stats.end_to_end.quantile(0.999) / 1e6);
+    printf("stages, p50/p99 -- uplink %.1f/%.1fms, jitter buffer %.1f/%.1fms, mix %.1f/%.1fms,"
+           " downlink %.1f/%.1fms\n",
+           stats.uplink.quantile(0.5) / 1e6, stats.uplink.quantile(0.99) / 1e6,
+           stats.jitter_buffer.quantile(0.5) / 1e6, stats.jitter_buffer.quantile(0.99) / 1e6,
+           stats.mix.quantile(0.5) / 1e6, stats.mix.quantile(0.99) / 1e6,
+           stats.downlink.quantile(0.5) / 1e6, stats.downlink.quantile(0.99) / 1e6);
+    if (underruns >= 0) {
+        printf("server FIFOs    -- %.0f underruns, %.0f overruns\n", underruns, overruns);
+    } else {
+        printf("server FIFOs    -- unknown (pass --stats_port)\n");
+    }
+    fflush(stdout);
+}
+
+
+/* Two sockets per client */
+static void raise_fd_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+void run_loadgen(const LoadgenParams & params) {
+    raise_fd_limit();
+    asio::io_service io_service;
+    LoadgenStats stats;
+
+    tcp::resolver resolver(io_service);
+    tcp::endpoint endpoint = *resolver.resolve(
+        tcp::resolver::query(tcp::v4(), params.server_name, std::to_string(params.port)));
+
+    vector<RoomProbe> probes(params.rooms);
+    vector<shared_ptr<SimClient>> clients;
+    for (size_t i = 0; i < params.clients; ++i) {
+        size_t room_nr = i % params.rooms;
+        string room = params.rooms == 1 ? SERVER_DEFAULT_ROOM : "load" + std::to_string(room_nr);
+        clients.push_back(make_shared<SimClient>(
+            params, stats, io_service, room, probes[room_nr], i < params.rooms));
+    }
+
+    double underruns_before = scrape_counter(params, "eognisko_fifo_underruns_total");
+    double overruns_before = scrape_counter(params, "eognisko_fifo_overruns_total");
+
+    /* Connections go out in slices of a tenth of a second */
+    asio::io_service::work work(io_service);
+    boost::thread_group threads;
+    for (size_t i = 0; i < params.threads; ++i) {
+        threads.create_thread(boost::bind(&asio::io_service::run, &io_service));
+    }
+
+    auto started = stats_clock::now();
+    auto deadline = started + std::chrono::seconds(params.duration);
+    auto next_report = started + std::chrono::seconds(1);
+    size_t per_slice = std::max(params.ramp / 10, (size_t) 1);
+    size_t launched = 0;
+    Totals was = take_totals(stats);
+
+    while (stats_clock::now() < deadline) {
+        for (size_t i = 0; i < per_slice && launched < clients.size(); ++i) {
+            clients[launched++]->start(endpoint);
+        }
+        boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+        if (stats_clock::now() >= next_report) {
+            Totals is = take_totals(stats);
+            print_interval(stats, was, is, 1,
+                std::chrono::duration<double>(stats_clock::now() - started).count());
+            was = is;
+            next_report += std::chrono::seconds(1);
+        }
+    }
+
+    for (auto & client_p : clients) {
+        client_p->stop();
+    }
+    io_service.stop();
+    threads.join_all();
+
+    double seconds = std::chrono::duration<double>(stats_clock::now() - started).count();
+    double underruns = scrape_counter(params, "eognisko_fifo_underruns_total");
+    double overruns = scrape_counter(params, "eognisko_fifo_overruns_total");
+    if (underruns >= 0 && underruns_before >= 0) {
+        underruns -= underruns_before;
+        overruns -= overruns_before;
+    }
+    print_summary(params, stats, clients, seconds, underruns, overruns);
+}
+
+int main(int argc, char** argv) {
+
+try {
+    namespace po = boost::program_options;
+
+    LoadgenParams params;
+    po::options_description desc("Options");
+    desc.add_options()
+        ("help,h", "")
+        ("server_name,s", po::value<std::string>(&params.server_name)->required())
+        ("port,p", po::value<uint16_t>(&params.port)->default_value(DEFAULT_PORT))
+        ("clients,n", po::value<size_t>(&params.clients)->default_value(DEFAULT_CLIENTS),
+         "simulated clients")
+        ("rooms", po::value<size_t>(&params.rooms)->default_value(DEFAULT_ROOMS),
+         "rooms to spread the clients over")
+        ("duration,d", po::value<unsigned long>(&params.duration)->default_value(DEFAULT_DURATION),
+         "seconds to run")
+        ("interval,i", po::value<unsigned long>(&params.interval)->default_value(DEFAULT_INTERVAL),
+         "ms of audio each client produces per tick")
+        ("format,f", po::value<std::string>(&params.format_name)
+                         ->default_value(audio_format_name(DEFAULT_AUDIO_FORMAT)),
+         "rate:sample:channels the clients upload, e.g. 48000:s16:1")
+        ("ramp", po::value<size_t>(&params.ramp)->default_value(DEFAULT_RAMP),
+         "connections opened per second")
+        ("probe_period", po::value<unsigned long>(&params.probe_period)->default_value(DEFAULT_PROBE_PERIOD),
+         "ms between latency pulses in each room")
+        ("report,r", po::value<std::string>(&params.report_mode)->default_value("self"),
+         "report format asked for: full, delta or self")
+        ("retransmit", po::value<bool>(&params.retransmit)->default_value(true),
+         "ask for lost DATA like runclient does")
+        ("threads,t", po::value<size_t>(&params.threads)->default_value(DEFAULT_THREADS))
+        ("stats_port", po::value<uint16_t>(&params.stats_port)->default_value(0),
+         "server's stats port, to read its FIFO underruns (0: don't)")
+    ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    if (vm.count("help")) {
+        cout << "E-ognisko -- load generator" << endl << desc << endl;
+        return 0;
+    }
+    po::notify(vm);
+    params.rooms = std::max(params.rooms, (size_t) 1);
+    params.interval = std::max(params.interval, 1UL);
+    params.threads = std::max(params.threads, (size_t) 1);
+    if (!parse_audio_format(params.format_name, params.format)) {
+        throw std::invalid_argument("bad format: " + params.format_name);
+    }
+
+    if (DEBUG) {
+        cout << "Settings:" << endl;
+        cout << "server_name         -- " << params.server_name << endl;
+        cout << "port                -- " << params.port << endl;
+        cout << "clients             -- " << params.clients << endl;
+        cout << "rooms               -- " << params.rooms << endl;
+        cout << "duration            -- " << params.duration << endl;
+        cout << "interval            -- " << params.interval << endl;
+        cout << "format              -- " << params.format_name << endl;
+        cout << "ramp                -- " << params.ramp << endl;
+        cout << "probe_period        -- " << params.probe_period << endl;
+        cout << "report              -- " << params.report_mode << endl;
+        cout << "retransmit          -- " << params.retransmit << endl;
+        cout << "threads             -- " << params.threads << endl;
+        cout << "stats_port          -- " << params.stats_port << endl;
+    }
+
+    run_loadgen(params);
+} catch (std::exception &e) {
+    cout << e.what() << endl;
+}
+
+    return 0;
+}
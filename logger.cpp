@@ -0,0 +1,200 @@
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include "logger.h"
+
+using std::memory_order_relaxed;
+using std::memory_order_acquire;
+using std::memory_order_release;
+
+static const char * level_names[] = { "INFO", "WARN", "ERROR" };
+
+static std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+
+
+Logger & Logger::instance() {
+    static Logger logger;
+    return logger;
+}
+
+Logger::Logger()
+    : ring(RING_SIZE),
+      enqueue_pos(0),
+      dequeue_pos(0),
+      limiters(LIMITER_SLOTS),
+      dropped(0),
+      suppressed(0),
+      dropped_reported(0),
+      stopping(false)
+{
+    for (size_t i = 0; i < RING_SIZE; ++i) {
+        ring[i].seq.store(i, memory_order_relaxed);
+    }
+    for (size_t i = 0; i < LIMITER_SLOTS; ++i) {
+        limiters[i].window.store(0, memory_order_relaxed);
+        limiters[i].count.store(0, memory_order_relaxed);
+        limiters[i].suppressed.store(0, memory_order_relaxed);
+    }
+    drainer = std::thread(&Logger::drain_loop, this);
+}
+
+Logger::~Logger() {
+    stopping.store(true, memory_order_release);
+    drainer.join();
+}
+
+double Logger::now() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+/* RATE LIMITING */
+
+Logger::Limiter & Logger::limiter_for(const char * key, uint64_t client) {
+    /* FNV-1a over the key, then the client mixed in */
+    uint64_t hash = 14695981039346656037ULL;
+    for (const char * c = key; *c; ++c) {
+        hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+    }
+    hash = (hash ^ client) * 1099511628211ULL;
+    return limiters[(hash >> 17) % LIMITER_SLOTS];
+}
+
+/* Colliding (key, client) pairs share a budget -- good enough for a log. */
+bool Logger::admit(const char * key, uint64_t client) {
+    Limiter & limiter = limiter_for(key, client);
+    uint32_t second = (uint32_t) now() + 1;
+
+    uint32_t window = limiter.window.load(memory_order_relaxed);
+    if (window != second
+        && limiter.window.compare_exchange_strong(window, second, memory_order_relaxed)) {
+        limiter.count.store(0, memory_order_relaxed);
+    }
+    if (limiter.count.fetch_add(1, memory_order_relaxed) < LOG_BURST) {
+        return true;
+    }
+    limiter.suppressed.fetch_add(1, memory_order_relaxed);
+    suppressed.fetch_add(1, memory_order_relaxed);
+    return false;
+}
+
+/* RING -- bounded MPSC queue, each slot carries a sequence number telling
+ * whose turn it is (producer at pos: seq == pos, consumer: seq == pos + 1). */
+
+Logger::Record * Logger::claim() {
+    size_t pos = enqueue_pos.load(memory_order_relaxed);
+    while (true) {
+        Record & record = ring[pos & (RING_SIZE - 1)];
+        size_t seq = record.seq.load(memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                return &record;
+            }
+        } else if (diff < 0) {
+            dropped.fetch_add(1, memory_order_relaxed);
+            return NULL;
+        } else {
+            pos = enqueue_pos.load(memory_order_relaxed);
+        }
+    }
+}
+
+void Logger::publish(Record * record) {
+    size_t pos = record->seq.load(memory_order_relaxed);
+    record->seq.store(pos + 1, memory_order_release);
+}
+
+void Logger::write(log_level_t level, const char * key, uint64_t client, const char * fmt, ...) {
+    Record * record = claim();
+    if (record == NULL) {
+        return;
+    }
+    record->raw = false;
+    record->level = level;
+    record->client = client;
+    record->suppressed = limiter_for(key, client).suppressed.exchange(0, memory_order_relaxed);
+    record->time = now();
+    strncpy(record->key, key, KEY_LEN - 1);
+    record->key[KEY_LEN - 1] = '\0';
+
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(record->text, TEXT_LEN, fmt, args);
+    va_end(args);
+
+    publish(record);
+}
+
+void Logger::print(const string & text) {
+    for (size_t offset = 0; offset < text.size(); offset += TEXT_LEN - 1) {
+        Record * record = claim();
+        if (record == NULL) {
+            return;
+        }
+        record->raw = true;
+        size_t len = std::min(text.size() - offset, TEXT_LEN - 1);
+        memcpy(record->text, text.data() + offset, len);
+        record->text[len] = '\0';
+        publish(record);
+    }
+}
+
+/* DRAINING */
+
+bool Logger::drain(string & out) {
+    bool any = false;
+    while (true) {
+        Record & record = ring[dequeue_pos & (RING_SIZE - 1)];
+        size_t seq = record.seq.load(memory_order_acquire);
+        if (seq != dequeue_pos + 1) {
+            break;
+        }
+        if (record.raw) {
+            out += record.text;
+        } else {
+            char prefix[96];
+            snprintf(prefix, sizeof(prefix), "[%11.6f] %s %s ",
+                     record.time, level_names[record.level], record.key);
+            out += prefix;
+            if (record.client != LOG_NO_CLIENT) {
+                out += "client=" + std::to_string(record.client) + " ";
+            }
+            out += record.text;
+            if (record.suppressed > 0) {
+                out += " (" + std::to_string(record.suppressed) + " similar suppressed)";
+            }
+            out += "\n";
+        }
+        record.seq.store(dequeue_pos + RING_SIZE, memory_order_release);
+        ++dequeue_pos;
+        any = true;
+    }
+
+    uint64_t dropped_now = get_dropped();
+    if (dropped_now != dropped_reported) {
+        out += "[logger] " + std::to_string(dropped_now - dropped_reported)
+             + " lines dropped, ring full\n";
+        dropped_reported = dropped_now;
+    }
+    return any;
+}
+
+void Logger::drain_loop() {
+    string out;
+    while (true) {
+        bool stop = stopping.load(memory_order_acquire);
+        out.clear();
+        bool any = drain(out);
+        if (!out.empty()) {
+            fwrite(out.data(), 1, out.size(), stderr);
+            fflush(stderr);
+        }
+        if (stop) {
+            return;
+        }
+        if (!any) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+    }
+}
@@ -0,0 +1,96 @@
+#ifndef __logger_h_
+#define __logger_h_
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+enum log_level_t { LOG_INFO, LOG_WARN, LOG_ERROR };
+
+const uint64_t LOG_NO_CLIENT = UINT64_MAX;
+
+/* Asynchronous, rate-limited logger.
+ *
+ * Handlers format a line straight into a slot of a bounded lock-free ring
+ * (many producers, one consumer); a background thread drains the ring to
+ * stderr. Nothing on the producer side blocks: when the ring is full the
+ * line is dropped and counted.
+ *
+ * Lines are rate-limited per (key, client): at most LOG_BURST lines per
+ * second, the rest only bump a suppressed counter that is reported with
+ * the next line that gets through. Use the LOG macro, so that suppressed
+ * lines don't even evaluate their arguments. */
+class Logger {
+public:
+    static const size_t RING_SIZE = 4096; // power of two
+    static const size_t TEXT_LEN = 240;
+    static const size_t KEY_LEN = 32;
+    static const uint32_t LOG_BURST = 5;
+    static const size_t LIMITER_SLOTS = 4096;
+
+    static Logger & instance();
+    ~Logger();
+
+    bool admit(const char * key, uint64_t client);
+    void write(log_level_t, const char * key, uint64_t client, const char * fmt, ...)
+        __attribute__((format(printf, 5, 6)));
+    void print(const string &); // verbatim, not rate-limited
+
+    uint64_t get_dropped() const { return dropped.load(std::memory_order_relaxed); }
+    uint64_t get_suppressed() const { return suppressed.load(std::memory_order_relaxed); }
+
+private:
+    struct Record {
+        std::atomic<size_t> seq;
+        bool raw;
+        log_level_t level;
+        uint64_t client;
+        uint32_t suppressed;
+        double time;
+        char key[KEY_LEN];
+        char text[TEXT_LEN];
+    };
+
+    struct Limiter {
+        std::atomic<uint32_t> window;
+        std::atomic<uint32_t> count;
+        std::atomic<uint32_t> suppressed;
+    };
+
+    Logger();
+    Record * claim();
+    void publish(Record *);
+    Limiter & limiter_for(const char * key, uint64_t client);
+    double now();
+
+    void drain_loop();
+    bool drain(string & out);
+
+    vector<Record> ring;
+    std::atomic<size_t> enqueue_pos;
+    size_t dequeue_pos;
+
+    vector<Limiter> limiters;
+
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint64_t> suppressed;
+    uint64_t dropped_reported;
+
+    std::atomic<bool> stopping;
+    std::thread drainer;
+};
+
+#define LOG(level, key, client, ...)                                    \
+    do {                                                                \
+        if (Logger::instance().admit((key), (client))) {                \
+            Logger::instance().write((level), (key), (client), __VA_ARGS__); \
+        }                                                               \
+    } while (0)
+
+#endif
@@ -0,0 +1,85 @@
+#include <algorithm>
+#include "mix_pool.h"
+
+MixPool::MixPool(size_t count)
+    : stopping(false)
+{
+    for (size_t i = 0; i < count; ++i) {
+        threads.push_back(std::thread(&MixPool::work, this));
+    }
+}
+
+MixPool::~MixPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wakeup.notify_all();
+    for (auto it = threads.begin(); it != threads.end(); ++it) {
+        it->join();
+    }
+}
+
+/* Blocks are whole cache lines, about one per core, and never more than
+ * MIX_BLOCK_MAX bytes, so a block's output stays in cache while every
+ * input is added to it. */
+void MixPool::mix(struct mixer_input* inputs, size_t n,
+                  void* output_buf, size_t* output_size,
+                  unsigned long tx_interval_ms,
+                  const AudioFormat & format) {
+    size_t frames = mixer_prepare(inputs, n, output_size, tx_interval_ms, format);
+    if (threads.empty() || frames * format.channels * n < PARALLEL_MIX_MIN_WORK) {
+        mix_range(inputs, n, output_buf, 0, frames, format);
+        return;
+    }
+
+    size_t align = std::max<size_t>(MIX_BLOCK_ALIGN / format.frame_size(), 1);
+    size_t block = (frames + threads.size()) / (threads.size() + 1);
+    block = (block + align - 1) / align * align;
+    block = std::min(block, MIX_BLOCK_MAX / format.frame_size() / align * align);
+    Job job = {inputs, n, output_buf, &format, frames, block, (frames + block - 1) / block, 0, 0};
+    if (job.blocks == 1) {
+        mix_range(inputs, n, output_buf, 0, frames, format);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    jobs.push_back(&job);
+    wakeup.notify_all();
+    while (take_block(&job, lock)) {}
+    finished.wait(lock, [&job] { return job.done == job.blocks; });
+}
+
+/* Mixes the job's next block, unlocked meanwhile; false if none is left.
+ * A job leaves the queue with its last block taken, and its caller, who
+ * waits for every block to be done, keeps it alive until then. */
+bool MixPool::take_block(Job * job, std::unique_lock<std::mutex> & lock) {
+    if (job->next == job->blocks) {
+        return false;
+    }
+    size_t from = job->next * job->block;
+    size_t to = std::min(from + job->block, job->frames);
+    if (++job->next == job->blocks) {
+        jobs.erase(std::find(jobs.begin(), jobs.end(), job));
+    }
+
+    lock.unlock();
+    mix_range(job->inputs, job->n, job->output, from, to, *job->format);
+    lock.lock();
+
+    if (++job->done == job->blocks) {
+        finished.notify_all();
+    }
+    return true;
+}
+
+void MixPool::work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wakeup.wait(lock, [this] { return stopping || !jobs.empty(); });
+        if (stopping) {
+            return;
+        }
+        take_block(jobs.front(), lock);
+    }
+}
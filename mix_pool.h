@@ -0,0 +1,62 @@
+#ifndef __mix_pool_h_
+#define __mix_pool_h_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "mixer.h"
+
+using std::vector;
+
+const size_t MIX_BLOCK_ALIGN = 64;           // bytes: one cache line
+const size_t MIX_BLOCK_MAX = 16384;          // bytes of output
+const size_t PARALLEL_MIX_MIN_WORK = 32768;  // sample additions worth splitting
+
+/* Persistent threads that mix one output in blocks of frames. The
+ * caller works on its own mix too, so a pool of N threads mixes on up to
+ * N + 1 cores; the threads are started once, never per tick. Rooms on
+ * different strands may mix at the same time -- their blocks are
+ * handed out in turn.
+ *
+ * Each block gets every input, in order, so the result is the same as
+ * the serial mixer()'s, limiter included. */
+class MixPool {
+public:
+    MixPool(size_t threads);
+    ~MixPool();
+
+    /* Same contract as mixer() */
+    void mix(struct mixer_input* inputs, size_t n,
+             void* output_buf, size_t* output_size,
+             unsigned long tx_interval_ms,
+             const AudioFormat & format = DEFAULT_AUDIO_FORMAT);
+
+    size_t size() const { return threads.size(); }
+
+private:
+    struct Job {
+        const struct mixer_input* inputs;
+        size_t n;
+        void* output;
+        const AudioFormat * format;
+        size_t frames;
+        size_t block;
+        size_t blocks;
+        size_t next;  // first block nobody took
+        size_t done;
+    };
+
+    bool take_block(Job *, std::unique_lock<std::mutex> &);
+    void work();
+
+    std::mutex mutex;
+    std::condition_variable wakeup;   // jobs queued, or stopping
+    std::condition_variable finished; // a job's last block is done
+    std::deque<Job*> jobs;            // with blocks left to take
+    bool stopping;
+    vector<std::thread> threads;
+};
+
+#endif
@@ -5,36 +5,175 @@
 #include "mixer.h"
 
 
-void mixer(struct mixer_input* inputs, size_t n,
-           void* output_buf, size_t* output_size,
-           unsigned long tx_interval_ms)
+/* Per sample type: what it's summed in, its full scale, how an input
+ * sample is taken, the way back, and what it's metered in. Sums of 16-bit samples are exact in float up
+ * to 2^24; their meter stays integer, so its loop vectorizes too. */
+template <typename Sample> struct SampleMix;
+
+template <> struct SampleMix<int16_t> {
+    typedef float wide_t;
+    static float full_scale() { return INT16_MAX; }
+    static int16_t clean(int16_t x) { return x; }
+    static int16_t narrow(float x) { return (int16_t) (x < 0 ? x - 0.5f : x + 0.5f); }
+    typedef uint32_t level_t;
+    typedef uint64_t squares_t;
+    static uint32_t magnitude(int16_t x) { return x < 0 ? -(int32_t) x : x; }
+};
+
+template <> struct SampleMix<float> {
+    typedef double wide_t;
+    static double full_scale() { return 1.0; }
+    static float clean(float x) { return clean_sample(x); }
+    static float narrow(double x) { return (float) x; }
+    typedef double level_t;
+    typedef double squares_t;
+    static double magnitude(float x) { return std::min(32768.0, 32768.0 * (x < 0 ? -x : x)); }
+};
+
+void mixer_meter::reset() {
+    samples = 0;
+    sum_squares = 0;
+    peak = 0;
+    clips = 0;
+}
+
+/* Adds a chunk's worth to the meter: one atomic add per count */
+template <typename Level, typename Squares>
+static void meter_add(struct mixer_meter* meter, size_t samples,
+                      Squares squares, Level peak, size_t clips) {
+    meter->samples.fetch_add(samples, std::memory_order_relaxed);
+    meter->sum_squares.fetch_add((uint64_t) squares, std::memory_order_relaxed);
+    meter->clips.fetch_add(clips, std::memory_order_relaxed);
+    uint32_t seen = meter->peak.load(std::memory_order_relaxed);
+    while (seen < (uint32_t) peak
+           && !meter->peak.compare_exchange_weak(seen, (uint32_t) peak, std::memory_order_relaxed)) {}
+}
+
+/* Transparent up to the knee, then bends towards full scale without
+ * reaching it; the slope is continuous, so there is no hard edge to
+ * crackle on. */
+template <typename Wide>
+static inline Wide limit(Wide x, Wide full_scale) {
+    Wide knee = LIMITER_KNEE * full_scale;
+    Wide magnitude = x < 0 ? -x : x;
+    if (magnitude <= knee) {
+        return x;
+    }
+    Wide range = full_scale - knee;
+    Wide excess = magnitude - knee;
+    Wide limited = knee + range * excess / (excess + range);
+    return x < 0 ? -limited : limited;
+}
+
+/* One pass per MIX_CHUNK samples: every input, scaled by its gain, is
+ * added into a wide accumulator that stays in L1, and only the limited
+ * sum is written out. Metered inputs are measured in the same loop.
+ * Inputs are added whole samples at a time, so one ending in a partial
+ * frame still gives all its samples. */
+template <typename Sample, unsigned Channels>
+static void mix_frames(const struct mixer_input* inputs, size_t n,
+                       Sample* result_data, size_t from, size_t to)
 {
     using std::min;
-    using std::max;
+    typedef typename SampleMix<Sample>::wide_t wide_t;
 
-    size_t wanted_2bytes = 176 * (size_t) tx_interval_ms / 2;
-    size_t avaiable_2bytes = *output_size / 2;
-    size_t result_size = min(wanted_2bytes, avaiable_2bytes); 
-    
-    *output_size = 2 * result_size;
+    wide_t accumulator[MIX_CHUNK];
+    const wide_t full_scale = SampleMix<Sample>::full_scale();
+    size_t first = from * Channels;
+    size_t last = to * Channels;
+
+    for (size_t chunk = first; chunk < last; chunk += MIX_CHUNK)
+    {
+        size_t chunk_end = min(chunk + MIX_CHUNK, last);
+        std::fill(accumulator, accumulator + (chunk_end - chunk), wide_t(0));
+
+        for (size_t i = 0; i < n; ++i) 
+        {
+            const Sample* input_data = (const Sample*) inputs[i].data + chunk;
+            size_t input_used = min(inputs[i].consumed / sizeof(Sample), chunk_end);
+            const wide_t gain = inputs[i].gain;
+
+            if (!inputs[i].meter) {
+                for (size_t j = 0; j + chunk < input_used; ++j) {
+                    accumulator[j] += gain * SampleMix<Sample>::clean(input_data[j]);
+                }
+                continue;
+            }
+
+            typename SampleMix<Sample>::squares_t squares = 0;
+            typename SampleMix<Sample>::level_t peak = 0;
+            uint32_t clips = 0;
+            size_t count = input_used > chunk ? input_used - chunk : 0;
+            for (size_t j = 0; j < count; ++j) {
+                Sample sample = SampleMix<Sample>::clean(input_data[j]);
+                accumulator[j] += gain * sample;
+                typename SampleMix<Sample>::level_t magnitude = SampleMix<Sample>::magnitude(sample);
+                squares += (typename SampleMix<Sample>::squares_t) magnitude * magnitude;
+                peak = std::max(peak, magnitude);
+                clips += magnitude >= (typename SampleMix<Sample>::level_t) CLIP_LEVEL;
+            }
+            meter_add(inputs[i].meter, count, squares, peak, clips);
+        }
 
-    memset(output_buf, 0, 2 * result_size);
+        for (size_t j = chunk; j < chunk_end; ++j) {
+            result_data[j] = SampleMix<Sample>::narrow(limit(accumulator[j - chunk], full_scale));
+        }
+    }
+}
 
-    int16_t* result_data = (int16_t*) output_buf;
+/* Sizes the output and sets what each input gives to it */
+size_t mixer_prepare(struct mixer_input* inputs, size_t n,
+                     size_t* output_size, unsigned long tx_interval_ms,
+                     const AudioFormat & format)
+{
+    using std::min;
 
+    size_t frame_size = format.frame_size();
+    size_t sample_size = format.sample_size();
+    size_t wanted_frames = format.bytes_per(tx_interval_ms) / frame_size;
+    size_t avaiable_frames = *output_size / frame_size;
+    size_t result_frames = min(wanted_frames, avaiable_frames); 
+    
+    *output_size = frame_size * result_frames;
+
+    size_t result_samples = result_frames * format.channels;
     for (size_t i = 0; i < n; ++i) 
     {
-        int16_t* input_data = (int16_t*) inputs[i].data;
-        size_t input_size = inputs[i].len / 2;
-        size_t input_used = min(input_size, result_size);
-        
-        inputs[i].consumed = 2 * input_used;
-        
-        for (size_t j = 0; j < input_used; ++j) {
-            int32_t sum = (int32_t) result_data[j] + (int32_t) input_data[j];
-            result_data[j] = min(INT16_MAX, max(INT16_MIN, sum));
-        }
+        size_t input_size = inputs[i].len / sample_size;
+        inputs[i].consumed = sample_size * min(input_size, result_samples);
     }
+    return result_frames;
+}
+
+void mix_range(const struct mixer_input* inputs, size_t n,
+               void* output, size_t from, size_t to,
+               const AudioFormat & format)
+{
+    switch (format.sample * (MAX_CHANNELS + 1) + format.channels) {
+    case SAMPLE_S16 * (MAX_CHANNELS + 1) + 1:
+        mix_frames<int16_t, 1>(inputs, n, (int16_t*) output, from, to);
+        break;
+    case SAMPLE_S16 * (MAX_CHANNELS + 1) + 2:
+        mix_frames<int16_t, 2>(inputs, n, (int16_t*) output, from, to);
+        break;
+    case SAMPLE_F32 * (MAX_CHANNELS + 1) + 1:
+        mix_frames<float, 1>(inputs, n, (float*) output, from, to);
+        break;
+    case SAMPLE_F32 * (MAX_CHANNELS + 1) + 2:
+        mix_frames<float, 2>(inputs, n, (float*) output, from, to);
+        break;
+    default:
+        assert (!"unsupported audio format");
+    }
+}
+
+void mixer(struct mixer_input* inputs, size_t n,
+           void* output_buf, size_t* output_size,
+           unsigned long tx_interval_ms,
+           const AudioFormat & format)
+{
+    size_t result_frames = mixer_prepare(inputs, n, output_size, tx_interval_ms, format);
+    mix_range(inputs, n, output_buf, 0, result_frames, format);
 }
 
 /*
@@ -42,11 +181,11 @@ int16_t data0[] = {1,2, 46, 21, INT16_MAX - 100, INT16_MIN + 1};
 
 int16_t data1[] = {-2,-3, -7, 12, INT16_MAX - 200, -2, 777};
 
-int16_t result[] = {-1, -1, 39, 33, INT16_MAX, INT16_MIN, 777, 0};
+int16_t result[] = {-1, -1, 39, 33, 32492, -31129, 777, 0}; // limited past the knee
 
 struct mixer_input inputs[] = {
-    {(void*) data0, sizeof(data0), 0},
-    {(void*) data1, sizeof(data1), 0},
+    {(void*) data0, sizeof(data0), 0, 1},
+    {(void*) data1, sizeof(data1), 0, 1},
 };
 
 int8_t output_buf[2000];
@@ -1,14 +1,68 @@
 #ifndef __mixer_h_
 #define __mixer_h_
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include "audio_format.h"
+
+const float LIMITER_KNEE = 0.9f;  // of full scale; the limiter is transparent below
+const size_t MIX_CHUNK = 256;     // samples summed in the accumulator at a time
+
+const uint32_t CLIP_LEVEL = INT16_MAX;  // 16-bit units; an input sample this loud clipped
+
+/* A float sample as a client sent it is anything at all: NaN or Inf is
+ * taken as silence, the rest is clamped to full scale, so no one input
+ * can poison the sum */
+inline float clean_sample(float x) {
+    return std::isfinite(x) ? std::min(1.0f, std::max(-1.0f, x)) : 0.0f;
+}
+
+/* Level of an input over the samples mixed from it, before its gain, in
+ * 16-bit units whatever the format. Blocks of one mix may be on several
+ * threads at once, so the counts are atomic; each block adds to them
+ * once per MIX_CHUNK. */
+struct mixer_meter {
+    std::atomic<uint64_t> samples;
+    std::atomic<uint64_t> sum_squares;
+    std::atomic<uint32_t> peak;
+    std::atomic<uint64_t> clips;
+
+    mixer_meter() { reset(); }
+    void reset();
+};
+
+/* gain scales the input as it is added; it is read once per call, so a
+ * tick is mixed with one gain throughout. meter, if set, is added to by
+ * the same pass. */
 struct mixer_input {
     void* data;
     size_t len;
     size_t consumed;
+    float gain;
+    struct mixer_meter* meter;
 };
 
+/* Sums tx_interval_ms of every input, times its gain, into output_buf.
+ * The sum is kept wide and goes through one limiter at the end, so a loud
+ * input can't pin everyone else's mix at full scale. Each sample type and
+ * channel count has its own inner loop, picked at compile time. */
 void mixer(struct mixer_input* inputs, size_t n,
            void* output_buf, size_t* output_size,
-           unsigned long tx_interval_ms);
+           unsigned long tx_interval_ms,
+           const AudioFormat & format = DEFAULT_AUDIO_FORMAT);
+
+/* mixer() in two steps, so the output can be mixed in pieces: prepare
+ * sizes the output (in frames, returned) and sets consumed; mix_range
+ * then fills output frames [from, to). Pieces mixed separately are the
+ * same as one mixer() call. */
+size_t mixer_prepare(struct mixer_input* inputs, size_t n,
+                     size_t* output_size, unsigned long tx_interval_ms,
+                     const AudioFormat & format);
+void mix_range(const struct mixer_input* inputs, size_t n,
+               void* output, size_t from, size_t to,
+               const AudioFormat & format);
 
 #endif
@@ -0,0 +1,250 @@
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include "recorder.h"
+#include "logger.h"
+
+using std::memory_order_relaxed;
+using std::memory_order_acquire;
+using std::memory_order_release;
+
+static const size_t INDEX_ENTRY_SIZE = 20;
+
+static void put_u32(char * out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out[i] = (char) (value >> (8 * i));
+    }
+}
+
+static void put_u64(char * out, uint64_t value) {
+    for (int i = 0; i < 8; ++i) {
+        out[i] = (char) (value >> (8 * i));
+    }
+}
+
+static uint64_t wall_clock_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+
+Recorder::Recorder(const string & _path, ServerStats & _stats, Counter & _drops)
+    : ring(RECORD_RING_SIZE),
+      enqueue_pos(0),
+      dequeue_pos(0),
+      next_stream(0),
+      lost(0),
+      stats(_stats),
+      drops(_drops),
+      path(_path),
+      chunk_records(0),
+      chunk_time(0),
+      stopping(false)
+{
+    for (size_t i = 0; i < RECORD_RING_SIZE; ++i) {
+        ring[i].seq.store(i, memory_order_relaxed);
+    }
+
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("can't open " + path + ": " + strerror(errno));
+    }
+    index_fd = ::open((path + ".idx").c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (index_fd < 0) {
+        ::close(fd);
+        throw std::runtime_error("can't open " + path + ".idx: " + strerror(errno));
+    }
+    offset = ::lseek(fd, 0, SEEK_END);
+    if (offset == 0) {
+        chunk = RECORD_MAGIC;
+    }
+    chunk.reserve(2 * RECORD_CHUNK_SIZE);
+
+    /* Straight into the chunk, the writer isn't running yet: the start
+     * of a run can't be dropped */
+    append(RECORD_START, NO_RECORD_STREAM, 0, wall_clock_ns(), string());
+    writer = std::thread(&Recorder::write_loop, this);
+}
+
+Recorder::~Recorder() {
+    stopping.store(true, memory_order_release);
+    writer.join();
+    ::close(index_fd);
+    ::close(fd);
+}
+
+/* PRODUCERS */
+
+/* NO_RECORD_STREAM if the ring is full: audio for a stream never
+ * declared would make the file unreadable, so try again next tick */
+uint32_t Recorder::open_stream(const string & name) {
+    uint32_t stream = next_stream.fetch_add(1, memory_order_relaxed);
+    if (!push(RECORD_STREAM, stream, 0, name.data(), name.size())) {
+        return NO_RECORD_STREAM;
+    }
+    return stream;
+}
+
+void Recorder::record(uint32_t stream, uint32_t nr, const char * data, size_t len) {
+    push(RECORD_AUDIO, stream, nr, data, len);
+}
+
+/* Payload is prefix followed by data, copied once into the slot */
+void Recorder::record_event(record_kind_t kind, const string & prefix,
+                            const char * data, size_t len) {
+    push(kind, NO_RECORD_STREAM, 0, data, len, prefix);
+}
+
+/* Same ring as the logger's: a slot's seq is pos while it's the
+ * producer's turn, pos + 1 while it's the consumer's. */
+bool Recorder::push(record_kind_t kind, uint32_t stream, uint32_t nr,
+                    const char * data, size_t len, const string & prefix) {
+    size_t pos = enqueue_pos.load(memory_order_relaxed);
+    Slot * slot;
+    while (true) {
+        slot = &ring[pos & (RECORD_RING_SIZE - 1)];
+        size_t seq = slot->seq.load(memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (enqueue_pos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            drops.add();
+            lost.fetch_add(1, memory_order_relaxed);
+            return false;
+        } else {
+            pos = enqueue_pos.load(memory_order_relaxed);
+        }
+    }
+    slot->kind = kind;
+    slot->stream = stream;
+    slot->nr = nr;
+    slot->time = wall_clock_ns();
+    slot->data.assign(prefix);
+    slot->data.append(data, len);
+    slot->seq.store(pos + 1, memory_order_release);
+    return true;
+}
+
+/* WRITER */
+
+void Recorder::write_loop() {
+    while (true) {
+        bool stop = stopping.load(memory_order_acquire);
+        bool any = drain();
+        if (stop) {
+            append_gap();
+        }
+        if (!chunk.empty() && (stop || std::chrono::steady_clock::now() - chunk_started
+                                       >= std::chrono::milliseconds(RECORD_FLUSH_INTERVAL))) {
+            flush();
+        }
+        if (stop) {
+            return;
+        }
+        if (!any) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+    }
+}
+
+bool Recorder::drain() {
+    bool any = false;
+    while (true) {
+        Slot & slot = ring[dequeue_pos & (RECORD_RING_SIZE - 1)];
+        if (slot.seq.load(memory_order_acquire) != dequeue_pos + 1) {
+            break;
+        }
+        append_gap();
+        append(slot.kind, slot.stream, slot.nr, slot.time, slot.data);
+        slot.seq.store(dequeue_pos + RECORD_RING_SIZE, memory_order_release);
+        ++dequeue_pos;
+        any = true;
+
+        if (chunk.size() >= RECORD_CHUNK_SIZE) {
+            flush();
+        }
+    }
+    return any;
+}
+
+void Recorder::append(record_kind_t kind, uint32_t stream, uint32_t nr, uint64_t time,
+                      const string & data) {
+    if (chunk_records == 0) {
+        chunk_time = time;
+        chunk_started = std::chrono::steady_clock::now();
+    }
+    char header[RECORD_HEADER_SIZE];
+    put_u32(header, kind);
+    put_u32(header + 4, stream);
+    put_u32(header + 8, nr);
+    put_u64(header + 12, time);
+    put_u32(header + 20, data.size());
+    chunk.append(header, sizeof(header));
+    chunk.append(data);
+    ++chunk_records;
+}
+
+/* Records lost since the last gap were lost before the one about to be
+ * appended, though maybe not right before it */
+void Recorder::append_gap() {
+    if (lost.load(memory_order_relaxed) == 0) {
+        return;
+    }
+    char count[8];
+    put_u64(count, lost.exchange(0, memory_order_relaxed));
+    append(RECORD_GAP, NO_RECORD_STREAM, 0, wall_clock_ns(), string(count, sizeof(count)));
+}
+
+/* One write for the chunk, one for its index entry. A chunk that fails
+ * to go out is counted as dropped, and the next one is tried anyway. */
+void Recorder::flush() {
+    uint64_t chunk_offset = offset;
+    if (chunk_offset == 0) {
+        chunk_offset = RECORD_MAGIC.size(); // the index points at records
+    }
+    if (write_all(fd, chunk.data(), chunk.size())) {
+        offset += chunk.size();
+        stats.record_chunks.add();
+        stats.record_bytes.add(chunk.size());
+
+        char entry[INDEX_ENTRY_SIZE];
+        put_u64(entry, chunk_offset);
+        put_u64(entry + 8, chunk_time);
+        put_u32(entry + 16, chunk_records);
+        write_all(index_fd, entry, sizeof(entry));
+    } else {
+        /* Cut off whatever part of the chunk made it, so the next one
+         * follows a whole record -- or the magic, if that went too */
+        drops.add(chunk_records);
+        lost.fetch_add(chunk_records, memory_order_relaxed);
+        if (::ftruncate(fd, offset) < 0) {
+            offset = ::lseek(fd, 0, SEEK_END);
+        }
+    }
+    chunk.clear();
+    if (offset == 0) {
+        chunk = RECORD_MAGIC;
+    }
+    chunk_records = 0;
+}
+
+bool Recorder::write_all(int out, const char * data, size_t len) {
+    while (len > 0) {
+        ssize_t written = ::write(out, data, len);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            LOG(LOG_ERROR, "record", LOG_NO_CLIENT, "writing %s failed: %s",
+                path.c_str(), strerror(errno));
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+    return true;
+}
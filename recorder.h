@@ -0,0 +1,109 @@
+#ifndef __recorder_h_
+#define __recorder_h_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+#include "stats.h"
+
+using std::string;
+using std::vector;
+
+const uint32_t NO_RECORD_STREAM = UINT32_MAX;
+
+/* Layout of a recording, all integers little-endian.
+ *
+ * The file starts with RECORD_MAGIC and then holds records:
+ *   u32 kind, u32 stream, u32 nr, u64 time (ns since the epoch),
+ *   u32 length, length bytes of payload.
+ * RECORD_START opens each run of the server; stream ids count from 0
+ * again after it. RECORD_STREAM names a stream before its first audio:
+ *   "mix <room> <format>" or "input <room> <client id> <format>".
+ * RECORD_AUDIO is one tick of a stream, nr being the room's remix nr.
+ *
+ * A trace (runserver --trace) is a recording of what came in instead:
+ * RECORD_DATAGRAM is a datagram received, its payload
+ *   u8 address length (4 or 16), address, u16 port, the datagram;
+ * RECORD_ACCEPT a TCP connection accepted, with no payload. Their stream
+ * is NO_RECORD_STREAM and nr is 0.
+ *
+ * RECORD_GAP stands where records were lost to a full ring or a failed
+ * write; its payload is a u64 count of them. A trace with a gap can't be
+ * replayed faithfully.
+ *
+ * Records are written in chunks of about RECORD_CHUNK_SIZE bytes. The
+ * index, at path + ".idx", gets an entry per chunk:
+ *   u64 offset in the file, u64 time of its first record, u32 records. */
+const string RECORD_MAGIC = "EOGNISKO-RECORDING 1\n";
+enum record_kind_t { RECORD_START, RECORD_STREAM, RECORD_AUDIO, RECORD_DATAGRAM, RECORD_ACCEPT,
+                     RECORD_GAP };
+const size_t RECORD_HEADER_SIZE = 24;
+
+const size_t RECORD_RING_SIZE = 8192;          // power of two
+const size_t RECORD_CHUNK_SIZE = 1 << 20;      // bytes per write
+const unsigned long RECORD_FLUSH_INTERVAL = 1000; // ms a partial chunk may wait
+
+/* Server-side recording tap. Rooms hand ticks to a bounded lock-free
+ * ring (many producers, one consumer), like the logger's; a background
+ * thread drains it into a chunk buffer and writes whole chunks. Nothing
+ * on the producer side blocks on the disk: when the ring is full, the
+ * record is dropped, counted and marked by a RECORD_GAP. Slots keep
+ * their buffers, so a steady stream doesn't allocate either. */
+class Recorder {
+public:
+    /* Appends to path; throws std::runtime_error if it can't be opened.
+     * Lost records are counted in drops. */
+    Recorder(const string & path, ServerStats &, Counter & drops);
+    ~Recorder(); // writes out whatever is queued
+
+    /* Safe from any thread */
+    uint32_t open_stream(const string & name); // NO_RECORD_STREAM: try again
+    void record(uint32_t stream, uint32_t nr, const char * data, size_t len);
+    void record_event(record_kind_t, const string & prefix, const char * data, size_t len);
+
+private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        record_kind_t kind;
+        uint32_t stream;
+        uint32_t nr;
+        uint64_t time;
+        string data;
+    };
+
+    bool push(record_kind_t, uint32_t, uint32_t, const char *, size_t,
+              const string & prefix = string());
+    void write_loop();
+    bool drain();
+    void append(record_kind_t, uint32_t, uint32_t, uint64_t, const string &);
+    void append_gap();
+    void flush();
+    bool write_all(int, const char *, size_t);
+
+    vector<Slot> ring;
+    std::atomic<size_t> enqueue_pos;
+    size_t dequeue_pos;
+    std::atomic<uint32_t> next_stream;
+    std::atomic<uint64_t> lost; // since the last RECORD_GAP
+
+    ServerStats & stats;
+    Counter & drops;
+    string path;
+    int fd;
+    int index_fd;
+    uint64_t offset;
+
+    /* CHUNK -- touched by the writer thread only */
+    string chunk;
+    uint32_t chunk_records;
+    uint64_t chunk_time;
+    std::chrono::steady_clock::time_point chunk_started;
+
+    std::atomic<bool> stopping;
+    std::thread writer;
+};
+
+#endif
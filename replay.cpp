@@ -0,0 +1,387 @@
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <exception>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+#include <boost/program_options.hpp>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <sys/resource.h>
+#include "server_params.h"
+#include "server.h"
+#include "server_clock.h"
+#include "recorder.h"
+#include "file_source.h"
+
+namespace asio = boost::asio;
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+using std::make_shared;
+using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
+
+
+#ifdef NDEBUG
+    const bool DEBUG = false;
+#else
+    const bool DEBUG = true;
+#endif
+
+const unsigned long DRAIN_INTERVAL = 1000; // simulated ms between reading the reports
+
+
+/* TRACE READING */
+
+static uint32_t get_u32(const char * in) {
+    uint32_t value = 0;
+    for (int i = 3; i >= 0; --i) {
+        value = (value << 8) | (uint8_t) in[i];
+    }
+    return value;
+}
+
+static uint64_t get_u64(const char * in) {
+    return get_u32(in) | ((uint64_t) get_u32(in + 4) << 32);
+}
+
+struct trace_event_t {
+    record_kind_t kind;
+    uint64_t time; // ns since the epoch
+    udp::endpoint endpoint;
+    const char * data;
+    size_t len;
+};
+
+/* Walks the mapped trace of one run of the server: the first, since
+ * sessions ids start over with the next RECORD_START. Records other than
+ * trace events are skipped, so a recording can be replayed as well; a
+ * RECORD_GAP is an error, a lost accept would shift every session id. */
+class TraceReader {
+public:
+    TraceReader(shared_ptr<MappedFile> _file)
+        : started_at(0),
+          file(_file),
+          position(RECORD_MAGIC.size()),
+          runs(0)
+    {
+        if (file->size < RECORD_MAGIC.size()
+            || memcmp(file->data, RECORD_MAGIC.data(), RECORD_MAGIC.size()) != 0) {
+            throw std::runtime_error("not a trace: " + file->path);
+        }
+    }
+
+    bool next(trace_event_t & event) {
+        while (position + RECORD_HEADER_SIZE <= file->size) {
+            const char * header = file->data + position;
+            uint32_t len = get_u32(header + 20);
+            if (position + RECORD_HEADER_SIZE + len > file->size) {
+                break; // cut short while it was being written
+            }
+            position += RECORD_HEADER_SIZE + len;
+
+            event.kind = (record_kind_t) get_u32(header);
+            event.time = get_u64(header + 12);
+            event.data = header + RECORD_HEADER_SIZE;
+            event.len = len;
+            if (event.kind == RECORD_START) {
+                if (++runs > 1) {
+                    return false;
+                }
+                started_at = event.time;
+            }
+            if (event.kind == RECORD_GAP && len >= 8) {
+                throw std::runtime_error("the trace lost " + std::to_string(get_u64(event.data))
+                                         + " records here, a replay would go its own way");
+            }
+            if (event.kind == RECORD_ACCEPT) {
+                return true;
+            }
+            if (event.kind == RECORD_DATAGRAM && parse_endpoint(event)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool more_runs() const { return runs > 1; }
+
+    uint64_t started_at; // of the run, ns since the epoch
+
+private:
+    /* Takes the endpoint off the front of the payload */
+    static bool parse_endpoint(trace_event_t & event) {
+        if (event.len < 1) {
+            return false;
+        }
+        size_t address_len = (uint8_t) event.data[0];
+        if (event.len < 1 + address_len + 2) {
+            return false;
+        }
+        asio::ip::address address;
+        if (address_len == 4) {
+            asio::ip::address_v4::bytes_type bytes;
+            memcpy(bytes.data(), event.data + 1, 4);
+            address = asio::ip::address_v4(bytes);
+        } else if (address_len == 16) {
+            asio::ip::address_v6::bytes_type bytes;
+            memcpy(bytes.data(), event.data + 1, 16);
+            address = asio::ip::address_v6(bytes);
+        } else {
+            return false;
+        }
+        const char * port = event.data + 1 + address_len;
+        event.endpoint = udp::endpoint(address, (uint8_t) port[0] | ((uint8_t) port[1] << 8));
+        event.data += 1 + address_len + 2;
+        event.len -= 1 + address_len + 2;
+        return true;
+    }
+
+    shared_ptr<MappedFile> file;
+    size_t position;
+    size_t runs;
+};
+
+
+/* REPLAY */
+
+static double cpu_seconds() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+           + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+/* A Server on a frozen clock, run by hand as the bench's pipeline is.
+ * Between two events the clock moves at most a tx_interval at a time,
+ * and every timer due runs before the next event, so a trace replays the
+ * same way every time, as fast as the server can take it. Accepts get a
+ * real loopback connection, whose reports are read off now and then;
+ * everything the server sends over UDP is only counted. */
+class Replay {
+public:
+    Replay(const ServerParams & _params)
+        : params(_params),
+          server(params, io_service),
+          nudge_timer(io_service),
+          nudge_fired(false),
+          acceptor(io_service, tcp::endpoint(asio::ip::address_v4::loopback(), 0)),
+          simulated_ns(0),
+          drained_ns(0),
+          datagrams_in(0),
+          bytes_in(0),
+          accepts(0),
+          datagrams_out(0),
+          bytes_out(0)
+    {
+        server.set_datagram_sink(boost::bind(&Replay::take, this, _1, _2, _3));
+    }
+
+    void run(TraceReader & trace) {
+        trace_event_t event;
+        double cpu_before = cpu_seconds();
+        auto wall_before = std::chrono::steady_clock::now();
+
+        while (trace.next(event)) {
+            advance_to(event.time > trace.started_at ? event.time - trace.started_at : 0);
+            if (event.kind == RECORD_ACCEPT) {
+                accept();
+            } else {
+                server.process_datagram(event.endpoint, event.data, event.len);
+                ++datagrams_in;
+                bytes_in += event.len;
+            }
+            io_service.poll();
+        }
+        advance_to(simulated_ns + params.tx_interval * 1000000);
+
+        double cpu = cpu_seconds() - cpu_before;
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_before).count();
+        double simulated = simulated_ns / 1e9;
+        std::ostringstream line;
+        line << "{\"bench\":\"replay\""
+             << ",\"datagrams_in\":" << datagrams_in
+             << ",\"bytes_in\":" << bytes_in
+             << ",\"accepts\":" << accepts
+             << ",\"datagrams_out\":" << datagrams_out
+             << ",\"bytes_out\":" << bytes_out
+             << ",\"simulated_s\":" << simulated
+             << ",\"wall_s\":" << wall
+             << ",\"speedup\":" << (wall > 0 ? simulated / wall : 0)
+             << ",\"cpu_s\":" << cpu
+             << ",\"cpu_us_per_datagram\":" << (datagrams_in > 0 ? cpu * 1e6 / datagrams_in : 0)
+             << "}";
+        cout << line.str() << endl;
+        if (trace.more_runs()) {
+            std::cerr << "only the first run of the server in the trace was replayed" << endl;
+        }
+    }
+
+    string render_stats() {
+        return server.render_stats();
+    }
+
+private:
+    void advance_to(uint64_t ns) {
+        uint64_t step_ns = params.tx_interval * 1000000;
+        while (simulated_ns < ns) {
+            uint64_t step = std::min(step_ns, ns - simulated_ns);
+            server_clock_traits::advance(boost::posix_time::microseconds(step / 1000));
+            simulated_ns += step;
+            nudge();
+            if (simulated_ns - drained_ns >= DRAIN_INTERVAL * 1000000) {
+                drain_clients();
+                drained_ns = simulated_ns;
+            }
+        }
+    }
+
+    /* As in the bench: an overdue timer re-arms asio's timerfd to fire at
+     * once. "At once" is still up to the kernel, so unlike the bench, we
+     * wait for it: when the nudge has run, so has every timer due by the
+     * frozen clock, and the poll runs whatever they posted. */
+    void nudge() {
+        nudge_fired = false;
+        nudge_timer.expires_at(server_clock_traits::now() - boost::posix_time::microseconds(1));
+        nudge_timer.async_wait(boost::bind(&Replay::nudged, this, asio::placeholders::error));
+        while (!nudge_fired) {
+            io_service.run_one();
+        }
+        io_service.poll();
+    }
+
+    void nudged(const boost::system::error_code &) {
+        nudge_fired = true;
+    }
+
+    void accept() {
+        auto client_p = make_shared<tcp::socket>(io_service);
+        auto accepted_p = make_shared<tcp::socket>(io_service);
+        client_p->connect(acceptor.local_endpoint());
+        acceptor.accept(*accepted_p);
+        server.handle_accept_tcp(boost::system::error_code(), accepted_p);
+        clients.push_back(client_p);
+        ++accepts;
+    }
+
+    /* Unread reports would fill the socket buffers, and the server would
+     * drop sessions for their backlog that production kept */
+    void drain_clients() {
+        for (auto it = clients.begin(); it != clients.end(); ++it) {
+            boost::system::error_code ec;
+            size_t available = (*it)->available(ec);
+            while (!ec && available > 0) {
+                available -= (*it)->read_some(asio::buffer(drain_buf, std::min(available, sizeof(drain_buf))), ec);
+            }
+        }
+    }
+
+    bool take(const udp::endpoint &, const string & header, const string & payload) {
+        ++datagrams_out;
+        bytes_out += header.size() + payload.size();
+        return true;
+    }
+
+    asio::io_service io_service;
+    ServerParams params;
+    Server server;
+    server_timer nudge_timer;
+    bool nudge_fired;
+    tcp::acceptor acceptor;
+    vector<shared_ptr<tcp::socket>> clients;
+    char drain_buf[65536];
+
+    uint64_t simulated_ns;
+    uint64_t drained_ns;
+    uint64_t datagrams_in;
+    uint64_t bytes_in;
+    uint64_t accepts;
+    uint64_t datagrams_out;
+    uint64_t bytes_out;
+};
+
+
+int main(int argc, char** argv) {
+
+try {
+    namespace po = boost::program_options;
+
+    ServerParams params;
+    string trace;
+    bool dump_stats;
+    po::options_description desc("Options -- the server's should match the traced run");
+    desc.add_options()
+        ("help,h", "")
+        ("trace,t", po::value<string>(&trace), "trace taken with runserver --trace")
+        ("fifo_size,F", po::value<size_t>(&params.fifo_size)->default_value(DEFAULT_FIFO_SIZE))
+        ("fifo_low_watermark,L", po::value<size_t>(&params.fifo_low_watermark)->default_value(DEFAULT_FIFO_LOW_WATERMARK))
+        ("fifo_high_watermark,H", po::value<size_t>(&params.fifo_high_watermark))
+        ("buf_len,X", po::value<size_t>(&params.buf_len)->default_value(DEFAULT_BUF_LEN))
+        ("tx_interval,i", po::value<unsigned long>(&params.tx_interval)->default_value(DEFAULT_TX_INTERVAL))
+        ("ack_delay", po::value<unsigned long>(&params.ack_delay)->default_value(DEFAULT_ACK_DELAY))
+        ("udp_timeout", po::value<unsigned long>(&params.udp_timeout)->default_value(DEFAULT_UDP_TIMEOUT))
+        ("report_backlog", po::value<size_t>(&params.report_backlog)->default_value(DEFAULT_REPORT_BACKLOG))
+        ("report_interval", po::value<unsigned long>(&params.report_interval)->default_value(DEFAULT_REPORT_INTERVAL))
+        ("resume_grace", po::value<unsigned long>(&params.resume_grace)->default_value(DEFAULT_RESUME_GRACE))
+        ("loudest", po::value<size_t>(&params.loudest)->default_value(DEFAULT_LOUDEST))
+        ("mix_threads", po::value<size_t>(&params.mix_threads)->default_value(DEFAULT_MIX_THREADS))
+        ("agc", po::value<bool>(&params.agc)->default_value(DEFAULT_AGC))
+        ("format", po::value<string>()->default_value(audio_format_name(DEFAULT_AUDIO_FORMAT)))
+        ("stats", po::bool_switch(&dump_stats), "print the server's stats once the trace is done")
+    ;
+
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (vm.count("help") || !vm.count("trace")) {
+        cout << "E-ognisko -- trace replay, one JSON object per run" << endl << desc << endl;
+        return vm.count("help") ? 0 : 1;
+    }
+    if (!vm.count("fifo_high_watermark")) {
+        params.fifo_high_watermark = params.fifo_size;
+    }
+    if (!parse_audio_format(vm["format"].as<string>(), params.format)) {
+        throw std::invalid_argument("bad format: " + vm["format"].as<string>());
+    }
+    params.port = 0; // ephemeral; nothing goes through the sockets
+    params.stats_port = 0;
+    params.workers = 1;
+    params.udp_backend = UDP_BACKEND_EPOLL;
+    params.record_inputs = false;
+    params.parent_port = 0;
+    params.cascade_room = DEFAULT_CASCADE_ROOM;
+    params.multicast_port = 0;
+
+    if (DEBUG) {
+        cout << "Settings:" << endl;
+        cout << "trace               -- " << trace << endl;
+        cout << "fifo_size           -- " << params.fifo_size << endl;
+        cout << "fifo_low_watermark  -- " << params.fifo_low_watermark << endl;
+        cout << "fifo_high_watermark -- " << params.fifo_high_watermark << endl;
+        cout << "buf_len             -- " << params.buf_len << endl;
+        cout << "tx_interval         -- " << params.tx_interval << endl;
+        cout << "loudest             -- " << params.loudest << endl;
+        cout << "mix_threads         -- " << params.mix_threads << endl;
+        cout << "format              -- " << audio_format_name(params.format) << endl;
+        cout << "agc                 -- " << params.agc << endl;
+    }
+
+    TraceReader reader(make_shared<MappedFile>(trace));
+    server_clock_traits::freeze();
+    Replay replay(params);
+    replay.run(reader);
+    if (dump_stats) {
+        cout << replay.render_stats();
+    }
+} catch (std::exception &e) {
+    cout << e.what() << endl;
+    return 1;
+}
+
+    return 0;
+}
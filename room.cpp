@@ -0,0 +1,667 @@
+#include <algorithm>
+#include <functional>
+#include <boost/bind.hpp>
+#include "room.h"
+#include "server.h"
+#include "logger.h"
+
+
+namespace asio = boost::asio;
+
+using std::make_shared;
+using std::make_pair;
+using boost::posix_time::milliseconds;
+
+
+Room::Room(string _name,
+           Server & _server,
+           ServerParams & _params,
+           ServerStats & _stats,
+           asio::io_service & io_service)
+    : name(_name),
+      strand(io_service),
+      members(0),
+      format(_params.format),
+      server(_server),
+      params(_params),
+      stats(_stats),
+      report_timer(io_service),
+      mix_and_send_timer(io_service),
+      running(false),
+      record_stream(NO_RECORD_STREAM),
+      upstream_active(false),
+      remix_nr(0) {}
+
+/* MEMBERSHIP */
+
+void Room::join(shared_ptr<Session> session_p) {
+    sessions.insert(make_pair(session_p->id, session_p));
+    stats.sessions_per_format[session_p->downstream_format].add();
+    LOG(LOG_INFO, "room_join", session_p->id, "joined room \"%s\"", name.c_str());
+
+    if (!running) {
+        running = true;
+        mix_and_send_timer.expires_from_now(milliseconds(params.tx_interval));
+        mix_and_send_timer.async_wait(strand.wrap(
+            boost::bind(
+                &Room::mix_and_send,
+                shared_from_this(),
+                asio::placeholders::error)));
+        report_timer.expires_from_now(milliseconds(params.report_interval));
+        report_timer.async_wait(strand.wrap(
+            boost::bind(
+                &Room::report,
+                shared_from_this(),
+                asio::placeholders::error)));
+    }
+    send_ack(session_p);
+}
+
+void Room::leave(shared_ptr<Session> session_p) {
+    auto it = sessions.find(session_p->id);
+    if (it == sessions.end()) {
+        return;
+    }
+    sessions.erase(it);
+    if (!session_p->info.empty()) {
+        removed_since_report.push_back(session_p->tcp_remote_endpoint_str);
+    }
+    if (session_p->fifo_state == ACTIVE) {
+        stats.sessions_active.sub();
+    }
+    stats.sessions_per_format[session_p->downstream_format].sub();
+    if (sessions.empty()) {
+        stop();
+    }
+}
+
+/* A session whose client is gone keeps its place, FIFO and sequence
+ * numbers while the server waits for the client to come back. */
+void Room::suspend(shared_ptr<Session> session_p) {
+    session_p->suspended = true;
+}
+
+/* The session's endpoints are the room's to change: it may be sending to
+ * the old one right up to here */
+void Room::resume(shared_ptr<Session> session_p, udp::endpoint udp_endpoint,
+                  tcp::endpoint tcp_endpoint, string tcp_endpoint_str) {
+    if (sessions.find(session_p->id) == sessions.end()) {
+        return;
+    }
+    session_p->udp_remote_endpoint = udp_endpoint;
+    session_p->tcp_remote_endpoint = tcp_endpoint;
+    session_p->tcp_remote_endpoint_str = tcp_endpoint_str;
+    session_p->suspended = false;
+    LOG(LOG_INFO, "room_resume", session_p->id, "resumed in room \"%s\"", name.c_str());
+    send_ack(session_p);
+}
+
+/* An idle room costs nothing: its timers are cancelled and the pending
+ * handlers, the last holders of the room, go away. */
+void Room::stop() {
+    running = false;
+    boost::system::error_code ignored;
+    mix_and_send_timer.cancel(ignored);
+    report_timer.cancel(ignored);
+}
+
+/* SNAPSHOT */
+
+void Room::save(SnapshotWriter & out) const {
+    out.put_string(audio_format_name(format));
+    out.put_u32(remix_nr);
+    out.put_u32(remixes.size());
+    for (auto it = remixes.begin(); it != remixes.end(); ++it) {
+        out.put_u32(it->first);
+        out.put_string(it->second);
+    }
+}
+
+/* Listeners carry on from the same remix numbers, so what they miss
+ * around the restart can still be retransmitted */
+void Room::restore(SnapshotReader & in) {
+    if (!parse_audio_format(in.get_string(), format)) {
+        throw std::runtime_error("bad room format in snapshot");
+    }
+    remix_nr = in.get_u32();
+    remixes.clear();
+    for (uint32_t n = in.get_u32(); n > 0; --n) {
+        uint32_t nr = in.get_u32();
+        remixes[nr] = in.get_string();
+    }
+}
+
+/* UDP */
+
+void Room::upload(shared_ptr<Session> session_p, string data, uint32_t nr,
+                  stats_clock::time_point received_at, uint64_t stamp) {
+    if (sessions.find(session_p->id) == sessions.end()) {
+        return; // left meanwhile
+    }
+
+    if (nr != session_p->ack) {
+        stats.upload_rejects_bad_nr.add();
+        LOG(LOG_WARN, "upload_bad_nr", session_p->id,
+            "Upload with bad nr: %u expected ack: %u", nr, session_p->ack);
+        return;
+    }
+    if (data.size() > session_p->get_win()) {
+        stats.upload_rejects_too_big.add();
+        LOG(LOG_WARN, "upload_too_big", session_p->id,
+            "Upload too big, size: %zu win: %zu", data.size(), session_p->get_win());
+        return;
+    }
+    //std::cout << "DATA: " << data << endl;
+    session_p->upload(data, stamp, received_at);
+    stats.receive_to_fifo.record(received_at, stats_clock::now());
+
+    /* If a DATA datagram goes to this session soon anyway, let it carry
+     * the ack instead of sending a separate ACK datagram. */
+    if (data_due_within_ack_delay()) {
+        session_p->ack_pending = true;
+        stats.acks_piggybacked.add();
+    } else {
+        send_ack(session_p);
+    }
+}
+
+void Room::retransmit(shared_ptr<Session> session_p, uint32_t nr) {
+    if (sessions.find(session_p->id) == sessions.end()) {
+        return;
+    }
+    ++session_p->retransmit_requests;
+    uint32_t min_avaiable = remix_nr + 1 - remixes.size();
+    uint32_t start = std::max(nr, min_avaiable);
+
+    if (session_p->mix_minus) {
+        min_avaiable = remix_nr + 1 - session_p->own_remixes.size();
+        start = std::max(nr, min_avaiable);
+    }
+
+    server.begin_batch();
+    for (uint32_t i = start; i <= remix_nr; ++i) {
+        send_remix_datagram(session_p, i);
+        stats.retransmits_served.add();
+    }
+    server.flush_datagrams();
+}
+
+bool Room::data_due_within_ack_delay() {
+    if (params.ack_delay == 0 || !running) {
+        return false;
+    }
+    return mix_and_send_timer.expires_from_now() <= milliseconds(params.ack_delay);
+}
+
+void Room::send_ack(shared_ptr<Session> session_p) {
+    string header = session_p->get_ack_header();
+    if (server.send_datagram(session_p->udp_remote_endpoint, header)) {
+        stats.packets_out[MSG_ACK].add();
+        stats.bytes_out[MSG_ACK].add(header.size());
+    }
+}
+
+/* REPORTS */
+
+void Room::schedule_report() {
+    report_timer.expires_at(report_timer.expires_at() + milliseconds(params.report_interval));
+    report_timer.async_wait(strand.wrap(
+        boost::bind(
+            &Room::report,
+            shared_from_this(),
+            asio::placeholders::error)));
+}
+
+void Room::report(const boost::system::error_code& ec) {
+    if (ec == asio::error::operation_aborted || !running) {
+        return;
+    }
+    schedule_report();
+    if (ec) {
+        LOG(LOG_ERROR, "timer", LOG_NO_CLIENT, "timer error in report: %s", ec.message().c_str());
+        return;
+    }
+
+    construct_report();
+    multi_send_report();
+    multi_reset_fifo_stats();
+}
+
+void Room::multi_send_report() {
+    auto batch_p = make_shared<report_batch_t>();
+    batch_p->reserve(sessions.size());
+    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+        batch_p->push_back(make_pair(it->second, choose_report(*it->second)));
+    }
+    server.queue_reports(batch_p, baseline_report_p, delta_report_p);
+}
+
+void Room::multi_reset_fifo_stats() {
+    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+        auto session_p = it->second;
+        session_p->reset_fifo_stats();
+    }
+}
+
+/* Report messages must be passed using shared_ptr to make sure they persist
+ * till all operations referring to them finish. A buffer still referred to
+ * by a queued write is left alone and a new one is allocated. */
+static void renew_report_buffer(shared_ptr<string> & report_p) {
+    if (!report_p || report_p.use_count() > 1) {
+        report_p = make_shared<string>();
+    }
+    report_p->assign("\n");
+}
+
+void Room::construct_report() {
+    renew_report_buffer(full_report_p);
+    renew_report_buffer(delta_report_p);
+    renew_report_buffer(baseline_report_p);
+    string & full = *full_report_p;
+    string & delta = *delta_report_p;
+    string & baseline = *baseline_report_p;
+    baseline += "full\n";
+
+    for (auto it = removed_since_report.begin(); it != removed_since_report.end(); ++it) {
+        delta += *it;
+        delta += " removed\n";
+    }
+    removed_since_report.clear();
+
+    size_t active_sessions = 0;
+    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+        Session & session = *(it->second);
+        session.update_levels();
+        if (session.update_info(report_scratch)) {
+            delta += session.info;
+        }
+        full += session.info;
+        baseline += session.info;
+        if (session.fifo_state == ACTIVE) {
+            ++active_sessions;
+        }
+    }
+
+    report_aggregates = "sessions: " + std::to_string(sessions.size())
+                      + " active: " + std::to_string(active_sessions) + "\n";
+}
+
+/* The server swaps a delta for the baseline if the delta would replace a
+ * queued message -- that one may be the baseline the delta refers to, or
+ * hold removals the client would never hear of again. */
+shared_ptr<string> Room::choose_report(Session & session) {
+    switch (session.report_mode) {
+    case REPORT_DELTA:
+        if (session.needs_full_report) {
+            session.needs_full_report = false;
+            return baseline_report_p;
+        }
+        return delta_report_p;
+    case REPORT_SELF:
+        return make_shared<string>("\n" + session.info + report_aggregates);
+    default:
+        return full_report_p;
+    }
+}
+
+/* MIXING AND SENDING */
+
+void Room::schedule_mix_and_send() {
+    mix_and_send_timer.expires_at(mix_and_send_timer.expires_at() + milliseconds(params.tx_interval));
+    mix_and_send_timer.async_wait(strand.wrap(
+        boost::bind(
+            &Room::mix_and_send,
+            shared_from_this(),
+            asio::placeholders::error)));
+}
+
+void Room::mix_and_send(const boost::system::error_code& ec) {
+    if (ec == asio::error::operation_aborted || !running) {
+        return;
+    }
+    schedule_mix_and_send();
+    if (ec) {
+        LOG(LOG_ERROR, "timer", LOG_NO_CLIENT, "timer error in mix_and_send: %s",
+            ec.message().c_str());
+        return;
+    }
+
+    ++remix_nr;
+    remixes.insert(make_pair(remix_nr, mix()));
+    if (recorder) {
+        record_remix();
+    }
+    if (remixes.size() > params.buf_len) {
+        remixes.erase(remix_nr - params.buf_len);
+    }
+    server.begin_batch();
+    multi_send_remix_datagram(remix_nr);
+    server.flush_datagrams();
+
+    if (remix_nr % std::max(ADAPT_INTERVAL / params.tx_interval, 1UL) == 0) {
+        multi_adapt_downstream();
+    }
+}
+
+/* With a parent, the local sessions are mixed first: that mix goes up,
+ * and only then is the parent's remix added for the local listeners. The
+ * parent never gets its own audio back. */
+string Room::mix() {
+    size_t tick = format.bytes_per(params.tx_interval);
+    if (output_buf.size() < tick) {
+        output_buf.resize(tick);
+        cascade_buf.resize(tick);
+    }
+
+    vector<mixer_input> inputs = construct_mixer_inputs();
+    vector<size_t> held_back = select_loudest(inputs);
+    multi_mix_minus(inputs);
+
+    size_t output_size = output_buf.size();
+    run_mixer(inputs.data(), inputs.size(), output_buf.data(), &output_size);
+    if (recorder && params.record_inputs) {
+        multi_record_input(inputs, held_back);
+    }
+    multi_consume(inputs, held_back);
+    if (!upstream) {
+        return string(output_buf.data(), output_size);
+    }
+
+    upstream->feed(string(output_buf.data(), output_size));
+    if (!upstream_active) {
+        return string(output_buf.data(), output_size);
+    }
+    struct mixer_input cascade[2] = {
+        {output_buf.data(), output_size, 0, 1},
+        {upstream_fifo.data(), upstream_fifo.size(), 0, 1}
+    };
+    size_t cascade_size = cascade_buf.size();
+    run_mixer(cascade, 2, cascade_buf.data(), &cascade_size);
+    consume_upstream(cascade[1].consumed);
+    return string(cascade_buf.data(), cascade_size);
+}
+
+void Room::run_mixer(struct mixer_input* inputs, size_t n, char* output, size_t* output_size) {
+    if (mix_pool) {
+        mix_pool->mix(inputs, n, (void*) output, output_size, params.tx_interval, format);
+    } else {
+        mixer(inputs, n, (void*) output, output_size, params.tx_interval, format);
+    }
+}
+
+vector<mixer_input> Room::construct_mixer_inputs() {
+    vector<mixer_input> inputs;
+    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+        Session & session = *(it->second);
+        if (session.mixed_in()) {
+            auto input_data = session.get_data();
+            struct mixer_input input {input_data.first, input_data.second, 0, session.tick_gain(), &session.meter};
+            inputs.push_back(input);
+        }
+    }
+    size_t tick = format.bytes_per(params.tx_interval);
+    for (auto it = sources.begin(); it != sources.end(); ++it) {
+        inputs.push_back(it->second.input(tick));
+    }
+    return inputs;
+}
+
+/* LOUDEST-N -- with more inputs than params.loudest, only the loudest
+ * are mixed; cost no longer grows with the room. Sessions mixed last tick
+ * rank with a SPEAKER_HYSTERESIS edge, so close contenders don't flap in
+ * and out. The rest go to the mixer empty, which costs it nothing, and
+ * what they would have given is returned, so it's consumed anyway and
+ * their FIFOs don't back up. */
+vector<size_t> Room::select_loudest(vector<mixer_input> & inputs) {
+    vector<size_t> held_back(inputs.size(), 0);
+    if (params.loudest == 0) {
+        return held_back;
+    }
+
+    vector<Session*> contributors;
+    vector<pair<double, size_t>> ranking; // score, input
+    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+        Session & session = *(it->second);
+        if (session.mixed_in()) {
+            double score = session.energy * (session.speaking ? SPEAKER_HYSTERESIS : 1);
+            ranking.push_back(make_pair(score, contributors.size()));
+            contributors.push_back(&session);
+        }
+    }
+    size_t selected = std::min(params.loudest, ranking.size());
+    std::nth_element(ranking.begin(), ranking.begin() + selected, ranking.end(),
+                     std::greater<pair<double, size_t>>());
+
+    for (size_t i = 0; i < ranking.size(); ++i) {
+        size_t input = ranking[i].second;
+        contributors[input]->speaking = i < selected;
+        if (i >= selected) {
+            held_back[input] = std::min(inputs[input].len, format.bytes_per(params.tx_interval));
+            inputs[input].len = 0;
+            stats.inputs_held_back.add();
+        }
+    }
+    return held_back;
+}
+
+void Room::multi_consume(vector<mixer_input> & inputs, const vector<size_t> & held_back) {
+    int counter = 0;
+    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+        Session & session = *(it->second);
+        if (session.mixed_in()) {
+            session.consume(inputs[counter].consumed + held_back[counter]);
+            ++counter;
+        }
+    }
+    for (auto it = sources.begin(); it != sources.end(); ++counter) {
+        if (it->second.advance(inputs[counter].consumed)) {
+            ++it;
+        } else {
+            LOG(LOG_INFO, "source", LOG_NO_CLIENT, "%s done in room \"%s\"",
+                it->first.c_str(), name.c_str());
+            it = sources.erase(it);
+        }
+    }
+}
+
+/* A mix-minus session gets a remix of its own, mixed from everyone else's
+ * input. Must run before the FIFOs are consumed. */
+void Room::multi_mix_minus(const vector<mixer_input> & inputs) {
+    int counter = 0;
+    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+        Session & session = *(it->second);
+        bool contributes = session.mixed_in();
+        if (session.mix_minus) {
+            vector<mixer_input> others;
+            for (size_t i = 0; i < inputs.size(); ++i) {
+                if (!contributes || i != (size_t) counter) {
+                    others.push_back(inputs[i]);
+                    others.back().meter = nullptr; // metered by the main mix
+                }
+            }
+            if (upstream_active) {
+                struct mixer_input input {upstream_fifo.data(), upstream_fifo.size(), 0, 1};
+                others.push_back(input);
+            }
+            size_t output_size = cascade_buf.size();
+            run_mixer(others.data(), others.size(), cascade_buf.data(), &output_size);
+            session.own_remixes[remix_nr] = string(cascade_buf.data(), output_size);
+            if (session.own_remixes.size() > params.buf_len) {
+                session.own_remixes.erase(session.own_remixes.begin());
+            }
+        }
+        if (contributes) {
+            ++counter;
+        }
+    }
+}
+
+/* FILE SOURCES */
+
+/* A source of the same name is replaced, and starts over */
+void Room::play(string source_name, shared_ptr<MappedFile> file, bool loop) {
+    sources.erase(source_name);
+    sources.insert(make_pair(source_name, FileSource(file, loop, format.frame_size())));
+    LOG(LOG_INFO, "source", LOG_NO_CLIENT, "playing %s%s in room \"%s\" as %s",
+        file->path.c_str(), loop ? " in a loop" : "", name.c_str(), source_name.c_str());
+}
+
+void Room::stop_source(string source_name) {
+    if (sources.erase(source_name) > 0) {
+        LOG(LOG_INFO, "source", LOG_NO_CLIENT, "%s stopped in room \"%s\"",
+            source_name.c_str(), name.c_str());
+    }
+}
+
+/* RECORDING -- streams are declared the first time they have audio, when
+ * the room's format is settled; the recorder never blocks the tick. */
+
+void Room::record_remix() {
+    if (record_stream == NO_RECORD_STREAM) {
+        record_stream = recorder->open_stream("mix " + name + " " + audio_format_name(format));
+        if (record_stream == NO_RECORD_STREAM) {
+            return;
+        }
+    }
+    const string & remix = remixes[remix_nr];
+    recorder->record(record_stream, remix_nr, remix.data(), remix.size());
+}
+
+/* What each session gave to the tick, held back by loudest-N or not */
+void Room::multi_record_input(const vector<mixer_input> & inputs, const vector<size_t> & held_back) {
+    int counter = 0;
+    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+        Session & session = *(it->second);
+        if (!session.mixed_in()) {
+            continue;
+        }
+        if (session.record_stream == NO_RECORD_STREAM) {
+            session.record_stream = recorder->open_stream(
+                "input " + name + " " + std::to_string(session.id) + " " + audio_format_name(format));
+            if (session.record_stream == NO_RECORD_STREAM) {
+                ++counter;
+                continue;
+            }
+        }
+        recorder->record(session.record_stream, remix_nr, (const char*) inputs[counter].data,
+                         inputs[counter].consumed + held_back[counter]);
+        ++counter;
+    }
+}
+
+/* CASCADING */
+
+/* Called on the room's strand with DATA from the parent. Like a session
+ * FIFO it waits for two ticks' worth before it is mixed in; beyond
+ * fifo_size the oldest audio goes, so the delay can't build up. */
+void Room::feed_upstream(string data) {
+    upstream_fifo.insert(upstream_fifo.end(), data.begin(), data.end());
+    if (upstream_fifo.size() > params.fifo_size) {
+        upstream_fifo.erase(upstream_fifo.begin(),
+                            upstream_fifo.end() - params.fifo_size);
+    }
+    if (!upstream_active && upstream_fifo.size() >= 2 * format.bytes_per(params.tx_interval)) {
+        upstream_active = true;
+    }
+}
+
+void Room::consume_upstream(size_t n) {
+    upstream_fifo.erase(upstream_fifo.begin(), upstream_fifo.begin() + n);
+    if (upstream_fifo.empty()) {
+        upstream_active = false;
+    }
+}
+
+/* Multicast listeners share one datagram; each of them only gets a
+ * unicast ACK when it has one coming or its window has just reopened. A
+ * mix-minus session's remix is its own, so it stays on unicast. */
+void Room::multi_send_remix_datagram(uint32_t nr) {
+    auto mixed_at = stats_clock::now();
+    bool multicast = server.multicast_enabled();
+    if (multicast) {
+        send_multicast_datagram(nr, mixed_at);
+    }
+    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+        Session & session = *(it->second);
+        if (session.suspended) {
+            continue;
+        }
+        if (!multicast || !session.multicast || session.mix_minus) {
+            send_remix_datagram(it->second, nr, mixed_at);
+        } else if (session.ack_pending
+                   || (session.advertised_win == 0 && session.get_win() > 0)) {
+            send_ack(it->second);
+        }
+    }
+}
+
+void Room::send_multicast_datagram(uint32_t nr, stats_clock::time_point mixed_at) {
+    string header = "MDATA " + name + " " + std::to_string(nr) + "\n";
+    const string & remix = remixes[nr];
+    if (!server.send_multicast(header, remix)) {
+        return;
+    }
+    stats.packets_out[MSG_MDATA].add();
+    stats.bytes_out[MSG_MDATA].add(header.size() + remix.size());
+    stats.mix_to_send.record(mixed_at, stats_clock::now());
+}
+
+/* Mix-minus sessions have remixes of their own, and multicast listeners
+ * take the shared one, so only plain unicast listeners are adapted -- and
+ * only in rooms whose remix the lighter encodings understand. */
+void Room::multi_adapt_downstream() {
+    if (!format_adaptable(format)) {
+        return;
+    }
+    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+        Session & session = *(it->second);
+        if (session.adaptive && !session.mix_minus && !session.multicast) {
+            session.adapt_downstream();
+        }
+    }
+}
+
+/* mixed_at is left default for retransmits -- they don't count towards
+ * mix to send latency. Header and remix go out as two iovecs, the remix
+ * is never copied per session. */
+void Room::send_remix_datagram(shared_ptr<Session> session_p, uint32_t nr,
+                               stats_clock::time_point mixed_at) {
+    string header = session_p->get_datagram_header(nr);
+    const string & remix = remix_for(*session_p, nr);
+
+    //std::cout << "sending datagram to: " << remote_endpoint << endl;
+    //          <<  *datagram_p << "--end_of_data" << endl;
+
+    if (!server.send_datagram(session_p->udp_remote_endpoint, header, remix)) {
+        return;
+    }
+    stats.packets_out[MSG_DATA].add();
+    stats.bytes_out[MSG_DATA].add(header.size() + remix.size());
+    if (mixed_at != stats_clock::time_point()) {
+        stats.mix_to_send.record(mixed_at, stats_clock::now());
+        ++session_p->down_sent;
+    } else {
+        ++session_p->down_resent;
+    }
+}
+
+/* A lighter variant is encoded by the first listener that needs it and
+ * then shared, so each costs one encoding per tick however many
+ * listeners are on it. */
+const string & Room::remix_for(Session & session, uint32_t nr) {
+    if (session.mix_minus) {
+        return session.own_remixes[nr];
+    }
+    if (session.downstream_format == FORMAT_FULL) {
+        return remixes[nr];
+    }
+    auto & cache = variants[session.downstream_format];
+    auto it = cache.find(nr);
+    if (it == cache.end()) {
+        it = cache.insert(make_pair(nr, encode_downstream(remixes[nr], session.downstream_format))).first;
+        if (cache.size() > params.buf_len && cache.begin() != it) {
+            cache.erase(cache.begin());
+        }
+    }
+    return it->second;
+}
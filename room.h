@@ -0,0 +1,160 @@
+#ifndef __room_h_
+#define __room_h_
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include "server_params.h"
+#include "session.h"
+#include "mixer.h"
+#include "stats.h"
+#include "upstream.h"
+#include "server_clock.h"
+#include "mix_pool.h"
+#include "recorder.h"
+#include "file_source.h"
+
+using std::shared_ptr;
+using std::string;
+using std::map;
+using std::vector;
+using std::pair;
+
+const string DEFAULT_ROOM = "default";
+
+class Server;
+
+/* Reports of one interval, handed over to the server for TCP delivery */
+typedef vector<pair<shared_ptr<Session>, shared_ptr<string>>> report_batch_t;
+
+/* A conference: its own session set, mixing tick, remix history and
+ * reports. Everything a room does runs on its strand, so rooms tick in
+ * parallel on the server's worker threads. The server talks to a room only
+ * by posting to that strand.
+ *
+ * A room without sessions has no timers armed; the server drops it. */
+class Room : public std::enable_shared_from_this<Room>
+{
+public:
+    Room(string, Server &, ServerParams &, ServerStats &, boost::asio::io_service &);
+
+    /* MEMBERSHIP */
+    void join(shared_ptr<Session>);
+    void leave(shared_ptr<Session>);
+    void suspend(shared_ptr<Session>);
+    void resume(shared_ptr<Session>, udp::endpoint, tcp::endpoint, string tcp_endpoint_str);
+    void stop();
+
+    /* SNAPSHOT -- remix history; only while no handler runs */
+    void save(SnapshotWriter &) const;
+    void restore(SnapshotReader &);
+
+    /* UDP */
+    void upload(shared_ptr<Session>, string, uint32_t, stats_clock::time_point, uint64_t);
+    void retransmit(shared_ptr<Session>, uint32_t);
+    bool data_due_within_ack_delay();
+    void send_ack(shared_ptr<Session>);
+
+    /* REPORTS */
+    void schedule_report();
+    void report(const boost::system::error_code&);
+    void construct_report();
+    void multi_send_report();
+    shared_ptr<string> choose_report(Session &);
+    void multi_reset_fifo_stats();
+
+    /* MIX AND SEND */
+    void schedule_mix_and_send();
+    void mix_and_send(const boost::system::error_code& ec);
+
+    string mix();
+    void run_mixer(struct mixer_input*, size_t, char*, size_t*);
+    vector<mixer_input> construct_mixer_inputs();
+    vector<size_t> select_loudest(vector<mixer_input> & inputs);
+    void multi_consume(vector<mixer_input> & inputs, const vector<size_t> & held_back);
+    void multi_mix_minus(const vector<mixer_input> & inputs);
+    void record_remix();
+    void multi_record_input(const vector<mixer_input> & inputs, const vector<size_t> & held_back);
+
+    /* FILE SOURCES -- virtual inputs, mixed after the sessions */
+    void play(string, shared_ptr<MappedFile>, bool);
+    void stop_source(string);
+
+    /* CASCADING */
+    void feed_upstream(string);
+    void consume_upstream(size_t);
+
+    void multi_send_remix_datagram(uint32_t);
+    void send_remix_datagram(shared_ptr<Session>, uint32_t,
+                             stats_clock::time_point mixed_at = stats_clock::time_point());
+    const string & remix_for(Session &, uint32_t);
+    void send_multicast_datagram(uint32_t, stats_clock::time_point);
+    void multi_adapt_downstream();
+
+
+    /* --- DATA --- */
+
+    string name;
+    boost::asio::io_service::strand strand;
+
+    /* Touched only by the server, on its strand */
+    size_t members;
+
+    /* Link to the parent server, set by the server before the first join */
+    shared_ptr<Upstream> upstream;
+
+    /* Threads helping with big mixes, set likewise; none if null */
+    shared_ptr<MixPool> mix_pool;
+
+    /* Where ticks are recorded, set likewise; none if null */
+    shared_ptr<Recorder> recorder;
+
+    /* What its sessions upload and get, set likewise -- by the first
+     * client, or the server's */
+    AudioFormat format;
+
+private:
+    Server & server;
+    ServerParams & params;
+    ServerStats & stats;
+
+    /* TIMERS */
+    server_timer report_timer;
+    server_timer mix_and_send_timer;
+    bool running;
+
+    /* RECORDING -- the mix's stream, declared on its first tick */
+    uint32_t record_stream;
+
+    /* MIXER -- a tick of the room's format, grown when the format is set */
+    vector<char> output_buf;
+    vector<char> cascade_buf;
+
+    /* CASCADING -- the parent's remix, mixed in like one more session */
+    vector<char> upstream_fifo;
+    bool upstream_active;
+
+    /* SESSIONS */
+    map<uint32_t, shared_ptr<Session>> sessions;
+
+    /* FILE SOURCES -- by name */
+    map<string, FileSource> sources;
+
+    /* REPORTS -- built once per interval, buffers reused when no write
+     * refers to them anymore */
+    shared_ptr<string> full_report_p;
+    shared_ptr<string> delta_report_p;
+    shared_ptr<string> baseline_report_p; // the full one, marked for delta clients
+    string report_aggregates;
+    string report_scratch;
+    vector<string> removed_since_report;
+
+    /* SENT DATAGRAMS */
+    uint32_t remix_nr; // can be set to any number at start
+    std::map<uint32_t, string> remixes;
+    std::map<uint32_t, string> variants[FORMAT_COUNT]; // lighter encodings, by format
+};
+
+#endif
@@ -19,14 +19,27 @@ using std::endl;
     const bool DEBUG = true;
 #endif
 
+/* A connection that was made and then lost is retried at once, to resume
+ * the session while the server keeps it. A server we had a session with
+ * is likely restarting, so for a while it is retried often. */
 void run_client(ClientParams params) {
+ClientResumeState state;
+int quick_retries = 0;
 while (true) {
     std::cerr << "Runclient..." << endl;
     boost::asio::io_service io_service;
-    Client client(params, io_service);
+    Client client(params, io_service, state);
     io_service.run();
+    state = client.get_resume_state();
     std::cerr << "Terminating...\n";
-    boost::this_thread::sleep(boost::posix_time::milliseconds(800)); 
+    if (state.connected) {
+        quick_retries = 0;
+    } else if (!state.token.empty() && quick_retries < 50) {
+        ++quick_retries;
+        boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+    } else {
+        boost::this_thread::sleep(boost::posix_time::milliseconds(800)); 
+    }
 }
 }
 
@@ -42,17 +55,39 @@ try {
         ("server_name,s", po::value<std::string>(&params.server_name)->required())
         ("port,p", po::value<uint16_t>(&params.port)->default_value(DEFAULT_PORT))
         ("retransmit_limit,X", po::value<size_t>(&params.retransmit_limit)->default_value(DEFAULT_RETRANSMIT_LIMIT))
+        ("report,r", po::value<std::string>(&params.report_mode)->default_value(DEFAULT_REPORT_MODE),
+         "report format: full, delta or self")
+        ("room,R", po::value<std::string>(&params.room)->default_value(""),
+         "room to join (server's default room if empty)")
+        ("format,f", po::value<std::string>(&params.format)->default_value(""),
+         "rate:sample:channels of our audio, e.g. 48000:s16:1 (the room's if empty)")
+        ("mixminus", po::bool_switch(&params.mix_minus),
+         "don't hear our own upload back")
+        ("multicast", po::bool_switch(&params.multicast),
+         "receive remixes from the server's multicast group when it has one")
+        ("adapt", po::value<bool>(&params.adapt)->default_value(true),
+         "let the server send lighter audio (mono, lower rate) over a lossy link")
+        ("latency", po::value<unsigned long>(&params.latency_interval)->default_value(DEFAULT_LATENCY_INTERVAL),
+         "ms between reports of uplink, jitter buffer, mix and downlink delay (0: off)")
     ;
 
     po::variables_map vm;
     po::store(po::parse_command_line(argc, argv, desc), vm);
     po::notify(vm);
+    params.use_stdio = true;
 
     if (DEBUG) {
         cout << "Settings:" << endl;
         cout << "server_name         -- " << params.server_name << endl;
         cout << "port                -- " << params.port << endl;
         cout << "retransmit_limit    -- " << params.retransmit_limit << endl;
+        cout << "report              -- " << params.report_mode << endl;
+        cout << "room                -- " << params.room << endl;
+        cout << "format              -- " << params.format << endl;
+        cout << "mixminus            -- " << params.mix_minus << endl;
+        cout << "multicast           -- " << params.multicast << endl;
+        cout << "adapt               -- " << params.adapt << endl;
+        cout << "latency             -- " << params.latency_interval << endl;
     }
 
     if (vm.count("help")) {
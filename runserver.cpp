@@ -1,11 +1,16 @@
 #include <iostream>
 #include <exception>
+#include <stdexcept>
+#include <cstdio>
+#include <fstream>
 #include <boost/program_options.hpp>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
+#include <boost/thread/thread.hpp>
 #include <signal.h>
 #include "server_params.h"
 #include "server.h"
+#include "logger.h"
 
 #ifdef NDEBUG
     const bool DEBUG = false;
@@ -20,21 +25,23 @@ using std::endl;
 
 boost::asio::io_service io_service;
 
-void on_signal(int signum) {
+/* Signals are delivered as io_service events: stopping the io_service from
+ * a plain signal handler may deadlock once several threads run it. */
+boost::asio::signal_set signals(io_service);
+
+int stop_signal = 0;
+
+void on_signal(const boost::system::error_code & ec, int signum) {
+        stop_signal = signum;
         io_service.stop();
 }
 
 
 
 void setup_signals() {
-    struct sigaction action;
-    action.sa_handler = on_signal;
-    action.sa_flags = 0;
-    sigemptyset(&action.sa_mask);
-    sigaddset(&action.sa_mask, SIGINT);
-    sigaddset(&action.sa_mask, SIGTERM);
-    sigaction(SIGINT, &action, NULL);
-    sigaction(SIGTERM, &action, NULL);
+    signals.add(SIGINT);
+    signals.add(SIGTERM);
+    signals.async_wait(on_signal);
 }
 
 
@@ -44,7 +51,34 @@ void run_server(ServerParams params) {
         cout << "Runserver..." << endl;
     }
     Server server(params, io_service);
+
+    /* A snapshot is used once: it is gone after loading, so a later start
+     * doesn't bring back sessions long dead. */
+    if (!params.snapshot.empty() && std::ifstream(params.snapshot.c_str())) {
+        try {
+            server.load_snapshot(params.snapshot);
+        } catch (std::exception & e) {
+            LOG(LOG_ERROR, "snapshot", LOG_NO_CLIENT, "snapshot not loaded: %s", e.what());
+        }
+        std::remove(params.snapshot.c_str());
+    }
+
+    /* Rooms tick on their own strands, spread over the workers */
+    boost::thread_group workers;
+    for (size_t i = 1; i < params.workers; ++i) {
+        workers.create_thread(boost::bind(&boost::asio::io_service::run, &io_service));
+    }
     io_service.run();
+    workers.join_all();
+
+    /* SIGTERM is a restart: keep the sessions for the next process */
+    if (!params.snapshot.empty() && stop_signal == SIGTERM) {
+        try {
+            server.save_snapshot(params.snapshot);
+        } catch (std::exception & e) {
+            LOG(LOG_ERROR, "snapshot", LOG_NO_CLIENT, "snapshot not saved: %s", e.what());
+        }
+    }
 }
 
 
@@ -65,6 +99,50 @@ try {
         ("fifo_high_watermark,H", po::value<size_t>(&params.fifo_high_watermark))
         ("buf_len,X", po::value<size_t>(&params.buf_len)->default_value(DEFAULT_BUF_LEN))
         ("tx_interval,i", po::value<unsigned long>(&params.tx_interval)->default_value(DEFAULT_TX_INTERVAL))
+        ("ack_delay", po::value<unsigned long>(&params.ack_delay)->default_value(DEFAULT_ACK_DELAY),
+         "max ms an ACK may wait to be piggybacked on DATA (0 disables)")
+        ("udp_timeout", po::value<unsigned long>(&params.udp_timeout)->default_value(DEFAULT_UDP_TIMEOUT),
+         "ms of UDP silence after which a session is removed")
+        ("report_backlog", po::value<size_t>(&params.report_backlog)->default_value(DEFAULT_REPORT_BACKLOG),
+         "consecutive reports a TCP write may stay in flight before the session is dropped")
+        ("report_interval", po::value<unsigned long>(&params.report_interval)->default_value(DEFAULT_REPORT_INTERVAL),
+         "ms between reports")
+        ("stats_port", po::value<uint16_t>(&params.stats_port)->default_value(DEFAULT_STATS_PORT),
+         "localhost port serving Prometheus stats over HTTP (0 disables)")
+        ("workers", po::value<size_t>(&params.workers)->default_value(DEFAULT_WORKERS),
+         "threads running room ticks")
+        ("udp_backend", po::value<std::string>()->default_value("epoll"),
+         "how datagrams are sent: epoll (a sendmsg each), sendmmsg (one per tick) or uring (io_uring both ways, epoll if unavailable)")
+        ("resume_grace", po::value<unsigned long>(&params.resume_grace)->default_value(DEFAULT_RESUME_GRACE),
+         "ms a session whose client is lost waits to be resumed (0 disables)")
+        ("loudest", po::value<size_t>(&params.loudest)->default_value(DEFAULT_LOUDEST),
+         "mix only this many loudest sessions of a room each tick (0: all)")
+        ("mix_threads", po::value<size_t>(&params.mix_threads)->default_value(DEFAULT_MIX_THREADS),
+         "threads helping rooms mix big rooms or long ticks (0: each room mixes alone)")
+        ("agc", po::value<bool>(&params.agc)->default_value(DEFAULT_AGC),
+         "bring every session's level towards the same loudness")
+        ("format", po::value<std::string>()->default_value(audio_format_name(DEFAULT_AUDIO_FORMAT)),
+         "rate:sample:channels of the audio mixed, sample s16 or f32; a client may ask for another in its room")
+        ("snapshot", po::value<std::string>(&params.snapshot)->default_value(""),
+         "file sessions are saved to on SIGTERM and restored from at start")
+        ("record", po::value<std::string>(&params.record)->default_value(""),
+         "file every room's mix is appended to, with an index in <file>.idx")
+        ("record_inputs", po::bool_switch(&params.record_inputs),
+         "record each session's input too")
+        ("trace", po::value<std::string>(&params.trace)->default_value(""),
+         "file every datagram received and TCP accept is appended to, for replay")
+        ("play", po::value<std::vector<std::string>>(&params.play)->multitoken(),
+         "room=file of raw PCM in the room's format, looped in the room while it has members")
+        ("play_dir", po::value<std::string>(&params.play_dir)->default_value(""),
+         "directory the stats endpoint's /play may take files from (empty: /play is off)")
+        ("parent", po::value<std::string>(),
+         "host[:port] of a server to join as a client, mixing its room into ours")
+        ("parent_room", po::value<std::string>(&params.parent_room)->default_value(""),
+         "room to join on the parent (its default room if empty)")
+        ("cascade_room", po::value<std::string>(&params.cascade_room)->default_value(DEFAULT_CASCADE_ROOM),
+         "local room linked to the parent")
+        ("multicast", po::value<std::string>(),
+         "IPv4 group:port to send each remix to once, for clients that join it")
     ;
 
     po::variables_map vm;
@@ -74,6 +152,38 @@ try {
     if (!vm.count("fifo_high_watermark")) {
         params.fifo_high_watermark = params.fifo_size;
     }
+    if (!parse_audio_format(vm["format"].as<std::string>(), params.format)) {
+        throw std::invalid_argument("bad format: " + vm["format"].as<std::string>());
+    }
+    const std::string & udp_backend = vm["udp_backend"].as<std::string>();
+    if (udp_backend == "epoll") {
+        params.udp_backend = UDP_BACKEND_EPOLL;
+    } else if (udp_backend == "sendmmsg") {
+        params.udp_backend = UDP_BACKEND_SENDMMSG;
+    } else if (udp_backend == "uring") {
+        params.udp_backend = UDP_BACKEND_URING;
+    } else {
+        throw std::invalid_argument("bad udp_backend: " + udp_backend);
+    }
+    params.parent_port = DEFAULT_PORT;
+    if (vm.count("parent")) {
+        params.parent_name = vm["parent"].as<std::string>();
+        size_t colon = params.parent_name.rfind(':');
+        if (colon != std::string::npos) {
+            params.parent_port = std::stoi(params.parent_name.substr(colon + 1));
+            params.parent_name.erase(colon);
+        }
+    }
+
+    params.multicast_port = params.port;
+    if (vm.count("multicast")) {
+        params.multicast_group = vm["multicast"].as<std::string>();
+        size_t colon = params.multicast_group.rfind(':');
+        if (colon != std::string::npos) {
+            params.multicast_port = std::stoi(params.multicast_group.substr(colon + 1));
+            params.multicast_group.erase(colon);
+        }
+    }
 
     if (DEBUG) {    
         cout << "Settings:" << endl;
@@ -83,6 +193,30 @@ try {
         cout << "fifo_high_watermark -- " << params.fifo_high_watermark << endl;
         cout << "buf_len             -- " << params.buf_len << endl;
         cout << "tx_interval         -- " << params.tx_interval << endl;
+        cout << "ack_delay           -- " << params.ack_delay << endl;
+        cout << "udp_timeout         -- " << params.udp_timeout << endl;
+        cout << "report_backlog      -- " << params.report_backlog << endl;
+        cout << "report_interval     -- " << params.report_interval << endl;
+        cout << "stats_port          -- " << params.stats_port << endl;
+        cout << "workers             -- " << params.workers << endl;
+        cout << "udp_backend         -- " << udp_backend << endl;
+        cout << "resume_grace        -- " << params.resume_grace << endl;
+        cout << "loudest             -- " << params.loudest << endl;
+        cout << "mix_threads         -- " << params.mix_threads << endl;
+        cout << "format              -- " << audio_format_name(params.format) << endl;
+        cout << "agc                 -- " << params.agc << endl;
+        cout << "snapshot            -- " << params.snapshot << endl;
+        cout << "record              -- " << params.record << endl;
+        cout << "record_inputs       -- " << params.record_inputs << endl;
+        cout << "trace               -- " << params.trace << endl;
+        for (auto it = params.play.begin(); it != params.play.end(); ++it) {
+            cout << "play                -- " << *it << endl;
+        }
+        cout << "play_dir            -- " << params.play_dir << endl;
+        cout << "parent              -- " << params.parent_name << ":" << params.parent_port << endl;
+        cout << "parent_room         -- " << params.parent_room << endl;
+        cout << "cascade_room        -- " << params.cascade_room << endl;
+        cout << "multicast           -- " << params.multicast_group << ":" << params.multicast_port << endl;
     }
 
     if (vm.count("help")) {
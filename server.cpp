@@ -1,15 +1,24 @@
 #include <boost/bind.hpp>
 #include <iostream>
 #include <exception>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/random.h>
+#include <cmath>
+#include <set>
 #include "server.h"
+#include "logger.h"
 
 
 namespace asio = boost::asio;
 
+using std::istream;
 using std::istringstream;
 using std::stringstream;
-using std::cerr;
-using std::endl;
 using std::getline;
 using std::move;
 using std::make_shared;
@@ -27,256 +36,552 @@ Server::Server(ServerParams _params,
                asio::io_service & _io_service) 
     : params(_params), 
       io_service(_io_service),
+      strand(io_service),
       acceptor(io_service, tcp::endpoint(tcp::v6(), params.port)),
       udp_socket(io_service, udp::endpoint(udp::v6(), params.port)),
-      report_timer(io_service, seconds(0)),
+      multicast_socket(io_service),
       remove_bad_sessions_timer(io_service, seconds(0)),
-      mix_and_send_timer(io_service, seconds(0)),
       next_free_id(0),
-      remix_nr(0)
+      liveness_wheel(params.udp_timeout / LIVENESS_RESOLUTION + 1)
 {
-    schedule_report();
+    if (params.stats_port != 0) {
+        stats_endpoint = make_shared<StatsEndpoint>(
+            io_service, strand, params.stats_port, boost::bind(&Server::render_stats, this));
+        stats_endpoint->control("/gain", boost::bind(&Server::set_gain, this, _1, _2));
+        stats_endpoint->control("/play", boost::bind(&Server::play, this, _1, _2));
+        stats_endpoint->control("/stop", boost::bind(&Server::stop_playing, this, _1, _2));
+    }
+    if (!params.multicast_group.empty()) {
+        multicast_endpoint = udp::endpoint(
+            asio::ip::address::from_string(params.multicast_group), params.multicast_port);
+        multicast_socket.open(multicast_endpoint.protocol());
+        multicast_socket.set_option(asio::ip::multicast::enable_loopback(true));
+        multicast_socket.set_option(asio::ip::multicast::hops(1));
+    }
+    if (params.mix_threads > 0) {
+        mix_pool = make_shared<MixPool>(params.mix_threads);
+    }
+    if (!params.record.empty()) {
+        recorder = make_shared<Recorder>(params.record, stats, stats.record_drops);
+    }
+    if (!params.trace.empty()) {
+        tracer = make_shared<Recorder>(params.trace, stats, stats.trace_drops);
+    }
+    for (auto it = params.play.begin(); it != params.play.end(); ++it) {
+        size_t eq = it->find('=');
+        if (eq == string::npos) {
+            throw std::invalid_argument("bad play, room=file expected: " + *it);
+        }
+        string file = it->substr(eq + 1);
+        looped_sources[it->substr(0, eq)][file] = make_shared<MappedFile>(file);
+    }
+    if (!params.parent_name.empty()) {
+        upstream = make_shared<Upstream>(
+            params.parent_name, params.parent_port, params.parent_room,
+            boost::bind(&Server::feed_from_upstream, this, _1));
+    }
+    if (params.udp_backend == UDP_BACKEND_URING) {
+        try {
+            ring = make_shared<UdpRing>(
+                udp_socket.native_handle(), io_service, strand, stats,
+                boost::bind(&Server::receive_datagram, this, _1, _2, _3),
+                boost::bind(&Server::fall_back_to_receive_udp, this));
+        } catch (std::runtime_error & e) {
+            LOG(LOG_WARN, "udp_backend", LOG_NO_CLIENT, "%s; falling back to epoll", e.what());
+            params.udp_backend = UDP_BACKEND_EPOLL;
+        }
+    }
     schedule_remove_bad_sessions();
-    schedule_mix_and_send();
     accept_tcp();
-    receive_udp();
+    if (!ring) {
+        receive_udp();
+    }
 }
 
 /* REPORTS */
 
-void Server::schedule_report() {
-    report_timer.expires_at(report_timer.expires_at() + seconds(1));
-    report_timer.async_wait(
+/* Called by rooms from their strands */
+void Server::queue_reports(shared_ptr<report_batch_t> batch_p,
+                           shared_ptr<string> baseline_report_p,
+                           shared_ptr<string> delta_report_p) {
+    strand.post(
         boost::bind(
-            &Server::report,
+            &Server::deliver_reports,
             this,
-            asio::placeholders::error));
+            batch_p,
+            baseline_report_p,
+            delta_report_p));
 }
 
-void Server::report(const boost::system::error_code& ec) {
-    schedule_report();
-    if (ec) {
-        cerr << "timer error in report\n"
-             << ec.message() << endl;
-        return;
-    }
-
-    /* Report message must be passed using shared_ptr to make sure it persits
-     * till all operations referring to it finish. */
-    auto report_p = make_shared<string>(construct_report());
-    
-    multi_send_report(report_p);
-    multi_reset_fifo_stats();
-}
-
-void Server::multi_send_report(shared_ptr<string> report_p) {
-    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
-        auto session_p = it->second;
+void Server::deliver_reports(shared_ptr<report_batch_t> batch_p,
+                             shared_ptr<string> baseline_report_p,
+                             shared_ptr<string> delta_report_p) {
+    vector<shared_ptr<Session>> stuck;
+    for (auto it = batch_p->begin(); it != batch_p->end(); ++it) {
+        auto session_p = it->first;
+        auto report_p = it->second;
+        if (sessions.find(session_p->id) == sessions.end() || session_p->detached
+            || !session_p->tcp_socket_p->is_open()) {
+            continue; // removed meanwhile, or no connection to send on
+        }
+        if (session_p->tcp_in_flight) {
+            ++session_p->tcp_backlogged_reports;
+            if (session_p->tcp_backlogged_reports > params.report_backlog) {
+                stuck.push_back(session_p);
+                continue;
+            }
+        } else {
+            session_p->tcp_backlogged_reports = 0;
+        }
+        /* A queued message about to be replaced may be the baseline the
+         * delta refers to, or carry removals -- send a fresh baseline then,
+         * marked as one so the client starts its table over. */
+        if (report_p == delta_report_p && session_p->tcp_pending) {
+            report_p = baseline_report_p;
+        }
         send_report(session_p, report_p);
     }
-}
 
-void Server::multi_reset_fifo_stats() {
-    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
-        auto session_p = it->second;
-        session_p->reset_fifo_stats();
+    for (auto it = stuck.begin(); it != stuck.end(); ++it) {
+        LOG(LOG_WARN, "tcp_backlog", (*it)->id, "TCP report backlog too long, backlog: %zu",
+            (*it)->get_tcp_backlog());
+        stats.backlog_disconnects.add();
+        disconnect_session(*it);
     }
 }
 
-string Server::construct_report() {
-    stringstream stream;
-    stream << "\n";
-    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
-        Session & session = *(it->second);
-        if (session.uses_udp) {
-            stream << session.get_info();
+/* Queues a TCP message. While a write is in flight only the newest unsent
+ * message is kept, so a stuck client costs at most two messages. */
+void Server::send_report(shared_ptr<Session> session_p, shared_ptr<string> report_p) {
+    Session & session = *session_p;
+    if (session.tcp_in_flight) {
+        if (session.tcp_pending) {
+            ++session.reports_coalesced;
+            stats.reports_coalesced.add();
         }
+        session.tcp_pending = report_p;
+        return;
     }
-    return stream.str();
+    start_tcp_write(session_p, report_p);
 }
 
-void Server::send_report(shared_ptr<Session> session_p, shared_ptr<string> report_p) {
+void Server::start_tcp_write(shared_ptr<Session> session_p, shared_ptr<string> report_p) {
     Session & session = *session_p;
+    session.tcp_in_flight = report_p;
+    stats.tcp_bytes_out.add(report_p->size());
     asio::async_write(
         *session.tcp_socket_p, 
         asio::buffer(*report_p),
-        boost::bind(
+        strand.wrap(boost::bind(
             &Server::handle_send_report, 
             this,
             asio::placeholders::error,
             asio::placeholders::bytes_transferred,
             session_p,
-            report_p)
+            report_p))
     );
 }
 
 void Server::handle_send_report(const boost::system::error_code& ec, size_t n,
                                 shared_ptr<Session> session_p, shared_ptr<string> report_p)
 {
+   if (session_p->resumed_as) {
+       /* The CLIENT greeting of a connection that resumed a session: the
+        * write now belongs to the resumed one */
+       handle_send_report(ec, n, session_p->resumed_as, report_p);
+       return;
+   }
+   Session & session = *session_p;
+   if (session.tcp_in_flight != report_p) {
+       return; // a write on a connection the session has since lost or replaced
+   }
+   session.tcp_in_flight.reset();
    if (ec) {
-       cerr << "TCP problem -- id: " << session_p->id << "\n"
-            << ec.message() << endl;
+       LOG(LOG_WARN, "tcp_error", session_p->id, "TCP problem: %s", ec.message().c_str());
 
-       remove_session(session_p);
+       session.tcp_pending.reset();
+       lose_client(session_p);
+       return;
+   }
+   if (session.tcp_pending) {
+       auto pending_p = session.tcp_pending;
+       session.tcp_pending.reset();
+       start_tcp_write(session_p, pending_p);
    }
 }
 
+size_t Server::get_tcp_backlog() {
+    size_t backlog = 0;
+    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+        backlog += it->second->get_tcp_backlog();
+    }
+    return backlog;
+}
+
 /* BAD SESSIONS REMOVAL */
 
 void Server::remove_session(shared_ptr<Session> session_p) {
     auto id = session_p->id;
-    cerr << "removing session -- id: " << id;
 
     auto it = sessions.find(id);
     if (it != sessions.end()) {
+        if (session_p->detached) {
+            detached_sessions.erase(id);
+        } else if (session_p->uses_udp) {
+            endpoint_to_session.erase(session_p->udp_key);
+        }
         if (session_p->uses_udp) {
-            endpoint_to_session.erase(session_p->udp_remote_endpoint);
+            sessions_by_token.erase(session_p->resume_token);
         }
+        liveness_wheel.erase(session_p->liveness);
+        leave_room(session_p);
         sessions.erase(it);
+        LOG(LOG_INFO, "session_removed", id, "removing session");
+    } else {
+        LOG(LOG_WARN, "session_removed", id, "removing session: session removed earlier!");
+    }
+}
+
+/* Removes the session and closes its TCP connection, which cancels any
+ * write still in flight. */
+void Server::disconnect_session(shared_ptr<Session> session_p) {
+    remove_session(session_p);
+    session_p->tcp_pending.reset();
+    boost::system::error_code ignored;
+    session_p->tcp_socket_p->close(ignored);
+}
+
+/* The client is gone, but it may come back: a UDP session waits
+ * resume_grace ms, suspended in its room, for a connection presenting its
+ * token. */
+void Server::lose_client(shared_ptr<Session> session_p) {
+    if (params.resume_grace == 0 || !session_p->uses_udp || session_p->detached) {
+        remove_session(session_p);
+        return;
+    }
+    endpoint_to_session.erase(session_p->udp_key);
+    liveness_wheel.erase(session_p->liveness);
+    session_p->detached = true;
+    session_p->resume_deadline = stats_clock::now() + std::chrono::milliseconds(params.resume_grace);
+    detached_sessions.insert(make_pair(session_p->id, session_p));
+
+    session_p->tcp_pending.reset();
+    boost::system::error_code ignored;
+    session_p->tcp_socket_p->close(ignored);
+
+    auto room_p = session_p->room;
+    room_p->strand.post(boost::bind(&Room::suspend, room_p, session_p));
+    LOG(LOG_INFO, "session_detached", session_p->id, "client lost, session kept for %lu ms",
+        params.resume_grace);
+}
+
+/* A token is all it takes to take a session over, so it comes from the
+ * kernel's CSPRNG: a seeded generator would give itself away after a few
+ * hundred greetings. */
+uint64_t Server::new_resume_token() {
+    uint64_t token;
+    ssize_t n;
+    do {
+        n = getrandom(&token, sizeof(token), 0);
+    } while (n < 0 && errno == EINTR);
+    if (n != sizeof(token)) {
+        throw std::runtime_error(string("getrandom failed: ") + strerror(errno));
+    }
+    return token;
+}
+
+/* The fresh session made for the new connection only lends it its TCP
+ * socket and is dropped; the old one carries on with the new endpoints.
+ * The client may well be back before we noticed it was gone -- then the
+ * old connection is dropped here. */
+bool Server::resume_session(udp::endpoint endpoint, shared_ptr<Session> new_session_p,
+                            const string & token_str) {
+    uint64_t token = strtoull(token_str.c_str(), NULL, 16);
+    auto it = sessions_by_token.find(token);
+    if (it == sessions_by_token.end()) {
+        LOG(LOG_INFO, "resume_failed", new_session_p->id, "no session to resume");
+        return false;
+    }
+    auto session_p = it->second;
+    if (session_p->detached) {
+        detached_sessions.erase(session_p->id);
     } else {
-        cerr << "session removed earlier! -- id: " << session_p->id;
+        endpoint_to_session.erase(session_p->udp_key);
+        liveness_wheel.erase(session_p->liveness);
+        boost::system::error_code ignored;
+        session_p->tcp_socket_p->close(ignored);
     }
-    cerr << "\n";
+    liveness_wheel.erase(new_session_p->liveness);
+    sessions.erase(new_session_p->id);
+
+    session_p->detached = false;
+    session_p->tcp_socket_p = new_session_p->tcp_socket_p;
+    /* The greeting may still be on its way: its write is carried over,
+     * or a report would start a second one on the same socket */
+    session_p->tcp_in_flight = new_session_p->tcp_in_flight;
+    session_p->tcp_pending = new_session_p->tcp_pending;
+    new_session_p->resumed_as = session_p;
+    session_p->tcp_backlogged_reports = 0;
+    session_p->needs_full_report = true;
+
+    session_p->udp_key = endpoint;
+    endpoint_to_session.insert(make_pair(endpoint, session_p));
+    liveness_wheel.insert(session_p->liveness, session_p->id);
+    stats.sessions_resumed.add();
+
+    auto room_p = session_p->room;
+    room_p->strand.post(boost::bind(&Room::resume, room_p, session_p, endpoint,
+                                    new_session_p->tcp_remote_endpoint,
+                                    new_session_p->tcp_remote_endpoint_str));
+    LOG(LOG_INFO, "session_resumed", session_p->id, "resumed by connection %u",
+        new_session_p->id);
+    return true;
 }
 
 void Server::schedule_remove_bad_sessions() {
-    remove_bad_sessions_timer.expires_at(remove_bad_sessions_timer.expires_at() + seconds(1));
-    remove_bad_sessions_timer.async_wait(
+    remove_bad_sessions_timer.expires_at(remove_bad_sessions_timer.expires_at()
+                                         + milliseconds(LIVENESS_RESOLUTION));
+    remove_bad_sessions_timer.async_wait(strand.wrap(
         boost::bind(
             &Server::remove_bad_sessions,
             this,
-            asio::placeholders::error)
+            asio::placeholders::error))
         );
 }
 
 void Server::remove_bad_sessions(const boost::system::error_code& ec) {
     schedule_remove_bad_sessions();
     if (ec) {
-        cerr << "timer error in remove_bad_sessions\n"
-             << ec.message() << endl;
+        LOG(LOG_ERROR, "timer", LOG_NO_CLIENT, "timer error in remove_bad_sessions: %s",
+            ec.message().c_str());
         return;
     }
-    
-    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
-        auto session_p = it->second;
-        Session & session = *session_p;
-        if (session.uses_udp) {
-            if (session.udp_alive) {
-                session.reset_alive_stats();
-            } else {
-                cerr << "udp not alive -- id: " << session_p->id << "\n";
-                remove_session(session_p);
-            }
+
+    /* Expired ids are already detached from the wheel, so removing their
+     * sessions doesn't disturb anything we iterate over. */
+    list<uint32_t> expired = liveness_wheel.advance();
+    for (auto it = expired.begin(); it != expired.end(); ++it) {
+        auto session_it = sessions.find(*it);
+        if (session_it == sessions.end()) {
+            continue;
         }
+        auto session_p = session_it->second;
+        session_p->liveness.linked = false;
+        LOG(LOG_INFO, "udp_timeout", session_p->id, "udp not alive");
+        lose_client(session_p);
+    }
+
+    auto now = stats_clock::now();
+    vector<shared_ptr<Session>> abandoned;
+    for (auto it = detached_sessions.begin(); it != detached_sessions.end(); ++it) {
+        if (it->second->resume_deadline <= now) {
+            abandoned.push_back(it->second);
+        }
+    }
+    for (auto it = abandoned.begin(); it != abandoned.end(); ++it) {
+        stats.resume_expired.add();
+        remove_session(*it);
     }
 }
 
-/* MIXING AND SENDING */
+/* ROOMS */
 
-void Server::schedule_mix_and_send() { 
-    mix_and_send_timer.expires_at(mix_and_send_timer.expires_at() + milliseconds(params.tx_interval));
-    mix_and_send_timer.async_wait(
-        boost::bind(
-            &Server::mix_and_send,
-            this,
-            asio::placeholders::error)
-        );
+shared_ptr<Room> Server::find_or_create_room(const string & name) {
+    auto it = rooms.find(name);
+    if (it != rooms.end()) {
+        return it->second;
+    }
+    auto room_p = make_room(name);
+    rooms.insert(make_pair(name, room_p));
+    return room_p;
 }
 
-void Server::mix_and_send(const boost::system::error_code& ec) {
-    schedule_mix_and_send();
-    if (ec) {
-        cerr << "timer error mix_and_send\n"
-             << ec.message() << endl;
-        return;
+/* A room wired to the server's shared parts, not yet in rooms */
+shared_ptr<Room> Server::make_room(const string & name) {
+    auto room_p = make_shared<Room>(name, *this, params, stats, io_service);
+    room_p->mix_pool = mix_pool;
+    room_p->recorder = recorder;
+    if (name == params.cascade_room) {
+        room_p->upstream = upstream;
     }
+    return room_p;
+}
 
-    ++remix_nr;
-    remixes.insert(make_pair(remix_nr, mix()));
-    if (remixes.size() > params.buf_len) {
-        remixes.erase(remix_nr - params.buf_len);
+/* Once its format is settled, a room gets the files looped in it */
+void Server::start_sources(shared_ptr<Room> room_p) {
+    auto it = looped_sources.find(room_p->name);
+    if (it == looped_sources.end()) {
+        return;
+    }
+    for (auto source = it->second.begin(); source != it->second.end(); ++source) {
+        room_p->strand.post(boost::bind(&Room::play, room_p, source->first, source->second, true));
     }
-    multi_send_remix_datagram(remix_nr);
 }
 
-string Server::mix() {
-    vector<mixer_input> inputs = construct_mixer_inputs();
-    size_t output_size = OUTPUT_BUF_SIZE;
-    mixer(inputs.data(), inputs.size(), (void*) output_buf, &output_size, params.tx_interval);
-    multi_consume(inputs);
-    return string((const char*) output_buf, output_size);
+/* The room is forgotten as soon as its last member leaves; it stops its
+ * timers on its own strand. */
+void Server::leave_room(shared_ptr<Session> session_p) {
+    auto room_p = session_p->room;
+    if (!room_p) {
+        return;
+    }
+    session_p->room.reset();
+    if (--room_p->members == 0) {
+        rooms.erase(room_p->name);
+    }
+    room_p->strand.post(boost::bind(&Room::leave, room_p, session_p));
 }
 
+/* CASCADING */
 
-vector<mixer_input> Server::construct_mixer_inputs() {
-    vector<mixer_input> inputs;
-    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
-        Session & session = *(it->second);
-        if (session.fifo_state == ACTIVE) {
-            auto input_data = session.get_data();
-            struct mixer_input input {input_data.first, input_data.second, 0};
-            inputs.push_back(input);
-        }
+void Server::feed_from_upstream(const string & data) {
+    strand.post(boost::bind(&Server::deliver_from_upstream, this, data));
+}
+
+/* The parent's remix is only of use while the linked room has members */
+void Server::deliver_from_upstream(string data) {
+    auto it = rooms.find(params.cascade_room);
+    if (it == rooms.end()) {
+        return;
     }
-    return inputs;
+    auto room_p = it->second;
+    room_p->strand.post(boost::bind(&Room::feed_upstream, room_p, data));
 }
 
-void Server::multi_consume(vector<mixer_input> & inputs) {
-    int counter = 0;
-    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
-        Session & session = *(it->second);
-        if (session.fifo_state == ACTIVE) {
-            session.consume(inputs[counter].consumed);
-            ++counter;
-        }
+/* SENDING UDP */
+
+/* Datagrams a tick on this thread has staged, for udp_backend sendmmsg or
+ * uring; entries past batch_size keep their buffers' capacity */
+static thread_local bool batch_open = false;
+static thread_local vector<outgoing_datagram_t> batch;
+static thread_local size_t batch_size = 0;
+static thread_local vector<struct mmsghdr> batch_msgs;
+static thread_local vector<struct iovec> batch_iovs;
+
+/* A non-blocking sendmsg on the descriptor is safe to issue from any
+ * thread, unlike asio operations on a shared socket object, and completes
+ * at once -- no handler, no copy of the datagram kept alive. A full socket
+ * buffer drops the datagram, as the network could.
+ *
+ * The other backends stage the datagram and send it with the rest of the
+ * batch, or at once outside one. A staged datagram counts as sent. */
+bool Server::send_datagram(const udp::endpoint & endpoint, const string & header,
+                           const string & payload) {
+    if (datagram_sink) {
+        return datagram_sink(endpoint, header, payload);
+    }
+    if (params.udp_backend == UDP_BACKEND_EPOLL) {
+        return send_on(udp_socket, endpoint, header, payload);
+    }
+    if (batch_size == batch.size()) {
+        batch.push_back(outgoing_datagram_t());
     }
+    outgoing_datagram_t & datagram = batch[batch_size++];
+    datagram.endpoint = endpoint;
+    datagram.data.assign(header);
+    datagram.data.append(payload);
+    if (!batch_open) {
+        flush_datagrams();
+    }
+    return true;
 }
 
-void Server::multi_send_remix_datagram(uint32_t nr) {
-    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
-        auto session_p = it->second;
-        if (session_p->uses_udp) {
-            send_remix_datagram(session_p, nr);
-        }
+/* Datagrams sent on this thread wait for flush_datagrams -- e.g. at the
+ * end of a room's tick. They are copied when staged: a remix variant may
+ * be evicted from its cache before the batch goes out. */
+void Server::begin_batch() {
+    batch_open = params.udp_backend != UDP_BACKEND_EPOLL && !datagram_sink;
+}
+
+void Server::flush_datagrams() {
+    batch_open = false;
+    if (batch_size == 0) {
+        return;
+    }
+    if (ring) {
+        ring->send(batch.data(), batch_size);
+    } else {
+        send_mmsg(batch.data(), batch_size);
     }
+    batch_size = 0;
 }
 
-void Server::send_remix_datagram(shared_ptr<Session> session_p, uint32_t nr) {
-    udp::endpoint remote_endpoint = session_p->udp_remote_endpoint;
-    auto datagram_p = make_shared<string>(construct_remix_datagram(session_p, nr));
+/* Takes unicast datagrams instead of the socket -- set before the server
+ * runs, e.g. by a benchmark that keeps them in memory. */
+void Server::set_datagram_sink(datagram_sink_t sink) {
+    datagram_sink = sink;
+}
 
-    //std::cout << "sending datagram to: " << remote_endpoint << endl;
-    //          <<  *datagram_p << "--end_of_data" << endl;
-    
-    udp_socket.async_send_to(
-        asio::buffer(*datagram_p),
-        remote_endpoint,
-        boost::bind(
-            &Server::handle_send_remix_datagram,
-            this,
-            asio::placeholders::error,
-            asio::placeholders::bytes_transferred,
-            session_p,
-            datagram_p)
-        );
+/* One datagram for every multicast listener of every room: the header
+ * names the room. */
+bool Server::send_multicast(const string & header, const string & payload) {
+    return send_on(multicast_socket, multicast_endpoint, header, payload);
+}
 
+bool Server::multicast_enabled() {
+    return multicast_socket.is_open();
 }
 
-string Server::construct_remix_datagram(shared_ptr<Session> session_p, uint32_t nr) {
-    stringstream stream;
-    stream << session_p->get_datagram_header(nr)
-           << remixes[nr];
+bool Server::send_on(udp::socket & socket, const udp::endpoint & endpoint,
+                     const string & header, const string & payload) {
+    struct iovec iov[2];
+    iov[0].iov_base = (void*) header.data();
+    iov[0].iov_len = header.size();
+    iov[1].iov_base = (void*) payload.data();
+    iov[1].iov_len = payload.size();
 
-    return stream.str();
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void*) endpoint.data();
+    msg.msg_namelen = endpoint.size();
+    msg.msg_iov = iov;
+    msg.msg_iovlen = payload.empty() ? 1 : 2;
+
+    stats.udp_send_calls.add();
+    if (::sendmsg(socket.native_handle(), &msg, MSG_DONTWAIT) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            stats.udp_send_drops.add();
+        } else {
+            LOG(LOG_WARN, "send_udp", LOG_NO_CLIENT, "sendmsg failed: %s", strerror(errno));
+        }
+        return false;
+    }
+    return true;
 }
-    
-void Server::handle_send_remix_datagram(const boost::system::error_code& ec, size_t n,
-                                        shared_ptr<Session> session_p, shared_ptr<string> datagram_p)
-{
-   if (ec) {
-       cerr << "error after send_remix_datagram -- id: " << session_p->id
-            << "\n" << ec.message() << endl;
-   }
+
+/* sendmmsg stops at the first datagram it can't send, and fails only if
+ * that is the first: skip it and go on with the rest. */
+void Server::send_mmsg(const outgoing_datagram_t * datagrams, size_t count) {
+    batch_msgs.resize(count);
+    batch_iovs.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+        const outgoing_datagram_t & datagram = datagrams[i];
+        batch_iovs[i].iov_base = (void*) datagram.data.data();
+        batch_iovs[i].iov_len = datagram.data.size();
+
+        struct msghdr & msg = batch_msgs[i].msg_hdr;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = (void*) datagram.endpoint.data();
+        msg.msg_namelen = datagram.endpoint.size();
+        msg.msg_iov = &batch_iovs[i];
+        msg.msg_iovlen = 1;
+    }
+
+    size_t sent = 0;
+    while (sent < count) {
+        stats.udp_send_calls.add();
+        int n = ::sendmmsg(udp_socket.native_handle(), &batch_msgs[sent], count - sent, MSG_DONTWAIT);
+        if (n > 0) {
+            sent += n;
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            stats.udp_send_drops.add();
+        } else {
+            LOG(LOG_WARN, "send_udp", LOG_NO_CLIENT, "sendmmsg failed: %s", strerror(errno));
+        }
+        ++sent;
+    }
 }
 
 /* ACCEPTING TCP */
@@ -285,24 +590,30 @@ void Server::accept_tcp() {
     auto tcp_socket_p = make_shared<tcp::socket>(io_service);
     acceptor.async_accept(
         *tcp_socket_p,
-        boost::bind(
+        strand.wrap(boost::bind(
             &Server::handle_accept_tcp,
             this,
             asio::placeholders::error,
-            tcp_socket_p)
+            tcp_socket_p))
     );
 }
     
 void Server::handle_accept_tcp(const boost::system::error_code& ec, shared_ptr<tcp::socket> tcp_socket_p) {
     if (ec) {
-        cerr << "error after accept_tcp\n";
+        LOG(LOG_WARN, "accept", LOG_NO_CLIENT, "error after accept_tcp: %s", ec.message().c_str());
         accept_tcp();
         return;
     }
-    cerr << "accepted new session -- id: " << next_free_id << "\n";
+    LOG(LOG_INFO, "session_accepted", next_free_id, "accepted new session");
+    if (tracer) {
+        tracer->record_event(RECORD_ACCEPT, string(), NULL, 0);
+    }
     
-    auto new_session_p = make_shared<Session>(next_free_id, params, tcp_socket_p);
+    auto new_session_p = make_shared<Session>(next_free_id, params, stats, tcp_socket_p);
+    new_session_p->resume_token = new_resume_token();
     sessions.insert(make_pair(next_free_id, new_session_p));
+    /* A connection that never sends CLIENT times out like a silent one */
+    liveness_wheel.insert(new_session_p->liveness, next_free_id);
     
     ++next_free_id;
     send_client_message(new_session_p);
@@ -317,35 +628,112 @@ void Server::send_client_message(shared_ptr<Session> session_p) {
 
 
 /* ACCEPTING UDP */
+
+/* Rate-limiting key for log lines about endpoints without a session */
+static uint64_t endpoint_key(const udp::endpoint & endpoint) {
+    uint64_t key = endpoint.port();
+    if (endpoint.address().is_v4()) {
+        return key * 131 + endpoint.address().to_v4().to_ulong();
+    }
+    auto bytes = endpoint.address().to_v6().to_bytes();
+    for (size_t i = 0; i < bytes.size(); ++i) {
+        key = key * 131 + bytes[i];
+    }
+    return key;
+}
+
+static string to_str(const udp::endpoint & endpoint) {
+    stringstream stream;
+    stream << endpoint;
+    return stream.str();
+}
+
+/* CLIENT datagrams may carry optional "key=value" words after the id,
+ * e.g. "CLIENT 7 room=jazz report=delta\n". Servers ignore keys they
+ * don't know. */
+static map<string, string> parse_client_options(istream & istream) {
+    map<string, string> options;
+    string word;
+    while (istream >> word) {
+        size_t eq = word.find('=');
+        if (eq != string::npos) {
+            options[word.substr(0, eq)] = word.substr(eq + 1);
+        }
+    }
+    return options;
+}
+
 void Server::receive_udp() {
     udp_socket.async_receive_from(
         boost::asio::buffer(recv_buf),
         udp_remote_endpoint,
-        boost::bind(
+        strand.wrap(boost::bind(
             &Server::handle_receive_udp,
             this,
             asio::placeholders::error,
-            asio::placeholders::bytes_transferred)
+            asio::placeholders::bytes_transferred))
     );
 }
 
 void Server::handle_receive_udp(const boost::system::error_code& ec, size_t n) {
     if (ec) {
-        cerr << "error after receive_udp\n";
+        LOG(LOG_WARN, "receive_udp", LOG_NO_CLIENT, "error after receive_udp: %s",
+            ec.message().c_str());
         receive_udp();
         return;
     }
+    receive_datagram(udp_remote_endpoint, recv_buf, n);
+    receive_udp();
+}
 
-    char* newline_pos = std::find(recv_buf, recv_buf + n, '\n');
-    if (newline_pos == recv_buf + n) {
-        cerr << "no newline in received udp datagram\n";
-        receive_udp();
+/* Off the socket, by either backend */
+void Server::receive_datagram(const udp::endpoint & endpoint, const char * buf, size_t n) {
+    if (tracer) {
+        trace_datagram(endpoint, buf, n);
+    }
+    process_datagram(endpoint, buf, n);
+}
+
+/* The ring keeps sending; only receiving goes back to asio */
+void Server::fall_back_to_receive_udp() {
+    LOG(LOG_WARN, "udp_backend", LOG_NO_CLIENT, "io_uring can't receive here; falling back to epoll");
+    receive_udp();
+}
+
+/* Only datagrams off the socket are traced: a replay feeds them back
+ * through process_datagram. Layout in recorder.h. */
+void Server::trace_datagram(const udp::endpoint & endpoint, const char * buf, size_t n) {
+    trace_prefix.clear();
+    if (endpoint.address().is_v4()) {
+        auto bytes = endpoint.address().to_v4().to_bytes();
+        trace_prefix += (char) bytes.size();
+        trace_prefix.append((const char*) bytes.data(), bytes.size());
+    } else {
+        auto bytes = endpoint.address().to_v6().to_bytes();
+        trace_prefix += (char) bytes.size();
+        trace_prefix.append((const char*) bytes.data(), bytes.size());
+    }
+    trace_prefix += (char) (endpoint.port() & 0xff);
+    trace_prefix += (char) (endpoint.port() >> 8);
+    tracer->record_event(RECORD_DATAGRAM, trace_prefix, buf, n);
+}
+
+/* Parses one datagram and hands it on, as if it had just come from the
+ * endpoint. On the server strand. */
+void Server::process_datagram(const udp::endpoint & endpoint, const char * buf, size_t n) {
+    udp_received_at = stats_clock::now();
+
+    const char* newline_pos = std::find(buf, buf + n, '\n');
+    if (newline_pos == buf + n) {
+        stats.parse_failures.add();
+        LOG(LOG_WARN, "bad_header", endpoint_key(endpoint),
+            "no newline in udp datagram from: %s", to_str(endpoint).c_str());
         return;
     }
     
-    char* header_start = recv_buf;
-    char* data_start = newline_pos + 1;
-    char* data_end = recv_buf + n;
+    const char* header_start = buf;
+    const char* data_start = newline_pos + 1;
+    const char* data_end = buf + n;
     
     string header(header_start, data_start);
     string data(data_start, data_end);
@@ -356,119 +744,458 @@ void Server::handle_receive_udp(const boost::system::error_code& ec, size_t n) {
     try {
         istream >> type;
 
-        //std::cout << "NOWE UDP -- type: " << type << endl;
+        stats_msg_t msg_type = MSG_UNKNOWN;
+        uint32_t number = 0;
         if (type == "CLIENT") {
-            uint32_t id;
-            istream >> id;
-            client(udp_remote_endpoint, id);
+            msg_type = MSG_CLIENT;
         } else if (type == "UPLOAD") {
-            uint32_t nr;
-            istream >> nr;
-            upload(udp_remote_endpoint, data, nr);
+            msg_type = MSG_UPLOAD;
         } else if (type == "RETRANSMIT") {
-            uint32_t nr;
-            istream >> nr;
-            retransmit(udp_remote_endpoint, nr);
+            msg_type = MSG_RETRANSMIT;
         } else if (type == "KEEPALIVE") {
-            keepalive(udp_remote_endpoint);
+            msg_type = MSG_KEEPALIVE;
+        }
+        if (msg_type == MSG_CLIENT || msg_type == MSG_UPLOAD || msg_type == MSG_RETRANSMIT) {
+            istream >> number;
+        }
+        stats.packets_in[msg_type].add();
+        stats.bytes_in[msg_type].add(n);
+
+        //std::cout << "NOWE UDP -- type: " << type << endl;
+        if (msg_type == MSG_UNKNOWN || istream.fail()) {
+            stats.parse_failures.add();
+            LOG(LOG_WARN, "bad_header", endpoint_key(endpoint),
+                "bad udp header from: %s", to_str(endpoint).c_str());
+        } else if (msg_type == MSG_CLIENT) {
+            client(endpoint, number, parse_client_options(istream));
+        } else if (msg_type == MSG_UPLOAD) {
+            string word;
+            uint64_t stamp = 0;
+            if (istream >> word) {
+                parse_latency_stamp(word, stamp);
+            }
+            upload(endpoint, data, number, stamp);
+        } else if (msg_type == MSG_RETRANSMIT) {
+            retransmit(endpoint, number);
         } else {
-            cerr << "bad udp header from: " << udp_remote_endpoint << endl;
+            keepalive(endpoint);
         }
     } catch(std::exception& e) {
-        cerr << "bad udp header from: " << udp_remote_endpoint << endl;
-        return;
+        LOG(LOG_WARN, "bad_header", endpoint_key(endpoint),
+            "bad udp header from: %s", to_str(endpoint).c_str());
     }
-    receive_udp();
 }
 
-void Server::client(udp::endpoint endpoint, uint32_t id) {
+void Server::client(udp::endpoint endpoint, uint32_t id,
+                    const map<string, string> & options) {
     auto it = sessions.find(id);
-    if (it != sessions.end()) {
-        auto session_p = it->second;
-        session_p->init_udp(endpoint);
-        endpoint_to_session.insert(make_pair(endpoint, session_p));
-        send_ack(session_p);
-    } else {
-        cerr << "not existing client tried to init udp -- id: " << id << endl;
+    if (it == sessions.end()) {
+        LOG(LOG_WARN, "unknown_client", endpoint_key(endpoint),
+            "not existing client tried to init udp -- id: %u", id);
+        return;
+    }
+    auto session_p = it->second;
+    if (session_p->uses_udp) {
+        /* Repeated CLIENT -- the room already knows the session */
+        liveness_wheel.refresh(session_p->liveness);
+        return;
+    }
+
+    auto resume_it = options.find("resume");
+    if (resume_it != options.end() && resume_session(endpoint, session_p, resume_it->second)) {
+        return;
+    }
+
+    auto report_it = options.find("report");
+    if (report_it != options.end()
+        && !parse_report_mode(report_it->second, session_p->report_mode)) {
+        LOG(LOG_WARN, "client_option", id, "unknown report mode: %s",
+            report_it->second.c_str());
+    }
+    auto mix_minus_it = options.find("mixminus");
+    session_p->mix_minus = mix_minus_it != options.end() && mix_minus_it->second == "1";
+    auto multicast_it = options.find("multicast");
+    session_p->multicast = multicast_enabled() && multicast_it != options.end()
+                           && multicast_it->second == "1";
+    auto adapt_it = options.find("adapt");
+    session_p->adaptive = adapt_it != options.end() && adapt_it->second == "1";
+    auto room_it = options.find("room");
+    string room_name = room_it != options.end() ? room_it->second : DEFAULT_ROOM;
+
+    /* The first client of a room picks its format; the rest must match */
+    auto room_p = find_or_create_room(room_name);
+    AudioFormat format = room_p->members > 0 ? room_p->format : params.format;
+    auto format_it = options.find("format");
+    if (format_it != options.end()) {
+        AudioFormat wanted;
+        if (!parse_audio_format(format_it->second, wanted)
+            || (room_p->members > 0 && wanted != room_p->format)) {
+            LOG(LOG_WARN, "client_format", id, "format %s refused, room \"%s\" is %s",
+                format_it->second.c_str(), room_name.c_str(),
+                audio_format_name(format).c_str());
+            if (room_p->members == 0) {
+                rooms.erase(room_name);
+            }
+            disconnect_session(session_p);
+            return;
+        }
+        format = wanted;
+    }
+    room_p->format = format;
+    session_p->format = format;
+    if (room_p->members == 0) {
+        start_sources(room_p);
     }
+
+    session_p->init_udp(endpoint);
+    endpoint_to_session.insert(make_pair(endpoint, session_p));
+    sessions_by_token.insert(make_pair(session_p->resume_token, session_p));
+    liveness_wheel.insert(session_p->liveness, id);
+
+    ++room_p->members;
+    session_p->room = room_p;
+    room_p->strand.post(boost::bind(&Room::join, room_p, session_p));
 }
 
 void Server::retransmit(udp::endpoint endpoint, uint32_t nr) {
     auto it = endpoint_to_session.find(endpoint);
     if (it == endpoint_to_session.end()) {
-        cerr << "unknown udp endpoint asking for retransmit: "
-             << endpoint << "\n";
+        stats.unknown_endpoint.add();
+        LOG(LOG_WARN, "unknown_endpoint", endpoint_key(endpoint),
+            "unknown udp endpoint asking for retransmit: %s", to_str(endpoint).c_str());
         return;
     }
     auto session_p = it->second;
-    session_p->keepalive();
-    
-    uint32_t min_avaiable = remix_nr + 1 - remixes.size();
-    uint32_t start = std::max(nr, min_avaiable);
-    
-    for (uint32_t i = start; i <= remix_nr; ++i) {
-        send_remix_datagram(session_p, i);
-    }
+    liveness_wheel.refresh(session_p->liveness);
+
+    auto room_p = session_p->room;
+    room_p->strand.post(boost::bind(&Room::retransmit, room_p, session_p, nr));
 }
 
-void Server::upload(udp::endpoint endpoint, string data, uint32_t nr) {
+void Server::upload(udp::endpoint endpoint, string data, uint32_t nr, uint64_t stamp) {
     /* NA TEST */
     //std::cout << "UPLOAD: " << endpoint << endl;
     auto it = endpoint_to_session.find(endpoint);
     if (it == endpoint_to_session.end()) {
-        cerr << "unknown udp endpoint wants to upload: "
-             << endpoint << "\n";
+        stats.unknown_endpoint.add();
+        LOG(LOG_WARN, "unknown_endpoint", endpoint_key(endpoint),
+            "unknown udp endpoint wants to upload: %s", to_str(endpoint).c_str());
         return;
     }
     auto session_p = it->second;
-    session_p->keepalive();
+    liveness_wheel.refresh(session_p->liveness);
 
-    if (nr != session_p->ack) {
-        cerr << "Upload with bad nr: " << nr
-             << " expected ack: " << session_p->ack
-             << " -- id: " << session_p->id << "\n";
-        return;
-    }
-    if (data.size() > session_p->get_win()) {
-        cerr << "Upload too big, size: " << data.size()
-             << " win: " << session_p->get_win() << " -- id " << session_p->id << "\n";
-        return;
-    }
-    //std::cout << "DATA: " << data << endl;
-    session_p->upload(data);
-    send_ack(session_p);
+    auto room_p = session_p->room;
+    room_p->strand.post(
+        boost::bind(&Room::upload, room_p, session_p, data, nr, udp_received_at, stamp));
 }
 
 void Server::keepalive(udp::endpoint endpoint) {
     auto it = endpoint_to_session.find(endpoint);
     if (it == endpoint_to_session.end()) {
-        cerr << "unknown udp endpoint asking for keepalive\n";
+        stats.unknown_endpoint.add();
+        LOG(LOG_WARN, "unknown_endpoint", endpoint_key(endpoint),
+            "unknown udp endpoint asking for keepalive: %s", to_str(endpoint).c_str());
         return;
     }
     auto session_p = it->second;
-    session_p->keepalive();
-}
-
-void Server::send_ack(shared_ptr<Session> session_p) {
-     auto ack_msg_p = make_shared<string>(session_p->get_ack_header());
-     
-     udp_socket.async_send_to(
-        asio::buffer(*ack_msg_p),
-        session_p->udp_remote_endpoint,
-     boost::bind(
-         &Server::handle_send_ack,
-         this,
-         boost::asio::placeholders::error,
-         boost::asio::placeholders::bytes_transferred,
-         session_p,
-         ack_msg_p)
-     );
-}
-
-void Server::handle_send_ack(const boost::system::error_code& ec, size_t n, shared_ptr<Session> session_p, shared_ptr<string> ack_msg_p) {
-    if (ec) {
-        cerr << "error after send_ack -- id: " << session_p->id << endl;
-        return;
+    liveness_wheel.refresh(session_p->liveness);
+}
+
+
+/* SNAPSHOT */
+
+/* Only with the io_service stopped: rooms and sessions are read without
+ * their strands. */
+void Server::save_snapshot(const string & path) {
+    SnapshotWriter out(path);
+    out.put_string(SNAPSHOT_MAGIC);
+    out.put_u32(next_free_id);
+
+    out.put_u32(rooms.size());
+    for (auto it = rooms.begin(); it != rooms.end(); ++it) {
+        out.put_string(it->first);
+        it->second->save(out);
     }
+
+    vector<shared_ptr<Session>> saved;
+    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+        if (it->second->uses_udp && it->second->room) {
+            saved.push_back(it->second);
+        }
+    }
+    out.put_u32(saved.size());
+    for (auto it = saved.begin(); it != saved.end(); ++it) {
+        out.put_u32((*it)->id);
+        out.put_string((*it)->room->name);
+        (*it)->save(out);
+    }
+    out.commit();
+    LOG(LOG_INFO, "snapshot", LOG_NO_CLIENT, "saved %zu sessions in %zu rooms to %s",
+        saved.size(), rooms.size(), path.c_str());
+}
+
+/* Before the io_service runs. Sessions come back on their old UDP
+ * endpoints, so audio flows as soon as their clients send anything; they
+ * have no TCP connection until the client reconnects and resumes. */
+void Server::load_snapshot(const string & path) {
+    SnapshotReader in(path);
+    if (in.get_string() != SNAPSHOT_MAGIC) {
+        throw std::runtime_error("not a snapshot: " + path);
+    }
+
+    /* Everything is read into these first: a snapshot that breaks off
+     * halfway leaves the server as it was */
+    uint32_t restored_next_free_id = in.get_u32();
+    map<string, shared_ptr<Room>> restored_rooms;
+    for (uint32_t n = in.get_u32(); n > 0; --n) {
+        string name = in.get_string();
+        auto room_p = make_room(name);
+        room_p->restore(in);
+        restored_rooms[name] = room_p;
+    }
+
+    uint32_t count = in.get_u32();
+    vector<shared_ptr<Session>> restored_sessions;
+    std::set<uint32_t> ids;
+    for (uint32_t n = 0; n < count; ++n) {
+        uint32_t id = in.get_u32();
+        string name = in.get_string();
+        if (id >= restored_next_free_id || !ids.insert(id).second) {
+            throw std::runtime_error("bad session id in snapshot");
+        }
+        auto & room_p = restored_rooms[name];
+        if (!room_p) {
+            room_p = make_room(name);
+        }
+        auto session_p = make_shared<Session>(id, params, stats, make_shared<tcp::socket>(io_service));
+        session_p->restore(in);
+        session_p->format = room_p->format;
+        session_p->room = room_p;
+        restored_sessions.push_back(session_p);
+    }
+
+    /* Only rooms somebody is in are taken */
+    next_free_id = restored_next_free_id;
+    for (auto it = restored_sessions.begin(); it != restored_sessions.end(); ++it) {
+        auto session_p = *it;
+        auto room_p = session_p->room;
+        if (room_p->members == 0) {
+            rooms.insert(make_pair(room_p->name, room_p));
+            start_sources(room_p);
+        }
+        sessions.insert(make_pair(session_p->id, session_p));
+        endpoint_to_session.insert(make_pair(session_p->udp_key, session_p));
+        sessions_by_token.insert(make_pair(session_p->resume_token, session_p));
+        liveness_wheel.insert(session_p->liveness, session_p->id);
+        if (session_p->fifo_state == ACTIVE) {
+            stats.sessions_active.add();
+        }
+        ++room_p->members;
+        room_p->join(session_p);
+    }
+    LOG(LOG_INFO, "snapshot", LOG_NO_CLIENT, "restored %u sessions from %s", count, path.c_str());
+}
+
+/* OPERATOR */
+
+/* key=value pairs of a query string, %XX and + decoded */
+map<string, string> Server::parse_query(const string & query) {
+    map<string, string> args;
+    istringstream words(query);
+    string word;
+    while (getline(words, word, '&')) {
+        string decoded;
+        for (size_t i = 0; i < word.size(); ++i) {
+            if (word[i] == '+') {
+                decoded += ' ';
+            } else if (word[i] == '%' && i + 2 < word.size()
+                       && isxdigit(word[i + 1]) && isxdigit(word[i + 2])) {
+                decoded += (char) std::stoi(word.substr(i + 1, 2), NULL, 16);
+                i += 2;
+            } else {
+                decoded += word[i];
+            }
+        }
+        size_t eq = decoded.find('=');
+        if (eq != string::npos) {
+            args[decoded.substr(0, eq)] = decoded.substr(eq + 1);
+        }
+    }
+    return args;
+}
+
+/* GET /gain?client=<id>&db=<dB> on the stats endpoint. The room picks the
+ * new gain up at its next tick. */
+int Server::set_gain(const string & query, string & body) {
+    map<string, string> args = parse_query(query);
+
+    uint32_t id;
+    double db;
+    try {
+        id = std::stoul(args.at("client"));
+        db = std::stod(args.at("db"));
+    } catch (std::exception & e) {
+        body = "usage: /gain?client=<id>&db=<dB>\n";
+        return 400;
+    }
+    auto it = sessions.find(id);
+    if (it == sessions.end()) {
+        body = "no client " + std::to_string(id) + "\n";
+        return 404;
+    }
+    db = std::min(MAX_GAIN_DB, std::max(MIN_GAIN_DB, db));
+    it->second->operator_gain.store(pow(10, db / 20), std::memory_order_relaxed);
+    LOG(LOG_INFO, "gain", id, "gain set to %.1f dB", db);
+    body = "ok\n";
+    return 200;
+}
+
+/* A file under --play_dir, by a relative path that stays inside it even
+ * through symlinks; empty if there is none */
+string Server::play_path(const string & file) {
+    if (params.play_dir.empty() || file.empty() || file[0] == '/') {
+        return string();
+    }
+    istringstream parts(file);
+    string part;
+    while (getline(parts, part, '/')) {
+        if (part == "..") {
+            return string();
+        }
+    }
+    char dir[PATH_MAX], resolved[PATH_MAX];
+    if (!realpath(params.play_dir.c_str(), dir)
+        || !realpath((params.play_dir + "/" + file).c_str(), resolved)) {
+        return string();
+    }
+    string prefix = string(dir) + "/";
+    if (string(resolved).compare(0, prefix.size(), prefix) != 0) {
+        return string();
+    }
+    return resolved;
+}
+
+/* GET /play?file=<path>[&room=<room>][&name=<name>][&loop=1]. The file is
+ * raw PCM in the room's format, under --play_dir; it plays as a member
+ * that never speaks up, named after the file unless given a name. A
+ * looped file stays with the room until stopped, even while it is empty;
+ * a file played once needs the room to have members. */
+int Server::play(const string & query, string & body) {
+    map<string, string> args = parse_query(query);
+    auto file_it = args.find("file");
+    if (file_it == args.end()) {
+        body = "usage: /play?file=<path>&room=<room>&name=<name>&loop=1\n";
+        return 400;
+    }
+    if (params.play_dir.empty()) {
+        body = "playing files is off, start the server with --play_dir\n";
+        return 403;
+    }
+    string path = play_path(file_it->second);
+    if (path.empty()) {
+        body = "no file " + file_it->second + " in the play directory\n";
+        return 403;
+    }
+    string room_name = args.count("room") ? args["room"] : DEFAULT_ROOM;
+    string name = args.count("name") ? args["name"] : file_it->second;
+    bool loop = args.count("loop") && args["loop"] == "1";
+
+    auto room_it = rooms.find(room_name);
+    if (!loop && room_it == rooms.end()) {
+        body = "no room " + room_name + "\n";
+        return 404;
+    }
+    shared_ptr<MappedFile> file;
+    try {
+        file = make_shared<MappedFile>(path);
+    } catch (std::exception & e) {
+        body = string(e.what()) + "\n";
+        return 400;
+    }
+    if (loop) {
+        looped_sources[room_name][name] = file;
+    }
+    if (room_it != rooms.end()) {
+        auto room_p = room_it->second;
+        room_p->strand.post(boost::bind(&Room::play, room_p, name, file, loop));
+    }
+    body = "ok\n";
+    return 200;
 }
 
+/* GET /stop?name=<name>[&room=<room>] */
+int Server::stop_playing(const string & query, string & body) {
+    map<string, string> args = parse_query(query);
+    auto name_it = args.find("name");
+    if (name_it == args.end()) {
+        body = "usage: /stop?name=<name>&room=<room>\n";
+        return 400;
+    }
+    string room_name = args.count("room") ? args["room"] : DEFAULT_ROOM;
+    auto looped_it = looped_sources.find(room_name);
+    if (looped_it != looped_sources.end()) {
+        looped_it->second.erase(name_it->second);
+        if (looped_it->second.empty()) {
+            looped_sources.erase(looped_it);
+        }
+    }
+    auto room_it = rooms.find(room_name);
+    if (room_it != rooms.end()) {
+        auto room_p = room_it->second;
+        room_p->strand.post(boost::bind(&Room::stop_source, room_p, name_it->second));
+    }
+    body = "ok\n";
+    return 200;
+}
+
+/* STATS */
+
+static void append_gauge(string & out, const string & name, const char * help, size_t value) {
+    out += "# HELP " + name + " " + help + "\n";
+    out += "# TYPE " + name + " gauge\n";
+    out += name + " " + std::to_string(value) + "\n";
+}
+
+/* Runs on the server strand. FIFO states belong to the rooms, so the
+ * number of ACTIVE sessions comes from a counter they keep. */
+string Server::render_stats() {
+    size_t udp_sessions = endpoint_to_session.size();
+    size_t active_sessions = std::min((size_t) stats.sessions_active.get(), udp_sessions);
+
+    string out;
+    append_gauge(out, "eognisko_sessions", "sessions with a TCP connection", sessions.size());
+    append_gauge(out, "eognisko_rooms", "rooms with members", rooms.size());
+    append_gauge(out, "eognisko_sessions_active", "UDP sessions with an ACTIVE FIFO", active_sessions);
+    append_gauge(out, "eognisko_sessions_filling", "UDP sessions with a FILLING FIFO",
+                 udp_sessions - active_sessions);
+    append_gauge(out, "eognisko_tcp_backlog_bytes", "bytes queued on TCP, all sessions",
+                 get_tcp_backlog());
+    append_levels(out);
+    stats.write_prometheus(out);
+    return out;
+}
+
+/* Per session, labelled by client id, as of the room's last report */
+void Server::append_levels(string & out) {
+    string level, peak, clips;
+    for (auto it = sessions.begin(); it != sessions.end(); ++it) {
+        Session & session = *(it->second);
+        if (!session.uses_udp) {
+            continue;
+        }
+        string label = "{client=\"" + std::to_string(session.id) + "\"} ";
+        level += "eognisko_session_level_dbfs" + label
+               + std::to_string(session.level_db.load(std::memory_order_relaxed)) + "\n";
+        peak += "eognisko_session_peak_dbfs" + label
+              + std::to_string(session.peak_db.load(std::memory_order_relaxed)) + "\n";
+        clips += "eognisko_session_clipped_samples_total" + label
+               + std::to_string(session.clips_total.load(std::memory_order_relaxed)) + "\n";
+    }
+    out += "# HELP eognisko_session_level_dbfs RMS of a session's upload over a report interval\n";
+    out += "# TYPE eognisko_session_level_dbfs gauge\n" + level;
+    out += "# HELP eognisko_session_peak_dbfs peak of a session's upload over a report interval\n";
+    out += "# TYPE eognisko_session_peak_dbfs gauge\n" + peak;
+    out += "# HELP eognisko_session_clipped_samples_total samples a session uploaded at full scale\n";
+    out += "# TYPE eognisko_session_clipped_samples_total counter\n" + clips;
+}
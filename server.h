@@ -1,12 +1,22 @@
 #ifndef __server_h_
 #define __server_h_
 
+#include <functional>
 #include <map>
 #include <string>
+#include <vector>
 #include <boost/asio.hpp>
 #include "server_params.h"
 #include "session.h"
-#include "mixer.h"
+#include "room.h"
+#include "timing_wheel.h"
+#include "stats.h"
+#include "upstream.h"
+#include "server_clock.h"
+#include "mix_pool.h"
+#include "recorder.h"
+#include "file_source.h"
+#include "udp_ring.h"
 
 using std::shared_ptr;
 using std::string;
@@ -15,40 +25,54 @@ using std::pair;
 using boost::asio::ip::tcp;
 using boost::asio::ip::udp;
 
-const size_t OUTPUT_BUF_SIZE = 10000;
 const size_t RECV_BUF_LEN = 100000;
+const unsigned long LIVENESS_RESOLUTION = 100; // ms per timing wheel slot
 
+/* Where unicast datagrams go instead of the socket, if set: endpoint,
+ * header, payload. Returns whether the datagram was taken. */
+typedef std::function<bool(const udp::endpoint &, const string &, const string &)> datagram_sink_t;
+
+/* Owns the sockets, the sessions and the rooms they are in. All of it is
+ * touched on the server strand only; mixing happens in the rooms. */
 class Server
 {
 public:
     Server(ServerParams, boost::asio::io_service &);
 
     /* REPORTS */
-    void schedule_report();
-    void report(const boost::system::error_code&);
-    string construct_report();
-    void multi_send_report(shared_ptr<string>);
+    void queue_reports(shared_ptr<report_batch_t>, shared_ptr<string>, shared_ptr<string>);
+    void deliver_reports(shared_ptr<report_batch_t>, shared_ptr<string>, shared_ptr<string>);
     void send_report(shared_ptr<Session>, shared_ptr<string>);
+    void start_tcp_write(shared_ptr<Session>, shared_ptr<string>);
     void handle_send_report(const boost::system::error_code&, size_t, shared_ptr<Session>, shared_ptr<string>);
-    
+    size_t get_tcp_backlog();
+
     /* BAD SESSIONS REMOVAL */
     void remove_session(shared_ptr<Session>);
+    void disconnect_session(shared_ptr<Session>);
+    void lose_client(shared_ptr<Session>);
+    bool resume_session(udp::endpoint, shared_ptr<Session>, const string &);
+    uint64_t new_resume_token();
     void schedule_remove_bad_sessions();
     void remove_bad_sessions(const boost::system::error_code& ec);
 
-    /* MIX AND SEND */
-    void schedule_mix_and_send();
-    void mix_and_send(const boost::system::error_code& ec);
-    
-    string mix();
-    vector<mixer_input> construct_mixer_inputs();
-    void multi_consume(vector<mixer_input> & inputs);
-    void multi_reset_fifo_stats();
+    /* ROOMS */
+    shared_ptr<Room> find_or_create_room(const string &);
+    shared_ptr<Room> make_room(const string &);
+    void start_sources(shared_ptr<Room>);
+    void leave_room(shared_ptr<Session>);
 
-    void multi_send_remix_datagram(uint32_t);
-    void send_remix_datagram(shared_ptr<Session>, uint32_t);
-    void handle_send_remix_datagram(const boost::system::error_code&, size_t, shared_ptr<Session>, shared_ptr<string>);
-    string construct_remix_datagram(shared_ptr<Session>, uint32_t);
+    /* CASCADING -- feed_from_upstream is called on the link's thread */
+    void feed_from_upstream(const string &);
+    void deliver_from_upstream(string);
+
+    /* SENDING UDP -- safe from any strand; a batch is per thread */
+    bool send_datagram(const udp::endpoint &, const string &, const string & payload = string());
+    void begin_batch();
+    void flush_datagrams();
+    bool send_multicast(const string &, const string &);
+    bool multicast_enabled();
+    void set_datagram_sink(datagram_sink_t);
 
     /* ACCEPTING TCP */
     void accept_tcp();
@@ -58,47 +82,92 @@ public:
     /* ACCEPTING UDP */
     void receive_udp();
     void handle_receive_udp(const boost::system::error_code&, size_t);
+    void receive_datagram(const udp::endpoint &, const char *, size_t);
+    void fall_back_to_receive_udp();
+    void trace_datagram(const udp::endpoint &, const char *, size_t);
+    void process_datagram(const udp::endpoint &, const char *, size_t);
 
-    void client(udp::endpoint, uint32_t);
-    void upload(udp::endpoint, string, uint32_t);
+    void client(udp::endpoint, uint32_t, const map<string, string> &);
+    void upload(udp::endpoint, string, uint32_t, uint64_t);
     void retransmit(udp::endpoint, uint32_t);
     void keepalive(udp::endpoint);
-    void send_ack(shared_ptr<Session>);
-    void handle_send_ack(const boost::system::error_code&, size_t n, shared_ptr<Session>, shared_ptr<string>);
+
+    /* SNAPSHOT */
+    void save_snapshot(const string &);
+    void load_snapshot(const string &);
+
+    /* OPERATOR -- commands on the stats endpoint */
+    static map<string, string> parse_query(const string &);
+    int set_gain(const string &, string &);
+    string play_path(const string &);
+    int play(const string &, string &);
+    int stop_playing(const string &, string &);
+
+    /* STATS */
+    string render_stats();
+    void append_levels(string &);
 
 
 
 private:
+    bool send_on(udp::socket &, const udp::endpoint &, const string &, const string &);
+    void send_mmsg(const outgoing_datagram_t *, size_t);
 
     /* --- DATA --- */
 
     ServerParams params;
     boost::asio::io_service & io_service;
-    
+    boost::asio::io_service::strand strand;
+
+    /* STATS */
+    ServerStats stats;
+    shared_ptr<StatsEndpoint> stats_endpoint;
+
     /* TCP */
     tcp::acceptor acceptor;
-    
+
     /* UDP */
     udp::socket udp_socket;
     udp::endpoint udp_remote_endpoint;
+    stats_clock::time_point udp_received_at;
     char recv_buf[RECV_BUF_LEN];
+    shared_ptr<UdpRing> ring; // both ways, if udp_backend is uring and the kernel has it
 
-    /* TIMERS */
-    boost::asio::deadline_timer report_timer;
-    boost::asio::deadline_timer remove_bad_sessions_timer;
-    boost::asio::deadline_timer mix_and_send_timer;
+    /* MULTICAST -- send only, closed unless a group is configured */
+    udp::socket multicast_socket;
+    udp::endpoint multicast_endpoint;
 
-    /* MIXER */
-    char output_buf[OUTPUT_BUF_SIZE];
+    datagram_sink_t datagram_sink;
+
+    /* TIMERS */
+    server_timer remove_bad_sessions_timer;
 
     /* SESSIONS */
     map<uint32_t, shared_ptr<Session>> sessions;
-    map<udp::endpoint, shared_ptr<Session>> endpoint_to_session; 
+    map<udp::endpoint, shared_ptr<Session>> endpoint_to_session;
     uint32_t next_free_id;
+    TimingWheel liveness_wheel;
+
+    /* RESUMPTION -- UDP sessions by token, and those waiting for their
+     * client by id */
+    map<uint64_t, shared_ptr<Session>> sessions_by_token;
+    map<uint32_t, shared_ptr<Session>> detached_sessions;
+
+    /* ROOMS -- only those with members */
+    map<string, shared_ptr<Room>> rooms;
+    shared_ptr<MixPool> mix_pool; // shared by the rooms, if mix_threads
+    shared_ptr<Recorder> recorder; // likewise, if recording
+
+    /* TRACE -- what came in, for replay; trace_prefix is scratch */
+    shared_ptr<Recorder> tracer;
+    string trace_prefix;
+
+    /* FILE SOURCES -- looped in a room whenever it has members; by room,
+     * then by name */
+    map<string, map<string, shared_ptr<MappedFile>>> looped_sources;
 
-    /* SENT DATAGRAMS */
-    uint32_t remix_nr; // can be set to any number at start
-    std::map<uint32_t, string> remixes;
+    /* CASCADING -- last, so the link's thread is joined first */
+    shared_ptr<Upstream> upstream;
 };
 
 #endif
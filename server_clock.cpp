@@ -0,0 +1,23 @@
+#include "server_clock.h"
+
+using boost::posix_time::ptime;
+using boost::posix_time::microsec_clock;
+
+static bool frozen = false;
+static ptime frozen_at;
+
+ptime server_clock_traits::now() {
+    if (frozen) {
+        return frozen_at;
+    }
+    return microsec_clock::universal_time();
+}
+
+void server_clock_traits::freeze() {
+    frozen_at = microsec_clock::universal_time();
+    frozen = true;
+}
+
+void server_clock_traits::advance(duration_type duration) {
+    frozen_at += duration;
+}
@@ -0,0 +1,21 @@
+#ifndef __server_clock_h_
+#define __server_clock_h_
+
+#include <boost/asio.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+/* Time as the server's timers see it: the system clock, unless someone
+ * froze it. A frozen clock only moves when advanced, so a benchmark can
+ * step the mixing ticks by hand and run exactly the timers that are due
+ * with io_service::poll(). Freeze it before the server is created. */
+struct server_clock_traits : public boost::asio::time_traits<boost::posix_time::ptime> {
+    static time_type now();
+
+    static void freeze();
+    static void advance(duration_type);
+};
+
+typedef boost::asio::basic_deadline_timer<
+    boost::posix_time::ptime, server_clock_traits> server_timer;
+
+#endif
@@ -2,6 +2,9 @@
 #define __server_params_h_
 #include <stdint.h>
 #include <cstddef>
+#include <string>
+#include <vector>
+#include "audio_format.h"
 
 const int ALBUM_NR = 337620;
 
@@ -10,6 +13,26 @@ const size_t DEFAULT_FIFO_SIZE = 10560;
 const size_t DEFAULT_FIFO_LOW_WATERMARK = 0;
 const size_t DEFAULT_BUF_LEN = 10;
 const unsigned long DEFAULT_TX_INTERVAL = 5;
+const unsigned long DEFAULT_ACK_DELAY = 5;
+const unsigned long DEFAULT_UDP_TIMEOUT = 1000;
+const size_t DEFAULT_REPORT_BACKLOG = 5;
+const unsigned long DEFAULT_REPORT_INTERVAL = 1000;
+const uint16_t DEFAULT_STATS_PORT = 0; // disabled
+const size_t DEFAULT_WORKERS = 1;
+const std::string DEFAULT_CASCADE_ROOM = "default";
+const unsigned long DEFAULT_RESUME_GRACE = 5000;
+const size_t DEFAULT_LOUDEST = 0; // mix every session
+const size_t DEFAULT_MIX_THREADS = 0; // rooms mix on their own
+const bool DEFAULT_AGC = false;
+
+/* How unicast datagrams leave: a sendmsg each, a sendmmsg per tick, or
+ * io_uring for both ways */
+typedef enum {
+    UDP_BACKEND_EPOLL,
+    UDP_BACKEND_SENDMMSG,
+    UDP_BACKEND_URING
+} udp_backend_t;
+const udp_backend_t DEFAULT_UDP_BACKEND = UDP_BACKEND_EPOLL;
 
 typedef struct {
         uint16_t port;
@@ -18,6 +41,30 @@ typedef struct {
         size_t fifo_high_watermark;
         size_t buf_len;
         unsigned long tx_interval;
+        unsigned long ack_delay;
+        unsigned long udp_timeout;
+        size_t report_backlog;
+        unsigned long report_interval;
+        uint16_t stats_port;
+        size_t workers;
+        udp_backend_t udp_backend;
+        unsigned long resume_grace;
+        size_t loudest;            // sessions mixed per tick in a room; 0: all
+        size_t mix_threads;        // helping rooms mix large ticks; 0: none
+        AudioFormat format;        // of rooms whose first client asks for none
+        bool agc;                  // level sessions towards AGC_TARGET
+        std::string snapshot;      // saved on SIGTERM, loaded at start; empty: none
+        std::string record;        // recording of every room's mix; empty: none
+        bool record_inputs;        // and of what each session gave to it
+        std::string trace;         // recording of datagrams and accepts; empty: none
+        std::vector<std::string> play; // room=file, looped in the room
+        std::string play_dir;      // where /play may take files from; empty: /play is off
+        std::string parent_name;   // empty: no parent server
+        uint16_t parent_port;
+        std::string parent_room;   // room joined on the parent
+        std::string cascade_room;  // local room linked to it
+        std::string multicast_group; // empty: DATA is unicast only
+        uint16_t multicast_port;
 } ServerParams;
 
 #endif
@@ -1,5 +1,9 @@
+#include <cstdio>
+#include <cmath>
+#include <cstring>
 #include <iostream>
 #include "session.h"
+#include "logger.h"
 
 using std::make_pair;
 using std::min;
@@ -7,45 +11,145 @@ using std::max;
 using std::stringstream;
 
 
+/* A session restored from a snapshot has no connection yet */
+static tcp::endpoint remote_endpoint_of(tcp::socket & socket) {
+    boost::system::error_code ignored;
+    return socket.remote_endpoint(ignored);
+}
+
 Session::Session(uint32_t _id,
                  ServerParams& _params,
+                 ServerStats& _stats,
                  shared_ptr<tcp::socket> _tcp_socket_p)
     : id(_id),
       params(_params),
+      stats(_stats),
       tcp_socket_p(_tcp_socket_p),
-      tcp_remote_endpoint(tcp_socket_p->remote_endpoint()),
+      tcp_remote_endpoint(remote_endpoint_of(*tcp_socket_p)),
+      tcp_backlogged_reports(0),
+      reports_coalesced(0),
+      report_mode(REPORT_FULL),
+      needs_full_report(true),
+      resume_token(0),
+      detached(false),
+      suspended(false),
       uses_udp(false),
       ack(0),
+      ack_pending(false),
+      advertised_win(0),
+      format(params.format),
+      multicast(false),
+      mix_minus(false),
+      adaptive(false),
+      downstream_format(FORMAT_FULL),
+      down_sent(0),
+      down_resent(0),
+      retransmit_requests(0),
+      clean_windows(0),
+      adapt_windows(0),
+      energy(0),
+      speaking(false),
+      operator_gain(1),
+      agc_gain(1),
+      level_db(LEVEL_FLOOR_DB),
+      peak_db(LEVEL_FLOOR_DB),
+      clips(0),
+      clips_total(0),
+      record_stream(NO_RECORD_STREAM),
       fifo_state(FILLING),
+      fifo_in_total(0),
+      fifo_out_total(0),
+      echo_stamp(0),
+      echo_jitter_buffer(0),
       fifo_max(0),
-      fifo_min(0),
-      udp_alive(false) {}
+      fifo_min(0)
+{
+    stringstream stream;
+    stream << tcp_remote_endpoint;
+    tcp_remote_endpoint_str = stream.str();
+}
 
 
-string Session::get_info()
+bool parse_report_mode(const string& name, report_mode_t& mode)
 {
-    stringstream stream;
+    if (name == "full") {
+        mode = REPORT_FULL;
+    } else if (name == "delta") {
+        mode = REPORT_DELTA;
+    } else if (name == "self") {
+        mode = REPORT_SELF;
+    } else {
+        return false;
+    }
+    return true;
+}
 
-    stream << tcp_remote_endpoint << " "
-           << "FIFO: " << fifo.size() << "/" << params.fifo_size << " "
-           << "(min. " << fifo_min << ", max. " << fifo_max << ")\n";
+/* Formats the report line into scratch (no stringstream, it runs for every
+ * session every report) and makes it the current info. Returns whether it
+ * differs from the previous one outside the meter fields: levels move
+ * every interval and would put every session in every delta report. */
+bool Session::update_info(string& scratch)
+{
+    using std::to_string;
 
-    return stream.str();
+    scratch.clear();
+    scratch += tcp_remote_endpoint_str;
+    scratch += " FIFO: ";
+    scratch += to_string(fifo.size());
+    scratch += "/";
+    scratch += to_string(params.fifo_size);
+    scratch += " (min. ";
+    scratch += to_string(fifo_min);
+    scratch += ", max. ";
+    scratch += to_string(fifo_max);
+    scratch += ")";
+    if (downstream_format != FORMAT_FULL) {
+        scratch += " downstream: ";
+        scratch += format_name(downstream_format);
+    }
+    bool changed = scratch != info_compared;
+    if (changed) {
+        info_compared.swap(scratch);
+    }
+
+    info.assign(info_compared);
+    info += " level: ";
+    info += to_string(lrintf(level_db.load(std::memory_order_relaxed)));
+    info += " dBFS, peak: ";
+    info += to_string(lrintf(peak_db.load(std::memory_order_relaxed)));
+    info += " dBFS, clipped: ";
+    info += to_string(clips);
+    info += "\n";
+    return changed;
 }
 
 string Session::get_datagram_header(uint32_t nr) {
+    /* Every DATA datagram carries ack and win, so it doubles as an ACK. */
+    ack_pending = false;
+
     stringstream stream;
 
+    advertised_win = get_win();
     stream << "DATA " << nr << " " << ack << " " 
-           << get_win() << "\n";
+           << advertised_win;
+    if (downstream_format != FORMAT_FULL) {
+        stream << " " << format_name(downstream_format);
+    }
+    append_echo(stream);
+    stream << "\n";
 
     return stream.str();
 }
 
 string Session::get_ack_header() {
+    ack_pending = false;
+
     stringstream stream;
 
-    stream << "ACK " << ack << " " << get_win() << "\n";
+    advertised_win = get_win();
+    stream << "ACK " << ack << " " << advertised_win;
+    append_echo(stream);
+    stream << "\n";
 
     return stream.str();
 }
@@ -53,7 +157,14 @@ string Session::get_ack_header() {
 string Session::get_client_header() {
     stringstream stream;
 
-    stream << "CLIENT " << id << "\n";
+    stream << "CLIENT " << id;
+    char token[32];
+    snprintf(token, sizeof(token), " token=%016llx", (unsigned long long) resume_token);
+    stream << token;
+    if (!params.multicast_group.empty()) {
+        stream << " multicast=" << params.multicast_group << ":" << params.multicast_port;
+    }
+    stream << "\n";
 
     return stream.str();
 }
@@ -64,11 +175,6 @@ void Session::reset_fifo_stats()
     fifo_max = fifo.size();
 }
 
-void Session::reset_alive_stats()
-{
-    udp_alive = false;
-}
-
 pair<void*, size_t> Session::get_data()
 {
     return make_pair((void*) fifo.data(), fifo.size());
@@ -80,31 +186,232 @@ void Session::consume(size_t bytes)
     fifo.erase(fifo.begin(), fifo.begin() + bytes_to_erase);
     fifo_min = min(fifo_min, fifo.size());
     if (fifo.size() <= params.fifo_low_watermark) {
+        if (fifo_state == ACTIVE) {
+            stats.fifo_underruns.add();
+            stats.sessions_active.sub();
+        }
         fifo_state = FILLING;
     }
+
+    /* Uploads fully mixed by now have waited their time in the FIFO */
+    fifo_out_total += bytes_to_erase;
+    if (!fifo_stamps.empty() && fifo_stamps.front().end <= fifo_out_total) {
+        auto now = stats_clock::now();
+        while (!fifo_stamps.empty() && fifo_stamps.front().end <= fifo_out_total) {
+            const fifo_stamp_t & mixed = fifo_stamps.front();
+            stats.fifo_to_mix.record(mixed.appended_at, now);
+            if (mixed.stamp != 0) {
+                echo_stamp = mixed.stamp;
+                echo_jitter_buffer = std::chrono::duration_cast<std::chrono::microseconds>(
+                    now - mixed.received_at).count();
+                echo_mixed_at = now;
+            }
+            fifo_stamps.pop_front();
+        }
+    }
+}
+
+/* Once per stamp: a lost datagram only loses a sample */
+void Session::append_echo(stringstream & stream) {
+    if (echo_stamp == 0) {
+        return;
+    }
+    uint64_t mix = std::chrono::duration_cast<std::chrono::microseconds>(
+        stats_clock::now() - echo_mixed_at).count();
+    stream << " " << latency_echo_word(echo_stamp, echo_jitter_buffer, mix);
+    echo_stamp = 0;
 }
 
 void Session::init_udp(udp::endpoint remote_endpoint) {
     udp_remote_endpoint = remote_endpoint;
+    udp_key = remote_endpoint;
     uses_udp = true;
-    keepalive();
 }
 
-void Session::keepalive() {
-    udp_alive = true;
+/* A sample as a fraction of full scale */
+static double unit_value(int16_t sample) { return sample / 32768.0; }
+static double unit_value(float sample) { return clean_sample(sample); }
+
+template <typename Sample>
+static double mean_square(const char * data, size_t samples) {
+    double sum = 0;
+    for (size_t i = 0; i < samples; ++i) {
+        Sample sample;
+        memcpy(&sample, data + sizeof(Sample) * i, sizeof(Sample));
+        double value = unit_value(sample);
+        sum += value * value;
+    }
+    return sum / samples;
+}
+
+/* Cheap enough to do on every upload: one pass over the samples, in a
+ * loop of their own type */
+void Session::measure_energy(const string & data) {
+    size_t samples = data.size() / format.sample_size();
+    if (samples == 0) {
+        return;
+    }
+    double square = format.sample == SAMPLE_F32
+                    ? mean_square<float>(data.data(), samples)
+                    : mean_square<int16_t>(data.data(), samples);
+    energy += ENERGY_SMOOTHING * (square - energy);
+}
+
+static float to_dbfs(double level) {
+    return level > 0 ? max(LEVEL_FLOOR_DB, (float) (20 * log10(level / 32768))) : LEVEL_FLOOR_DB;
+}
+
+/* Called by the room before each report, with no mix running */
+void Session::update_levels() {
+    uint64_t samples = meter.samples.load(std::memory_order_relaxed);
+    double rms = samples > 0 ? sqrt((double) meter.sum_squares.load(std::memory_order_relaxed) / samples) : 0;
+    level_db.store(to_dbfs(rms), std::memory_order_relaxed);
+    peak_db.store(to_dbfs(meter.peak.load(std::memory_order_relaxed)), std::memory_order_relaxed);
+    clips = meter.clips.load(std::memory_order_relaxed);
+    clips_total.fetch_add(clips, std::memory_order_relaxed);
+    meter.reset();
+}
+
+/* Called by the room once per tick the session is mixed in. AGC moves
+ * quickly to cut a session that got loud and slowly to lift a quiet one;
+ * silence leaves it where it was, so the noise floor isn't pumped up. */
+float Session::tick_gain() {
+    if (params.agc && energy > AGC_NOISE_FLOOR) {
+        double target = min(AGC_MAX_GAIN, max(AGC_MIN_GAIN, sqrt(AGC_TARGET / energy)));
+        agc_gain += (target < agc_gain ? AGC_ATTACK : AGC_RELEASE) * (target - agc_gain);
+    }
+    return operator_gain.load(std::memory_order_relaxed) * agc_gain;
 }
 
-void Session::upload(string data) {
+/* received_at is when the datagram came in, needed only with a stamp */
+void Session::upload(string data, uint64_t stamp, stats_clock::time_point received_at) {
     ++ack;
     for (size_t i = 0; i < data.size(); ++i) {
         fifo.push_back(data[i]);
     }
     fifo_max = max(fifo.size(), fifo_max);
-    if (fifo.size() >= params.fifo_high_watermark) {
+    if (params.loudest > 0 || params.agc) {
+        measure_energy(data);
+    }
+    if (fifo.size() >= params.fifo_high_watermark && fifo_state != ACTIVE) {
         fifo_state = ACTIVE;
+        stats.sessions_active.add();
+    }
+    if (get_win() == 0) {
+        stats.fifo_overruns.add();
     }
+
+    fifo_in_total += data.size();
+    fifo_stamp_t fifo_stamp = {fifo_in_total, stats_clock::now(), stamp, received_at};
+    fifo_stamps.push_back(fifo_stamp);
 }
 
 size_t Session::get_win() {
     return params.fifo_size - fifo.size();
 }
+
+/* Called once per ADAPT_INTERVAL. What the listener got without asking
+ * twice is its capacity: on heavy loss the session drops to the richest
+ * format that fits it, at least one step. After a run of windows without
+ * a single RETRANSMIT it tries one step up. */
+void Session::adapt_downstream() {
+    uint64_t sent = down_sent;
+    uint64_t resent = down_resent;
+    size_t requests = retransmit_requests;
+    down_sent = down_resent = 0;
+    retransmit_requests = 0;
+
+    /* The first window is partial and holds the catch-up of a new client */
+    if (adapt_windows++ == 0) {
+        return;
+    }
+
+    if (requests == 0) {
+        if (++clean_windows >= ADAPT_CLEAN_WINDOWS && downstream_format != FORMAT_FULL) {
+            clean_windows = 0;
+            LOG(LOG_INFO, "downstream", id, "no losses, switching to %s",
+                format_name((downstream_format_t) (downstream_format - 1)));
+            stats.downstream_upgrades.add();
+            set_downstream_format((downstream_format_t) (downstream_format - 1));
+        }
+        return;
+    }
+    clean_windows = 0;
+    if (sent == 0 || (double) resent / sent <= ADAPT_MAX_LOSS) {
+        return;
+    }
+
+    double delivered = sent > resent ? (double) (sent - resent) / sent : 0;
+    double capacity = delivered * format_rate(downstream_format, format);
+    int lighter = downstream_format + 1;
+    while (lighter < FORMAT_COUNT - 1 && format_rate((downstream_format_t) lighter, format) > capacity) {
+        ++lighter;
+    }
+    if (lighter < FORMAT_COUNT) {
+        LOG(LOG_INFO, "downstream", id, "%llu of %llu DATA resent, switching to %s",
+            (unsigned long long) resent, (unsigned long long) sent,
+            format_name((downstream_format_t) lighter));
+        stats.downstream_downgrades.add();
+        set_downstream_format((downstream_format_t) lighter);
+    }
+}
+
+void Session::set_downstream_format(downstream_format_t format) {
+    stats.sessions_per_format[downstream_format].sub();
+    stats.sessions_per_format[format].add();
+    downstream_format = format;
+}
+
+/* SNAPSHOT */
+
+void Session::save(SnapshotWriter & out) const {
+    out.put_u64(resume_token);
+    out.put_string(tcp_remote_endpoint_str);
+    out.put_u32(report_mode);
+    out.put_u32(mix_minus | multicast << 1 | adaptive << 2);
+    out.put_u32(downstream_format);
+    out.put_string(udp_remote_endpoint.address().to_string());
+    out.put_u32(udp_remote_endpoint.port());
+    out.put_u32(ack);
+    out.put_bytes(fifo);
+    out.put_u32(fifo_state);
+    float gain = operator_gain.load(std::memory_order_relaxed);
+    uint32_t gain_bits;
+    memcpy(&gain_bits, &gain, sizeof(gain));
+    out.put_u32(gain_bits);
+}
+
+void Session::restore(SnapshotReader & in) {
+    resume_token = in.get_u64();
+    tcp_remote_endpoint_str = in.get_string();
+    report_mode = (report_mode_t) in.get_u32();
+    uint32_t flags = in.get_u32();
+    mix_minus = flags & 1;
+    multicast = flags & 2;
+    adaptive = flags & 4;
+    downstream_format = (downstream_format_t) (in.get_u32() % FORMAT_COUNT);
+    auto address = boost::asio::ip::address::from_string(in.get_string());
+    init_udp(udp::endpoint(address, in.get_u32()));
+    ack = in.get_u32();
+    fifo = in.get_bytes();
+    fifo_in_total = fifo.size();
+    if (in.get_u32() == ACTIVE) {
+        fifo_state = ACTIVE; // counted in sessions_active once the server takes it
+    }
+    uint32_t gain_bits = in.get_u32();
+    float gain;
+    memcpy(&gain, &gain_bits, sizeof(gain));
+    operator_gain.store(gain, std::memory_order_relaxed);
+    reset_fifo_stats();
+}
+
+size_t Session::get_tcp_backlog() {
+    size_t backlog = 0;
+    if (tcp_in_flight) {
+        backlog += tcp_in_flight->size();
+    }
+    if (tcp_pending) {
+        backlog += tcp_pending->size();
+    }
+    return backlog;
+}
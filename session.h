@@ -1,11 +1,22 @@
 #ifndef __session_h_
 #define __session_h_
 
+#include <atomic>
 #include <cstdint>
+#include <deque>
+#include <map>
+#include <sstream>
 #include <vector>
 #include <string>
 #include <boost/asio.hpp>
 #include "server_params.h"
+#include "timing_wheel.h"
+#include "stats.h"
+#include "downstream_format.h"
+#include "snapshot.h"
+#include "mixer.h"
+#include "recorder.h"
+#include "latency.h"
 
 using std::shared_ptr;
 using std::string;
@@ -16,23 +27,71 @@ using boost::asio::ip::udp;
 
 enum fifo_state_t { FILLING, ACTIVE };
 
+/* Downstream rate adaptation, see Session::adapt_downstream */
+const unsigned long ADAPT_INTERVAL = 1000;  // ms of DATA per estimate
+const double ADAPT_MAX_LOSS = 0.05;          // resent/sent that steps down
+const size_t ADAPT_CLEAN_WINDOWS = 5;        // windows without RETRANSMIT to step up
+
+/* Loudest-N selection, see Room::select_loudest */
+const double ENERGY_SMOOTHING = 0.2;         // weight of the newest upload
+const double SPEAKER_HYSTERESIS = 2.0;       // energy edge a mixed session keeps (3 dB)
+
+/* Automatic level control, see Session::tick_gain; energies are mean
+ * squares relative to full scale */
+const double AGC_TARGET = 0.01;              // energy aimed at (-20 dBFS)
+const double AGC_NOISE_FLOOR = 1e-5;         // below it the gain is held (-50 dBFS)
+const double AGC_MAX_GAIN = 4.0;             // +12 dB
+const double AGC_MIN_GAIN = 0.1;             // -20 dB
+const double AGC_ATTACK = 0.2;               // per tick, towards a lower gain
+const double AGC_RELEASE = 0.01;             // per tick, towards a higher gain
+
+/* Levels in reports, see Session::update_levels */
+const float LEVEL_FLOOR_DB = -99;            // silence, or nothing mixed
+
+/* Operator gain, set over the stats endpoint */
+const double MIN_GAIN_DB = -60;
+const double MAX_GAIN_DB = 20;
+
+class Room;
+
+/* What a client gets on TCP every report interval:
+ *   REPORT_FULL  -- a line for every UDP session (default),
+ *   REPORT_DELTA -- only lines that changed since the previous report,
+ *                   and "<endpoint> removed" for sessions that are gone;
+ *                   a report opening with a "full" line is a baseline
+ *                   that replaces everything known so far,
+ *   REPORT_SELF  -- its own line and a line of aggregates. */
+enum report_mode_t { REPORT_FULL, REPORT_DELTA, REPORT_SELF };
+
+bool parse_report_mode(const string&, report_mode_t&);
+
 class Session {
 public:
-    Session(uint32_t, ServerParams&, shared_ptr<tcp::socket>);
+    Session(uint32_t, ServerParams&, ServerStats&, shared_ptr<tcp::socket>);
     
-    string get_info();
+    bool update_info(string&);
     string get_datagram_header(uint32_t);
     string get_ack_header();
+    void append_echo(std::stringstream &);
     string get_client_header();
     
     pair<void*, size_t> get_data();
     void consume(size_t);
     void reset_fifo_stats();
-    void reset_alive_stats();
     void init_udp(udp::endpoint);
-    void keepalive();
-    void upload(string);
+    void upload(string, uint64_t stamp = 0, stats_clock::time_point received_at = stats_clock::time_point());
+    void measure_energy(const string &);
+    float tick_gain();
+    void update_levels();
     size_t get_win();
+    size_t get_tcp_backlog();
+    bool mixed_in() const { return fifo_state == ACTIVE && !suspended; }
+    void adapt_downstream();
+    void set_downstream_format(downstream_format_t);
+
+    /* SNAPSHOT -- everything but id and room, which the server handles */
+    void save(SnapshotWriter &) const;
+    void restore(SnapshotReader &);
     
 
     /* Identification */
@@ -40,26 +99,125 @@ public:
 
     /* Parameters */
     ServerParams & params;
+    ServerStats & stats;
 
     /* TCP connection */
     shared_ptr<tcp::socket> tcp_socket_p;
     tcp::endpoint tcp_remote_endpoint;
+    string tcp_remote_endpoint_str;
+
+    /* TCP WRITE QUEUE -- at most one write in flight, one waiting. A newer
+     * report replaces the waiting one. */
+    shared_ptr<string> tcp_in_flight;
+    shared_ptr<string> tcp_pending;
+    size_t tcp_backlogged_reports; // consecutive reports finding a write in flight
+    size_t reports_coalesced;
+
+    /* REPORTS */
+    report_mode_t report_mode;
+    bool needs_full_report; // delta client that hasn't got a baseline
+    string info;            // line from the last report
+    string info_compared;   // info without the meter fields, which change every time
+
+    /* Set and read by the server on its strand; everything below that
+     * concerns UDP and the FIFO belongs to the room's strand. */
+    shared_ptr<Room> room;
+
+    /* RESUMPTION -- a session that lost its client waits detached until
+     * resume_deadline for a new connection presenting the token */
+    uint64_t resume_token;
+    bool detached;
+    stats_clock::time_point resume_deadline;
+    shared_ptr<Session> resumed_as; // on a connection's session: the one it took over
+
+    /* Room's side of detached: the FIFO is frozen and nothing is sent */
+    bool suspended;
 
     /* UDP connection */
     bool uses_udp;
-    udp::endpoint udp_remote_endpoint;
+    udp::endpoint udp_remote_endpoint; // the room's once the session has joined
+    udp::endpoint udp_key;             // the server's: where endpoint_to_session has it
     uint32_t ack;
+    bool ack_pending; // ACK deferred until the next DATA datagram
+    size_t advertised_win; // last win sent
+
+    /* Audio its uploads and remixes are in -- the room's */
+    AudioFormat format;
+
+    /* MULTICAST -- remixes come from the group; only retransmits, ACKs
+     * and window updates are unicast */
+    bool multicast;
+
+    /* MIX-MINUS -- set for a downstream server: it gets the remix without
+     * its own upload, or it would send our mix back to us with itself in it */
+    bool mix_minus;
+    std::map<uint32_t, string> own_remixes;
+
+    /* DOWNSTREAM ADAPTATION -- for clients that said adapt=1. Counts are
+     * per ADAPT_INTERVAL window. */
+    bool adaptive;
+    downstream_format_t downstream_format;
+    uint64_t down_sent;
+    uint64_t down_resent;
+    size_t retransmit_requests;
+    size_t clean_windows;
+    size_t adapt_windows;
+
+    /* LOUDNESS -- mean square of uploaded samples relative to full scale,
+     * smoothed over uploads; kept only with loudest-N selection or AGC
+     * on. speaking: mixed last tick. */
+    double energy;
+    bool speaking;
+
+    /* GAIN -- operator_gain is set on the server strand whenever an
+     * operator asks, and read once per tick on the room's, so a tick is
+     * mixed with one value and neither side locks. agc_gain is the
+     * room's alone. */
+    std::atomic<float> operator_gain;
+    double agc_gain;
+
+    /* LEVELS -- meter is filled by the mixer while the session is mixed
+     * in, and turned into the figures below once per report interval on
+     * the room's strand; the stats endpoint reads those on the server's.
+     * A session held back by loudest-N isn't read, so it meters silent. */
+    mixer_meter meter;
+    std::atomic<float> level_db;   // RMS over the last interval, dBFS
+    std::atomic<float> peak_db;
+    uint64_t clips;                // in the last interval
+    std::atomic<uint64_t> clips_total;
+
+    /* RECORDING -- its input's stream, declared by the room */
+    uint32_t record_stream;
 
     /* FIFO */
     vector<char> fifo;
     fifo_state_t fifo_state;
 
+    /* FIFO LATENCY -- total bytes in and out, and for each upload the
+     * "in" offset it ends at, when it reached the FIFO, and, if its
+     * client stamped it, the stamp and when its datagram came in */
+    struct fifo_stamp_t {
+        uint64_t end;
+        stats_clock::time_point appended_at;
+        uint64_t stamp;
+        stats_clock::time_point received_at;
+    };
+    uint64_t fifo_in_total;
+    uint64_t fifo_out_total;
+    std::deque<fifo_stamp_t> fifo_stamps;
+
+    /* END-TO-END TIMING -- the newest stamped upload mixed, echoed by the
+     * next DATA or ACK; see latency.h */
+    uint64_t echo_stamp; // 0: nothing to echo
+    uint64_t echo_jitter_buffer; // us
+    stats_clock::time_point echo_mixed_at;
+
     /* REPORT STATISTICS */
     size_t fifo_max;
     size_t fifo_min;
     
-    /* KEEPALIVE STATISTICS */
-    bool udp_alive;
+    /* LIVENESS -- position in the server's timing wheel */
+    TimingWheel::entry liveness;
 };
 
 #endif
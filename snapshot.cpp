@@ -0,0 +1,100 @@
+#include <cstdio>
+#include <stdexcept>
+#include "snapshot.h"
+
+
+/* WRITER */
+
+SnapshotWriter::SnapshotWriter(const string & _path)
+    : path(_path),
+      tmp_path(_path + ".tmp"),
+      out(tmp_path.c_str(), std::ios::binary | std::ios::trunc)
+{
+    if (!out) {
+        throw std::runtime_error("can't open " + tmp_path);
+    }
+}
+
+void SnapshotWriter::put_u32(uint32_t value) {
+    unsigned char bytes[4];
+    for (int i = 0; i < 4; ++i) {
+        bytes[i] = value >> (8 * i);
+    }
+    out.write((const char*) bytes, sizeof(bytes));
+}
+
+void SnapshotWriter::put_u64(uint64_t value) {
+    put_u32((uint32_t) value);
+    put_u32((uint32_t) (value >> 32));
+}
+
+void SnapshotWriter::put_string(const string & data) {
+    put_u32(data.size());
+    out.write(data.data(), data.size());
+}
+
+void SnapshotWriter::put_bytes(const vector<char> & data) {
+    put_u32(data.size());
+    out.write(data.data(), data.size());
+}
+
+/* The old snapshot (if any) is replaced only by a complete new one */
+void SnapshotWriter::commit() {
+    out.close();
+    if (out.fail()) {
+        throw std::runtime_error("can't write " + tmp_path);
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        throw std::runtime_error("can't rename " + tmp_path + " to " + path);
+    }
+}
+
+
+/* READER */
+
+SnapshotReader::SnapshotReader(const string & path)
+    : in(path.c_str(), std::ios::binary)
+{
+    if (!in) {
+        throw std::runtime_error("can't open " + path);
+    }
+}
+
+void SnapshotReader::read(void * data, size_t n) {
+    in.read((char*) data, n);
+    if ((size_t) in.gcount() != n) {
+        throw std::runtime_error("snapshot truncated");
+    }
+}
+
+uint32_t SnapshotReader::get_u32() {
+    unsigned char bytes[4];
+    read(bytes, sizeof(bytes));
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) {
+        value |= (uint32_t) bytes[i] << (8 * i);
+    }
+    return value;
+}
+
+uint64_t SnapshotReader::get_u64() {
+    uint64_t low = get_u32();
+    uint64_t high = get_u32();
+    return low | (high << 32);
+}
+
+string SnapshotReader::get_string() {
+    string data(get_u32(), '\0');
+    if (!data.empty()) {
+        read(&data[0], data.size());
+    }
+    return data;
+}
+
+vector<char> SnapshotReader::get_bytes() {
+    vector<char> data(get_u32());
+    if (!data.empty()) {
+        read(data.data(), data.size());
+    }
+    return data;
+}
@@ -0,0 +1,50 @@
+#ifndef __snapshot_h_
+#define __snapshot_h_
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+/* Flat binary file of fixed-width little-endian integers and
+ * length-prefixed byte strings. Both ends throw std::runtime_error on any
+ * failure; a snapshot is either read whole or not used. */
+
+class SnapshotWriter {
+public:
+    /* Writes to path.tmp; commit() renames it over path */
+    SnapshotWriter(const string & path);
+
+    void put_u32(uint32_t);
+    void put_u64(uint64_t);
+    void put_string(const string &);
+    void put_bytes(const vector<char> &);
+    void commit();
+
+private:
+    string path;
+    string tmp_path;
+    std::ofstream out;
+};
+
+class SnapshotReader {
+public:
+    SnapshotReader(const string & path);
+
+    uint32_t get_u32();
+    uint64_t get_u64();
+    string get_string();
+    vector<char> get_bytes();
+
+private:
+    void read(void *, size_t);
+
+    std::ifstream in;
+};
+
+const string SNAPSHOT_MAGIC = "EOGNISKO-SNAPSHOT 3";
+
+#endif
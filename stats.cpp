@@ -0,0 +1,313 @@
+#include <boost/bind.hpp>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <istream>
+#include "stats.h"
+
+namespace asio = boost::asio;
+
+using std::make_shared;
+
+
+/* LATENCY HISTOGRAM */
+
+size_t LatencyHistogram::bucket_of(uint64_t ns) {
+    if (ns < (uint64_t) SUB_BUCKETS) {
+        return ns;
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    size_t sub = (ns >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+    return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub;
+}
+
+/* Largest value falling into the bucket */
+uint64_t LatencyHistogram::bucket_upper(size_t bucket) {
+    if (bucket < (size_t) SUB_BUCKETS) {
+        return bucket;
+    }
+    int exponent = bucket / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+    uint64_t sub = bucket % SUB_BUCKETS;
+    if (exponent >= 62) {
+        return UINT64_MAX;
+    }
+    return ((SUB_BUCKETS + sub + 1) << (exponent - SUB_BUCKET_BITS)) - 1;
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+    counts[bucket_of(ns)].add();
+    total.add();
+    sum_ns.add(ns);
+}
+
+void LatencyHistogram::record(stats_clock::time_point start, stats_clock::time_point end) {
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    record(ns > 0 ? (uint64_t) ns : 0);
+}
+
+uint64_t LatencyHistogram::quantile(double q) const {
+    uint64_t n = total.get();
+    if (n == 0) {
+        return 0;
+    }
+    uint64_t target = (uint64_t) std::ceil(q * n);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < (size_t) BUCKETS; ++i) {
+        seen += counts[i].get();
+        if (seen >= target && seen > 0) {
+            return bucket_upper(i);
+        }
+    }
+    return bucket_upper(BUCKETS - 1);
+}
+
+static void append_metric(string & out, const string & name, const string & labels, double value) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), " %.9g\n", value);
+    out += name;
+    if (!labels.empty()) {
+        out += "{" + labels + "}";
+    }
+    out += buf;
+}
+
+static void append_header(string & out, const string & name, const char * type, const string & help) {
+    out += "# HELP " + name + " " + help + "\n";
+    out += "# TYPE " + name + " " + type + "\n";
+}
+
+/* Exposes power-of-two bucket bounds from 1us to ~17s -- the sub-buckets
+ * only sharpen the quantile gauges written next to the histogram. */
+void LatencyHistogram::write_prometheus(string & out, const string & name, const string & help) const {
+    const int MIN_EXPONENT = 10;
+    const int MAX_EXPONENT = 34;
+
+    string histogram = name + "_seconds";
+    append_header(out, histogram, "histogram", help);
+
+    uint64_t cumulative = 0;
+    size_t bucket = 0;
+    for (int exponent = MIN_EXPONENT; exponent <= MAX_EXPONENT; ++exponent) {
+        uint64_t bound = (uint64_t) 1 << exponent;
+        while (bucket < (size_t) BUCKETS && bucket_upper(bucket) < bound) {
+            cumulative += counts[bucket].get();
+            ++bucket;
+        }
+        char le[32];
+        snprintf(le, sizeof(le), "le=\"%.9g\"", bound / 1e9);
+        append_metric(out, histogram + "_bucket", le, cumulative);
+    }
+    uint64_t count = total.get();
+    append_metric(out, histogram + "_bucket", "le=\"+Inf\"", count);
+    append_metric(out, histogram + "_sum", "", sum_ns.get() / 1e9);
+    append_metric(out, histogram + "_count", "", count);
+
+    string quantiles = name + "_quantile_seconds";
+    append_header(out, quantiles, "gauge", help + " (quantiles)");
+    const double qs[] = {0.5, 0.9, 0.99, 0.999};
+    for (size_t i = 0; i < sizeof(qs) / sizeof(qs[0]); ++i) {
+        char label[32];
+        snprintf(label, sizeof(label), "quantile=\"%g\"", qs[i]);
+        append_metric(out, quantiles, label, quantile(qs[i]) / 1e9);
+    }
+}
+
+
+/* SERVER STATS */
+
+static const char * msg_type_names[MSG_TYPES] = {
+    "CLIENT", "UPLOAD", "RETRANSMIT", "KEEPALIVE", "unknown", "DATA", "ACK", "MDATA"
+};
+
+static void append_per_type(string & out, const string & name, const char * help,
+                            const Counter * counters, int from, int to) {
+    append_header(out, name, "counter", help);
+    for (int type = from; type < to; ++type) {
+        append_metric(out, name, string("type=\"") + msg_type_names[type] + "\"",
+                      counters[type].get());
+    }
+}
+
+static void append_counter(string & out, const string & name, const char * help,
+                           const Counter & counter) {
+    append_header(out, name, "counter", help);
+    append_metric(out, name, "", counter.get());
+}
+
+void ServerStats::write_prometheus(string & out) const {
+    append_per_type(out, "eognisko_udp_packets_in_total", "UDP datagrams received",
+                    packets_in, MSG_CLIENT, MSG_DATA);
+    append_per_type(out, "eognisko_udp_bytes_in_total", "UDP bytes received",
+                    bytes_in, MSG_CLIENT, MSG_DATA);
+    append_per_type(out, "eognisko_udp_packets_out_total", "UDP datagrams sent",
+                    packets_out, MSG_DATA, MSG_TYPES);
+    append_per_type(out, "eognisko_udp_bytes_out_total", "UDP bytes sent",
+                    bytes_out, MSG_DATA, MSG_TYPES);
+
+    append_counter(out, "eognisko_parse_failures_total",
+                   "UDP datagrams with a malformed header", parse_failures);
+    append_counter(out, "eognisko_unknown_endpoint_total",
+                   "UDP datagrams from endpoints without a session", unknown_endpoint);
+
+    append_header(out, "eognisko_upload_rejects_total", "counter", "UPLOADs rejected");
+    append_metric(out, "eognisko_upload_rejects_total", "reason=\"bad_nr\"",
+                  upload_rejects_bad_nr.get());
+    append_metric(out, "eognisko_upload_rejects_total", "reason=\"too_big\"",
+                  upload_rejects_too_big.get());
+
+    append_counter(out, "eognisko_udp_send_drops_total",
+                   "datagrams dropped on a full socket buffer", udp_send_drops);
+    append_counter(out, "eognisko_udp_send_calls_total",
+                   "syscalls that sent UDP datagrams", udp_send_calls);
+    append_counter(out, "eognisko_acks_piggybacked_total",
+                   "ACKs left to the next DATA datagram", acks_piggybacked);
+    append_counter(out, "eognisko_retransmits_served_total",
+                   "DATA datagrams resent on RETRANSMIT", retransmits_served);
+    append_counter(out, "eognisko_fifo_underruns_total",
+                   "ACTIVE FIFOs drained to the low watermark", fifo_underruns);
+    append_counter(out, "eognisko_fifo_overruns_total",
+                   "UPLOADs that filled a FIFO completely", fifo_overruns);
+
+    append_counter(out, "eognisko_inputs_held_back_total",
+                   "session inputs consumed but left out of the mix by loudest-N",
+                   inputs_held_back);
+
+    append_counter(out, "eognisko_record_chunks_total", "chunks written to the recording",
+                   record_chunks);
+    append_counter(out, "eognisko_record_bytes_total", "bytes written to the recording",
+                   record_bytes);
+    append_counter(out, "eognisko_record_drops_total",
+                   "records lost to a full ring or a failed write", record_drops);
+    append_counter(out, "eognisko_trace_drops_total",
+                   "trace records lost to a full ring or a failed write", trace_drops);
+
+    append_counter(out, "eognisko_downstream_downgrades_total",
+                   "sessions switched to a lighter DATA format", downstream_downgrades);
+    append_counter(out, "eognisko_downstream_upgrades_total",
+                   "sessions switched back to a richer DATA format", downstream_upgrades);
+    append_header(out, "eognisko_sessions_per_format", "gauge", "UDP sessions by DATA format");
+    for (int format = 0; format < FORMAT_COUNT; ++format) {
+        append_metric(out, "eognisko_sessions_per_format",
+                      string("format=\"") + format_name((downstream_format_t) format) + "\"",
+                      sessions_per_format[format].get());
+    }
+
+    append_counter(out, "eognisko_sessions_resumed_total",
+                   "detached sessions taken over by a reconnecting client", sessions_resumed);
+    append_counter(out, "eognisko_resume_expired_total",
+                   "detached sessions removed at the end of the grace period", resume_expired);
+
+    append_counter(out, "eognisko_tcp_bytes_out_total",
+                   "TCP bytes queued (CLIENT and reports)", tcp_bytes_out);
+    append_counter(out, "eognisko_reports_coalesced_total",
+                   "unsent reports replaced by newer ones", reports_coalesced);
+    append_counter(out, "eognisko_backlog_disconnects_total",
+                   "sessions dropped for TCP report backlog", backlog_disconnects);
+
+    receive_to_fifo.write_prometheus(out, "eognisko_receive_to_fifo",
+                                     "UDP receive to FIFO append latency");
+    fifo_to_mix.write_prometheus(out, "eognisko_fifo_to_mix",
+                                 "time uploaded data waits in the FIFO before it is mixed");
+    mix_to_send.write_prometheus(out, "eognisko_mix_to_send",
+                                 "mix to DATA send completion latency");
+}
+
+
+/* STATS ENDPOINT */
+
+struct StatsEndpoint::Connection {
+    Connection(asio::io_service & io_service) : socket(io_service) {}
+
+    tcp::socket socket;
+    asio::streambuf request;
+    string response;
+};
+
+StatsEndpoint::StatsEndpoint(asio::io_service & _io_service,
+                             asio::io_service::strand & _strand,
+                             uint16_t port,
+                             std::function<string()> _render)
+    : io_service(_io_service),
+      strand(_strand),
+      acceptor(io_service, tcp::endpoint(asio::ip::address_v4::loopback(), port)),
+      render(_render)
+{
+    accept();
+}
+
+void StatsEndpoint::control(const string & path, control_handler_t handler) {
+    controls[path] = handler;
+}
+
+void StatsEndpoint::accept() {
+    auto connection_p = make_shared<Connection>(io_service);
+    acceptor.async_accept(
+        connection_p->socket,
+        boost::bind(
+            &StatsEndpoint::handle_accept,
+            this,
+            asio::placeholders::error,
+            connection_p)
+    );
+}
+
+void StatsEndpoint::handle_accept(const boost::system::error_code& ec,
+                                  shared_ptr<Connection> connection_p) {
+    accept();
+    if (ec) {
+        return;
+    }
+    asio::async_read_until(
+        connection_p->socket,
+        connection_p->request,
+        "\r\n\r\n",
+        strand.wrap(boost::bind(
+            &StatsEndpoint::handle_read_request,
+            this,
+            asio::placeholders::error,
+            asio::placeholders::bytes_transferred,
+            connection_p))
+    );
+}
+
+void StatsEndpoint::handle_read_request(const boost::system::error_code& ec, size_t n,
+                                        shared_ptr<Connection> connection_p) {
+    if (ec) {
+        return;
+    }
+    std::istream request(&connection_p->request);
+    string method, target;
+    request >> method >> target;
+    size_t question = target.find('?');
+    auto control_it = controls.find(target.substr(0, question));
+
+    string body;
+    int status = 200;
+    if (control_it != controls.end()) {
+        string query = question == string::npos ? string() : target.substr(question + 1);
+        status = control_it->second(query, body);
+    } else {
+        body = render();
+    }
+    connection_p->response =
+        "HTTP/1.0 " + std::to_string(status) + (status == 200 ? " OK" : " Error") + "\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: " + std::to_string(body.size()) + "\r\n"
+        "\r\n" + body;
+    asio::async_write(
+        connection_p->socket,
+        asio::buffer(connection_p->response),
+        boost::bind(
+            &StatsEndpoint::handle_write_response,
+            this,
+            asio::placeholders::error,
+            asio::placeholders::bytes_transferred,
+            connection_p)
+    );
+}
+
+void StatsEndpoint::handle_write_response(const boost::system::error_code& ec, size_t n,
+                                          shared_ptr<Connection> connection_p) {
+    boost::system::error_code ignored;
+    connection_p->socket.shutdown(tcp::socket::shutdown_both, ignored);
+}
@@ -0,0 +1,147 @@
+#ifndef __stats_h_
+#define __stats_h_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <boost/asio.hpp>
+#include "downstream_format.h"
+
+using std::string;
+using std::shared_ptr;
+using boost::asio::ip::tcp;
+
+typedef std::chrono::steady_clock stats_clock;
+
+/* Relaxed atomic counter -- no ordering, just a lock-free add, so it is
+ * cheap enough to bump on every packet. */
+class Counter {
+public:
+    Counter() : value(0) {}
+
+    void add(uint64_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+    void sub(uint64_t n = 1) { value.fetch_sub(n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value;
+};
+
+/* Latency histogram in the spirit of HdrHistogram: values (ns) are bucketed
+ * by power of two, each power split into SUB_BUCKETS linear sub-buckets,
+ * which keeps relative error under 25% with a fixed, small array. */
+class LatencyHistogram {
+public:
+    static const int SUB_BUCKET_BITS = 2;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int BUCKETS = 64 * SUB_BUCKETS;
+
+    void record(uint64_t ns);
+    void record(stats_clock::time_point start, stats_clock::time_point end);
+    uint64_t quantile(double q) const;
+    void write_prometheus(string & out, const string & name, const string & help) const;
+
+private:
+    static size_t bucket_of(uint64_t ns);
+    static uint64_t bucket_upper(size_t bucket);
+
+    Counter counts[BUCKETS];
+    Counter total;
+    Counter sum_ns;
+};
+
+/* Message types counted on the UDP path */
+enum stats_msg_t {
+    MSG_CLIENT, MSG_UPLOAD, MSG_RETRANSMIT, MSG_KEEPALIVE, MSG_UNKNOWN,
+    MSG_DATA, MSG_ACK, MSG_MDATA,
+    MSG_TYPES
+};
+
+struct ServerStats {
+    /* UDP traffic */
+    Counter packets_in[MSG_TYPES];
+    Counter bytes_in[MSG_TYPES];
+    Counter packets_out[MSG_TYPES];
+    Counter bytes_out[MSG_TYPES];
+    Counter parse_failures;
+    Counter unknown_endpoint;
+    Counter udp_send_drops; // socket buffer full
+    Counter udp_send_calls; // sendmsg, sendmmsg or io_uring_enter
+
+    /* Uploads and retransmits */
+    Counter upload_rejects_bad_nr;
+    Counter upload_rejects_too_big;
+    Counter acks_piggybacked;
+    Counter retransmits_served;
+
+    /* Downstream adaptation */
+    Counter downstream_downgrades;
+    Counter downstream_upgrades;
+    Counter sessions_per_format[FORMAT_COUNT]; // UDP sessions, used as gauges
+
+    /* Resumption */
+    Counter sessions_resumed;
+    Counter resume_expired;
+
+    /* FIFOs */
+    Counter sessions_active;
+    Counter fifo_underruns; // ACTIVE fifo ran down to the low watermark
+    Counter fifo_overruns;  // upload left no window at all
+
+    /* Loudest-N */
+    Counter inputs_held_back; // consumed without being mixed
+
+    /* Recording */
+    Counter record_chunks;
+    Counter record_bytes;
+    Counter record_drops; // ticks not recorded: ring full or write failed
+    Counter trace_drops;  // likewise for --trace
+
+    /* TCP reports */
+    Counter tcp_bytes_out;
+    Counter reports_coalesced;
+    Counter backlog_disconnects;
+
+    /* Latencies */
+    LatencyHistogram receive_to_fifo;
+    LatencyHistogram fifo_to_mix;
+    LatencyHistogram mix_to_send;
+
+    void write_prometheus(string & out) const;
+};
+
+/* Operator command on the stats endpoint: gets the query string, fills
+ * in the response body, returns the HTTP status */
+typedef std::function<int(const string &, string &)> control_handler_t;
+
+/* Serves Prometheus text on localhost over plain HTTP/1.0. Whatever is
+ * requested, the response is render()'s output, called on the given
+ * strand -- unless the path is one set with control(), whose handler
+ * then runs there instead. */
+class StatsEndpoint {
+public:
+    StatsEndpoint(boost::asio::io_service &, boost::asio::io_service::strand &,
+                  uint16_t port, std::function<string()> render);
+
+    void control(const string & path, control_handler_t);
+
+private:
+    struct Connection;
+
+    void accept();
+    void handle_accept(const boost::system::error_code&, shared_ptr<Connection>);
+    void handle_read_request(const boost::system::error_code&, size_t, shared_ptr<Connection>);
+    void handle_write_response(const boost::system::error_code&, size_t, shared_ptr<Connection>);
+
+    boost::asio::io_service & io_service;
+    boost::asio::io_service::strand & strand;
+    tcp::acceptor acceptor;
+    std::function<string()> render;
+    std::map<string, control_handler_t> controls;
+};
+
+#endif
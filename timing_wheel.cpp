@@ -0,0 +1,43 @@
+#include "timing_wheel.h"
+
+
+TimingWheel::TimingWheel(size_t slots_count)
+    : slots(slots_count > 0 ? slots_count : 1),
+      current(0) {}
+
+void TimingWheel::insert(entry& e, uint32_t id) {
+    if (e.linked) {
+        refresh(e);
+        return;
+    }
+    e.slot = current;
+    e.pos = slots[current].insert(slots[current].end(), id);
+    e.linked = true;
+}
+
+void TimingWheel::refresh(entry& e) {
+    if (!e.linked || e.slot == current) {
+        return;
+    }
+    /* splice keeps e.pos valid, no allocation involved */
+    slots[current].splice(slots[current].end(), slots[e.slot], e.pos);
+    e.slot = current;
+}
+
+void TimingWheel::erase(entry& e) {
+    if (!e.linked) {
+        return;
+    }
+    slots[e.slot].erase(e.pos);
+    e.linked = false;
+}
+
+/* Moves to the next tick. The slot we land on holds ids that were last
+ * refreshed a full revolution ago -- they are detached and returned. The
+ * caller must mark their entries as unlinked before dropping them. */
+list<uint32_t> TimingWheel::advance() {
+    current = (current + 1) % slots.size();
+    list<uint32_t> expired;
+    expired.swap(slots[current]);
+    return expired;
+}
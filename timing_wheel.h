@@ -0,0 +1,39 @@
+#ifndef __timing_wheel_h_
+#define __timing_wheel_h_
+
+#include <cstdint>
+#include <cstddef>
+#include <list>
+#include <vector>
+
+using std::list;
+using std::vector;
+
+/* Hashed timing wheel for session liveness.
+ *
+ * Every tracked id sits in the slot of the tick it was last refreshed in.
+ * Refreshing moves it to the current slot in O(1), advancing the wheel
+ * hands back everything that was not refreshed for a full revolution. */
+class TimingWheel {
+public:
+    struct entry {
+        entry() : slot(0), linked(false) {}
+
+        size_t slot;
+        list<uint32_t>::iterator pos;
+        bool linked;
+    };
+
+    TimingWheel(size_t slots_count);
+
+    void insert(entry&, uint32_t id);
+    void refresh(entry&);
+    void erase(entry&);
+    list<uint32_t> advance();
+
+private:
+    vector<list<uint32_t>> slots;
+    size_t current;
+};
+
+#endif
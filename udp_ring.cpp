@@ -0,0 +1,372 @@
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "udp_ring.h"
+#include "logger.h"
+
+
+namespace asio = boost::asio;
+
+const uint64_t RECV_TAG = 1ULL << 63; // user_data of the receive; sends carry their slot
+
+static int io_uring_setup(unsigned entries, struct io_uring_params * p) {
+    return (int) ::syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int) ::syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int ring_fd, unsigned opcode, void * arg, unsigned nr_args) {
+    return (int) ::syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static std::runtime_error uring_error(const string & what) {
+    return std::runtime_error("io_uring: " + what + ": " + strerror(errno));
+}
+
+
+UdpRing::UdpRing(int _fd, asio::io_service & io_service, asio::io_service::strand & _strand,
+                 ServerStats & _stats, receive_handler_t _on_receive,
+                 std::function<void()> _on_failure)
+    : fd(_fd),
+      strand(_strand),
+      stats(_stats),
+      on_receive(_on_receive),
+      on_failure(_on_failure),
+      ring_fd(-1),
+      ring_mem(MAP_FAILED),
+      ring_size(0),
+      sqes((struct io_uring_sqe*) MAP_FAILED),
+      sqes_size(0),
+      sqe_tail(0),
+      buf_ring((struct io_uring_buf_ring*) MAP_FAILED),
+      buf_ring_size(URING_RECV_BUFFERS * sizeof(struct io_uring_buf)),
+      buf_tail(0),
+      recv_arena(URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE),
+      slots(URING_SEND_SLOTS),
+      drain_posted(false),
+      event_descriptor(io_service),
+      event_count(0)
+{
+    /* Every send in flight and every receive buffer can hold a
+     * completion at once: the CQ never overflows */
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = 2 * URING_ENTRIES;
+    ring_fd = io_uring_setup(URING_ENTRIES, &p);
+    if (ring_fd < 0) {
+        throw uring_error("setup");
+    }
+    try {
+        if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+            errno = ENOSYS;
+            throw uring_error("no single mmap");
+        }
+        ring_size = std::max(p.sq_off.array + p.sq_entries * sizeof(unsigned),
+                             p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+        ring_mem = ::mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring_fd, IORING_OFF_SQ_RING);
+        if (ring_mem == MAP_FAILED) {
+            throw uring_error("mmap rings");
+        }
+        sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = (struct io_uring_sqe*) ::mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+                                             MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            throw uring_error("mmap sqes");
+        }
+        char * base = (char*) ring_mem;
+        sq_head = (unsigned*) (base + p.sq_off.head);
+        sq_tail = (unsigned*) (base + p.sq_off.tail);
+        sq_array = (unsigned*) (base + p.sq_off.array);
+        sq_mask = *(unsigned*) (base + p.sq_off.ring_mask);
+        sq_entries = p.sq_entries;
+        sqe_tail = *sq_tail;
+        cq_head = (unsigned*) (base + p.cq_off.head);
+        cq_tail = (unsigned*) (base + p.cq_off.tail);
+        cq_flags = (unsigned*) (base + p.cq_off.flags);
+        cq_mask = *(unsigned*) (base + p.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe*) (base + p.cq_off.cqes);
+        for (unsigned i = 0; i < sq_entries; ++i) {
+            sq_array[i] = i;
+        }
+
+        /* The kernel picks a receive buffer per datagram from this ring */
+        buf_ring = (struct io_uring_buf_ring*) ::mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE,
+                                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf_ring == MAP_FAILED) {
+            throw uring_error("mmap buffer ring");
+        }
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t) buf_ring;
+        reg.ring_entries = URING_RECV_BUFFERS;
+        reg.bgid = 0;
+        if (io_uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            throw uring_error("register buffer ring");
+        }
+        for (uint16_t i = 0; i < URING_RECV_BUFFERS; ++i) {
+            recycle(i);
+        }
+
+        int event_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event_fd < 0) {
+            throw uring_error("eventfd");
+        }
+        event_descriptor.assign(event_fd);
+        if (io_uring_register(ring_fd, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0) {
+            throw uring_error("register eventfd");
+        }
+    } catch (...) {
+        release();
+        throw;
+    }
+
+    for (uint32_t i = 0; i < URING_SEND_SLOTS; ++i) {
+        free_slots.push_back(URING_SEND_SLOTS - 1 - i);
+    }
+    memset(&recv_msg, 0, sizeof(recv_msg));
+    recv_msg.msg_namelen = sizeof(struct sockaddr_in6);
+
+    {
+        std::lock_guard<std::mutex> lock(ring_mutex);
+        arm_receive();
+        submit();
+    }
+    wait_for_completions();
+}
+
+UdpRing::~UdpRing() {
+    release();
+}
+
+void UdpRing::release() {
+    boost::system::error_code ignored;
+    event_descriptor.close(ignored);
+    if (ring_fd >= 0) {
+        ::close(ring_fd);
+    }
+    if (buf_ring != MAP_FAILED) {
+        ::munmap(buf_ring, buf_ring_size);
+    }
+    if (sqes != MAP_FAILED) {
+        ::munmap(sqes, sqes_size);
+    }
+    if (ring_mem != MAP_FAILED) {
+        ::munmap(ring_mem, ring_size);
+    }
+}
+
+/* SENDING */
+
+/* One io_uring_enter per call, however many datagrams, unless the slots
+ * run out midway. A slot swaps its buffer with the datagram's, so nothing
+ * is copied twice. Send completions are reaped here rather than woken up
+ * for: a UDP send completes during the enter. */
+void UdpRing::send(outgoing_datagram_t * datagrams, size_t count) {
+    std::lock_guard<std::mutex> lock(ring_mutex);
+    __atomic_store_n(cq_flags, *cq_flags | IORING_CQ_EVENTFD_DISABLED, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < count; ++i) {
+        if (free_slots.empty()) {
+            submit();
+            reap();
+            if (free_slots.empty()) {
+                stats.udp_send_drops.add();
+                continue;
+            }
+        }
+        uint32_t slot_nr = free_slots.back();
+        free_slots.pop_back();
+
+        outgoing_datagram_t & datagram = datagrams[i];
+        Slot & slot = slots[slot_nr];
+        slot.endpoint = datagram.endpoint;
+        slot.data.swap(datagram.data);
+        slot.iov.iov_base = (void*) slot.data.data();
+        slot.iov.iov_len = slot.data.size();
+        memset(&slot.msg, 0, sizeof(slot.msg));
+        slot.msg.msg_name = slot.endpoint.data();
+        slot.msg.msg_namelen = slot.endpoint.size();
+        slot.msg.msg_iov = &slot.iov;
+        slot.msg.msg_iovlen = 1;
+
+        struct io_uring_sqe * sqe = next_sqe();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t) &slot.msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_DONTWAIT;
+        sqe->user_data = slot_nr;
+    }
+    submit();
+    /* Completions posted while the eventfd was off are caught here */
+    __atomic_store_n(cq_flags, *cq_flags & ~IORING_CQ_EVENTFD_DISABLED, __ATOMIC_RELEASE);
+    reap();
+}
+
+/* Callers hold ring_mutex */
+struct io_uring_sqe * UdpRing::next_sqe() {
+    if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+        submit();
+    }
+    struct io_uring_sqe * sqe = &sqes[sqe_tail & sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ++sqe_tail;
+    return sqe;
+}
+
+void UdpRing::submit() {
+    __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit == 0) {
+        return;
+    }
+    stats.udp_send_calls.add();
+    if (io_uring_enter(ring_fd, to_submit, 0, 0) < 0 && errno != EINTR) {
+        LOG(LOG_WARN, "send_udp", LOG_NO_CLIENT, "io_uring_enter failed: %s", strerror(errno));
+    }
+}
+
+/* Frees the slots of finished sends; receives are left for the strand.
+ * Callers hold ring_mutex. */
+void UdpRing::reap() {
+    unsigned head = *cq_head;
+    unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        const struct io_uring_cqe & cqe = cqes[head & cq_mask];
+        if (cqe.user_data == RECV_TAG) {
+            pending_receives.push_back(cqe);
+            continue;
+        }
+        free_slots.push_back((uint32_t) cqe.user_data);
+        if (cqe.res == -EAGAIN) {
+            stats.udp_send_drops.add();
+        } else if (cqe.res < 0) {
+            LOG(LOG_WARN, "send_udp", LOG_NO_CLIENT, "sendmsg failed: %s", strerror(-cqe.res));
+        }
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    if (!pending_receives.empty() && !drain_posted) {
+        drain_posted = true;
+        strand.post(boost::bind(&UdpRing::drain, this));
+    }
+}
+
+/* RECEIVING */
+
+/* One submission for as long as buffers last. Callers hold ring_mutex. */
+void UdpRing::arm_receive() {
+    struct io_uring_sqe * sqe = next_sqe();
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) &recv_msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = RECV_TAG;
+}
+
+void UdpRing::wait_for_completions() {
+    event_descriptor.async_read_some(
+        asio::buffer(&event_count, sizeof(event_count)),
+        strand.wrap(boost::bind(
+            &UdpRing::handle_completions,
+            this,
+            asio::placeholders::error)));
+}
+
+void UdpRing::handle_completions(const boost::system::error_code & ec) {
+    if (ec == asio::error::operation_aborted) {
+        return;
+    }
+    if (ec) {
+        LOG(LOG_WARN, "receive_udp", LOG_NO_CLIENT, "error on io_uring eventfd: %s",
+            ec.message().c_str());
+    }
+    drain();
+    wait_for_completions();
+}
+
+/* On the strand */
+void UdpRing::drain() {
+    vector<struct io_uring_cqe> completions;
+    {
+        std::lock_guard<std::mutex> lock(ring_mutex);
+        reap();
+        completions.swap(pending_receives);
+        drain_posted = false;
+    }
+    bool rearm = false;
+    bool failed = false;
+    for (auto it = completions.begin(); it != completions.end(); ++it) {
+        receive_completed(*it);
+        if (!(it->flags & IORING_CQE_F_MORE)) {
+            if (it->res == -EINVAL || it->res == -EOPNOTSUPP) {
+                failed = true;
+            } else {
+                rearm = true;
+            }
+        }
+    }
+    if (failed) {
+        on_failure();
+    } else if (rearm) {
+        std::lock_guard<std::mutex> lock(ring_mutex);
+        arm_receive();
+        submit();
+    }
+}
+
+/* The buffer holds io_uring_recvmsg_out, the sender's address in the
+ * room recv_msg left for it, then the datagram */
+void UdpRing::receive_completed(const struct io_uring_cqe & cqe) {
+    if (cqe.res < 0) {
+        /* Out of buffers: datagrams wait in the socket until the rearm */
+        if (cqe.res != -ENOBUFS && cqe.res != -EINVAL && cqe.res != -EOPNOTSUPP) {
+            LOG(LOG_WARN, "receive_udp", LOG_NO_CLIENT, "io_uring recvmsg failed: %s",
+                strerror(-cqe.res));
+        }
+        return;
+    }
+    if (!(cqe.flags & IORING_CQE_F_BUFFER)) {
+        return;
+    }
+    uint16_t buffer = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    const char * base = &recv_arena[buffer * URING_RECV_BUFFER_SIZE];
+    struct io_uring_recvmsg_out out;
+    memcpy(&out, base, sizeof(out));
+    const char * name = base + sizeof(out);
+    const char * payload = name + recv_msg.msg_namelen + recv_msg.msg_controllen;
+
+    if (out.flags & MSG_TRUNC || out.namelen > recv_msg.msg_namelen) {
+        LOG(LOG_WARN, "receive_udp", LOG_NO_CLIENT, "dropped a truncated datagram of %u bytes",
+            out.payloadlen);
+    } else {
+        udp::endpoint endpoint;
+        memcpy(endpoint.data(), name, out.namelen);
+        endpoint.resize(out.namelen);
+        on_receive(endpoint, payload, out.payloadlen);
+    }
+    recycle(buffer);
+}
+
+/* Entries are indexed by hand: in C++ the header's flexible bufs array
+ * lands past the tail it should overlay */
+void UdpRing::recycle(uint16_t buffer) {
+    struct io_uring_buf & buf =
+        ((struct io_uring_buf*) buf_ring)[buf_tail & (URING_RECV_BUFFERS - 1)];
+    buf.addr = (uint64_t) &recv_arena[buffer * URING_RECV_BUFFER_SIZE];
+    buf.len = URING_RECV_BUFFER_SIZE;
+    buf.bid = buffer;
+    ++buf_tail;
+    __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
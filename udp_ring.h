@@ -0,0 +1,124 @@
+#ifndef __udp_ring_h_
+#define __udp_ring_h_
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <boost/asio.hpp>
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "stats.h"
+
+using std::string;
+using std::vector;
+using boost::asio::ip::udp;
+
+const unsigned URING_ENTRIES = 1024;          // submission queue; completions get twice that
+const unsigned URING_RECV_BUFFERS = 64;       // power of two
+const size_t URING_RECV_BUFFER_SIZE = 65536 + 128; // any datagram, its address and the kernel's header
+const size_t URING_SEND_SLOTS = 1024;
+
+/* A datagram waiting in a batch, header and payload copied into data:
+ * what they came from may be gone by the time the batch is sent */
+struct outgoing_datagram_t {
+    udp::endpoint endpoint;
+    string data;
+};
+
+/* One UDP socket's traffic through io_uring, on raw syscalls.
+ *
+ * Receiving is a single multishot RECVMSG into a ring of buffers
+ * registered with the kernel, which picks one per datagram: a steady
+ * stream needs no submission at all. Completions are signalled on an
+ * eventfd that asio waits on, and reaped on the given strand, where
+ * received datagrams go to the handler and their buffers straight back
+ * to the ring.
+ *
+ * Sending copies each datagram into a preallocated slot (SENDMSG can't
+ * take registered buffers) and submits a whole batch with one
+ * io_uring_enter. Sends are MSG_DONTWAIT, so a full socket buffer drops
+ * the datagram, as with sendmsg.
+ *
+ * Throws std::runtime_error if the kernel can't do any of it. */
+class UdpRing {
+public:
+    typedef std::function<void(const udp::endpoint &, const char *, size_t)> receive_handler_t;
+
+    /* on_failure is called, on the strand, if receiving stops for good */
+    UdpRing(int fd, boost::asio::io_service &, boost::asio::io_service::strand &,
+            ServerStats &, receive_handler_t on_receive, std::function<void()> on_failure);
+    ~UdpRing();
+
+    /* Safe from any thread; takes the datagrams' data, leaving buffers
+     * of the same capacity in its place */
+    void send(outgoing_datagram_t *, size_t count);
+
+private:
+    struct Slot {
+        udp::endpoint endpoint;
+        string data;
+        struct iovec iov;
+        struct msghdr msg;
+    };
+
+    void release();
+    void arm_receive();
+    struct io_uring_sqe * next_sqe();
+    void submit();
+    void reap();
+    void wait_for_completions();
+    void handle_completions(const boost::system::error_code &);
+    void drain();
+    void receive_completed(const struct io_uring_cqe &);
+    void recycle(uint16_t buffer);
+
+    int fd;
+    boost::asio::io_service::strand & strand;
+    ServerStats & stats;
+    receive_handler_t on_receive;
+    std::function<void()> on_failure;
+
+    /* RING -- mapped from the kernel */
+    int ring_fd;
+    void * ring_mem;
+    size_t ring_size;
+    struct io_uring_sqe * sqes;
+    size_t sqes_size;
+    unsigned * sq_head;
+    unsigned * sq_tail;
+    unsigned * sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;
+    unsigned * cq_head;
+    unsigned * cq_tail;
+    unsigned * cq_flags;
+    unsigned cq_mask;
+    struct io_uring_cqe * cqes;
+
+    /* RECEIVING -- the provided buffer ring and its buffers; recycled on
+     * the strand only */
+    struct io_uring_buf_ring * buf_ring;
+    size_t buf_ring_size;
+    uint16_t buf_tail;
+    vector<char> recv_arena;
+    struct msghdr recv_msg;
+
+    /* Everything below is shared by the senders and the strand */
+    std::mutex ring_mutex;
+
+    /* SENDING */
+    vector<Slot> slots;
+    vector<uint32_t> free_slots;
+
+    /* COMPLETIONS -- receives reaped by a sender wait for the strand */
+    vector<struct io_uring_cqe> pending_receives;
+    bool drain_posted;
+    boost::asio::posix::stream_descriptor event_descriptor;
+    uint64_t event_count;
+};
+
+#endif
@@ -0,0 +1,91 @@
+#include <chrono>
+#include <boost/bind.hpp>
+#include "upstream.h"
+#include "client.h"
+#include "logger.h"
+
+
+const int RECONNECT_DELAY = 800; // ms, as runclient
+
+
+Upstream::Upstream(string _server_name, uint16_t _port, string _room,
+                   std::function<void(const string &)> _on_data)
+    : server_name(_server_name),
+      port(_port),
+      room(_room),
+      on_data(_on_data),
+      current_io(nullptr),
+      current_client(nullptr),
+      stopping(false),
+      thread(&Upstream::run, this) {}
+
+Upstream::~Upstream() {
+    stopping = true;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (current_io) {
+            current_io->stop();
+        }
+    }
+    thread.join();
+}
+
+void Upstream::feed(const string & data) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (current_io) {
+        current_io->post(boost::bind(&Client::feed_input, current_client, data));
+    }
+}
+
+/* A fresh io_service per connection: handlers left over from a dead
+ * Client never run against the next one. Its state is carried over, as
+ * in runclient, so the parent resumes our session. */
+void Upstream::run() {
+    ClientParams params;
+    params.server_name = server_name;
+    params.port = port;
+    params.retransmit_limit = DEFAULT_RETRANSMIT_LIMIT;
+    params.report_mode = "self";
+    params.room = room;
+    params.format = ""; // the parent's room must mix what ours does
+    params.mix_minus = true;
+    params.multicast = false;
+    params.adapt = false;
+    params.latency_interval = 0;
+    params.use_stdio = false;
+
+    ClientResumeState state;
+    while (!stopping) {
+        state.connected = false;
+        try {
+            boost::asio::io_service io_service;
+            Client client(params, io_service, state);
+            client.on_data = on_data;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping) {
+                    break;
+                }
+                current_io = &io_service;
+                current_client = &client;
+            }
+            io_service.run();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                current_io = nullptr;
+                current_client = nullptr;
+            }
+            state = client.get_resume_state();
+        } catch (std::exception & e) {
+            LOG(LOG_ERROR, "upstream", LOG_NO_CLIENT, "upstream link failed: %s", e.what());
+        }
+        LOG(LOG_WARN, "upstream", LOG_NO_CLIENT, "upstream link to %s:%u down, reconnecting",
+            server_name.c_str(), port);
+        if (state.connected) {
+            continue; // resume at once
+        }
+        for (int waited = 0; waited < RECONNECT_DELAY && !stopping; waited += 50) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+    }
+}
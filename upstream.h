@@ -0,0 +1,48 @@
+#ifndef __upstream_h_
+#define __upstream_h_
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <boost/asio.hpp>
+
+using std::string;
+
+class Client;
+
+/* Link to a parent server: a Client, just like runclient's, with the local
+ * mix as its input. It runs on its own io_service and thread, so
+ * connecting (and reconnecting after the parent goes away) never blocks
+ * the server's workers.
+ *
+ * The parent is asked for mix-minus, so what it sends down -- handed to
+ * on_data on the link's thread -- holds everyone but us. */
+class Upstream
+{
+public:
+    Upstream(string server_name, uint16_t port, string room,
+             std::function<void(const string &)> on_data);
+    ~Upstream();
+
+    /* Safe from any thread; dropped while the link is down */
+    void feed(const string &);
+
+private:
+    void run();
+
+    string server_name;
+    uint16_t port;
+    string room;
+    std::function<void(const string &)> on_data;
+
+    std::mutex mutex;
+    boost::asio::io_service * current_io;
+    Client * current_client;
+
+    std::atomic<bool> stopping;
+    std::thread thread;
+};
+
+#endif